@@ -1,10 +1,159 @@
 #ifndef _BENCH_H_
 #define _BENCH_H_
 
-#define BENCH_OP_UPLOAD     0
-#define BENCH_OP_DOWNLOAD   1
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rho/rho.h>
+#include <rpc.h>
+#include <rpc_aead.h>
+#include <rpc_hugemem.h>
+
+/* BENCH_OP_UPLOAD, BENCH_OP_DOWNLOAD, and their stubs are generated */
+#include "bench_rpc.h"
 
 #define BENCH_1MB   1048576U
 #define BENCH_MAX_PAYLOAD_SIZE  (10 * BENCH_1MB)
 
+/* how long a server stops accepting when accept(2) runs out of memory */
+#define BENCH_ACCEPT_BACKOFF_MS 10
+
+/*
+ * The payload buffer that bodies are copied from and to; with huge, it is
+ * backed by huge pages (see rpc_hugemem.h), and already faulted in.  Which
+ * kind of pages it got is logged at debug level to log, or with rho_debug
+ * if log is NULL.
+ */
+static inline uint8_t *
+bench_payload_alloc(bool huge, struct rho_log *log)
+{
+    uint8_t *p = NULL;
+    int kind = RPC_HUGEMEM_NONE;
+
+    if (!huge)
+        return (rhoL_zalloc(BENCH_MAX_PAYLOAD_SIZE));
+
+    p = rpc_hugemem_alloc(BENCH_MAX_PAYLOAD_SIZE, &kind);
+    if (p == NULL)
+        rho_errno_die(errno, "can't map the payload buffer");
+    if (log != NULL)
+        rho_log_debug(log, "payload buffer: %s",
+                rpc_hugemem_kind_to_str(kind));
+    else
+        rho_debug("payload buffer: %s", rpc_hugemem_kind_to_str(kind));
+    return (p);
+}
+
+static inline void
+bench_payload_free(uint8_t *p, bool huge)
+{
+    if (huge)
+        rpc_hugemem_free(p, BENCH_MAX_PAYLOAD_SIZE);
+    else
+        rhoL_free(p);
+}
+
+/* the cipher named by -A, or die */
+static inline int
+bench_aead_cipher(const char *name)
+{
+    int cipher = rpc_aead_cipher_from_str(name);
+
+    if (cipher == -1)
+        rho_die("unknown AEAD cipher \"%s\" (try aes-128-gcm, "
+                "aes-256-gcm, or chacha20-poly1305)", name);
+    return (cipher);
+}
+
+/* read the pre-shared key for cipher (-K) from the start of path */
+static inline void
+bench_aead_key_load(const char *path, int cipher, uint8_t *key)
+{
+    FILE *fp = NULL;
+    size_t keylen = rpc_aead_keylen(cipher);
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        rho_errno_die(errno, "can't open key file \"%s\"", path);
+    if (fread(key, 1, keylen, fp) != keylen)
+        rho_die("key file \"%s\" is shorter than %zu bytes", path, keylen);
+    fclose(fp);
+}
+
+/*
+ * Put agent in AEAD record mode (see rpc_aead.h), with a key exported from
+ * its TLS session if it has one (its handshake must be done), and psk
+ * otherwise.
+ */
+static inline int
+bench_aead_enable(struct rpc_agent *agent, int cipher, const uint8_t *psk,
+        bool initiator)
+{
+    if (agent->ra_sock->ssl != NULL)
+        return (rpc_agent_set_aead_from_tls(agent, cipher));
+    else
+        return (rpc_agent_set_aead(agent, cipher, psk,
+                    rpc_aead_keylen(cipher), initiator));
+}
+
+/*
+ * A server's spare fd: held open so that, out of fds, it can be given up to
+ * accept a pending connection and close it (bench_accept_shed).
+ */
+static inline int
+bench_spare_fd_open(void)
+{
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        rho_errno_die(errno, "can't open the spare fd (/dev/null)");
+    return (fd);
+}
+
+/*
+ * Out of fds (EMFILE or ENFILE), the pending connection on the listening
+ * socket lfd can't be accepted, and, left in the queue, would keep lfd
+ * ready: give up *spare_fd to accept it, close it, and take the spare
+ * back.  Without the spare, every later shortage would spin, so failing
+ * to take it back is fatal.
+ */
+static inline void
+bench_accept_shed(struct rho_log *log, int lfd, int *spare_fd)
+{
+    int cfd = -1;
+
+    (void)close(*spare_fd);
+    cfd = accept(lfd, NULL, NULL);
+    if (cfd != -1)
+        (void)close(cfd);
+    *spare_fd = bench_spare_fd_open();
+
+    rho_log_warn(log, "out of fds: %s the connection",
+            cfd != -1 ? "dropped" : "can't drop");
+}
+
+/*
+ * accept(2) failed with ENOBUFS or ENOMEM: the kernel is short of memory
+ * for the socket, which a spare fd won't help with, so only wait a little
+ * before trying again (the whole event loop waits, so that it doesn't
+ * spin on the still-ready listening socket).
+ */
+static inline void
+bench_accept_backoff(struct rho_log *log, int error)
+{
+    struct timespec ts = { 0, BENCH_ACCEPT_BACKOFF_MS * 1000000L };
+
+    rho_log_warn(log, "accept failed: %s; backing off for %d ms",
+            strerror(error), BENCH_ACCEPT_BACKOFF_MS);
+    (void)nanosleep(&ts, NULL);
+}
+
 #endif 
@@ -0,0 +1,200 @@
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rho/rho.h>
+
+#include "bench_perf.h"
+
+static const struct {
+    const char  *name;
+    uint32_t    type;
+    uint64_t    config;
+} bench_perf_events[BENCH_PERF_NCOUNTERS] = {
+    [BENCH_PERF_CYCLES] = { "cycles",
+        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [BENCH_PERF_INSTRUCTIONS] = { "instructions",
+        PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [BENCH_PERF_CACHE_MISSES] = { "cache-misses",
+        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [BENCH_PERF_CTX_SWITCHES] = { "context-switches",
+        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    [BENCH_PERF_PAGE_FAULTS] = { "page-faults",
+        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/* what read(2) of a counter returns, given the read_format we ask for */
+struct bench_perf_reading {
+    uint64_t    value;
+    uint64_t    time_enabled;
+    uint64_t    time_running;
+};
+
+static int
+bench_perf_open(int i, bool user_only)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = bench_perf_events[i].type;
+    attr.config = bench_perf_events[i].config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_kernel = user_only ? 1 : 0;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    /* this thread, on any CPU */
+    return ((int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+struct bench_perf *
+bench_perf_create(void)
+{
+    struct bench_perf *perf = NULL;
+    int i = 0;
+    int fd = 0;
+
+    RHO_TRACE_ENTER();
+
+    perf = rhoL_zalloc(sizeof(*perf));
+again:
+    for (i = 0; i < BENCH_PERF_NCOUNTERS; i++) {
+        fd = bench_perf_open(i, perf->bp_user_only);
+        if (fd == -1 && (errno == EACCES || errno == EPERM) &&
+                !perf->bp_user_only) {
+            /* start over, so that all of the counts cover the same modes */
+            while (--i >= 0) {
+                if (perf->bp_fds[i] != -1)
+                    close(perf->bp_fds[i]);
+            }
+            perf->bp_user_only = true;
+            goto again;
+        }
+        if (fd == -1)
+            rho_debug("perf counter \"%s\" not available (errno=%d)",
+                    bench_perf_events[i].name, errno);
+        perf->bp_fds[i] = fd;
+    }
+
+    RHO_TRACE_EXIT();
+    return (perf);
+}
+
+void
+bench_perf_destroy(struct bench_perf *perf)
+{
+    int i = 0;
+
+    RHO_TRACE_ENTER();
+
+    for (i = 0; i < BENCH_PERF_NCOUNTERS; i++) {
+        if (perf->bp_fds[i] != -1)
+            close(perf->bp_fds[i]);
+    }
+    rhoL_free(perf);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * COUNTING
+ *********************************************************/
+void
+bench_perf_start(struct bench_perf *perf)
+{
+    int i = 0;
+
+    for (i = 0; i < BENCH_PERF_NCOUNTERS; i++) {
+        if (perf->bp_fds[i] == -1)
+            continue;
+        (void)ioctl(perf->bp_fds[i], PERF_EVENT_IOC_RESET, 0);
+        (void)ioctl(perf->bp_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void
+bench_perf_stop(struct bench_perf *perf)
+{
+    int i = 0;
+    struct bench_perf_reading r;
+
+    for (i = 0; i < BENCH_PERF_NCOUNTERS; i++) {
+        if (perf->bp_fds[i] == -1)
+            continue;
+        (void)ioctl(perf->bp_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (i = 0; i < BENCH_PERF_NCOUNTERS; i++) {
+        perf->bp_values[i] = 0;
+        perf->bp_counted[i] = false;
+        if (perf->bp_fds[i] == -1)
+            continue;
+        if (read(perf->bp_fds[i], &r, sizeof(r)) != (ssize_t)sizeof(r))
+            continue;
+        /* never scheduled onto the PMU: there is nothing to scale */
+        if (r.time_running == 0)
+            continue;
+        /*
+         * with more hardware counters than the PMU has, the kernel
+         * multiplexes them; extrapolate to the whole time enabled
+         */
+        if (r.time_running < r.time_enabled)
+            r.value = (uint64_t)((double)r.value *
+                    ((double)r.time_enabled / r.time_running));
+        perf->bp_values[i] = r.value;
+        perf->bp_counted[i] = true;
+    }
+}
+
+/*
+ * Write the counts of the last start/stop, divided by n (the number of
+ * RPCs, copies, ...), to buf as one line.
+ */
+void
+bench_perf_format(const struct bench_perf *perf, uint64_t n,
+        char *buf, size_t len)
+{
+    int i = 0;
+    size_t off = 0;
+    double per = 0.0;
+
+    RHO_ASSERT(len > 0);
+
+    buf[0] = '\0';
+    if (n == 0)
+        n = 1;
+
+    for (i = 0; i < BENCH_PERF_NCOUNTERS && off < len; i++) {
+        if (perf->bp_fds[i] == -1 || !perf->bp_counted[i]) {
+            off += snprintf(buf + off, len - off, "%sn/a %s",
+                    i > 0 ? ", " : "", bench_perf_events[i].name);
+            continue;
+        }
+        per = (double)perf->bp_values[i] / n;
+        off += snprintf(buf + off, len - off, "%s%.2f %s",
+                i > 0 ? ", " : "", per, bench_perf_events[i].name);
+        if (i == BENCH_PERF_INSTRUCTIONS &&
+                perf->bp_counted[BENCH_PERF_CYCLES] &&
+                perf->bp_values[BENCH_PERF_CYCLES] > 0 && off < len)
+            off += snprintf(buf + off, len - off, " (%.2f IPC)",
+                    (double)perf->bp_values[i] /
+                    perf->bp_values[BENCH_PERF_CYCLES]);
+    }
+
+    if (perf->bp_user_only && off < len)
+        (void)snprintf(buf + off, len - off, " [user mode only]");
+}
@@ -0,0 +1,43 @@
+#ifndef _BENCH_PERF_H_
+#define _BENCH_PERF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hardware and software performance counters, via perf_event_open(2), for
+ * the calling thread.  A bench enables them around its measured loop only,
+ * so that setup, connection, and reporting don't pollute the counts.
+ *
+ * Counters the CPU or the kernel won't give us (a VM without a PMU, an
+ * enclave, a strict kernel.perf_event_paranoid) are skipped, and reported
+ * as "n/a"; if only kernel-mode counting is refused, the counters fall
+ * back, all together, to counting user mode alone.  A counter that the
+ * kernel never got to schedule during the measurement is also "n/a".
+ */
+
+#define BENCH_PERF_CYCLES       0
+#define BENCH_PERF_INSTRUCTIONS 1
+#define BENCH_PERF_CACHE_MISSES 2
+#define BENCH_PERF_CTX_SWITCHES 3
+#define BENCH_PERF_PAGE_FAULTS  4
+#define BENCH_PERF_NCOUNTERS    5
+
+struct bench_perf {
+    int         bp_fds[BENCH_PERF_NCOUNTERS];      /* -1: not available */
+    uint64_t    bp_values[BENCH_PERF_NCOUNTERS];   /* as of bench_perf_stop */
+    bool        bp_counted[BENCH_PERF_NCOUNTERS];  /* it ran at all */
+    bool        bp_user_only;
+};
+
+struct bench_perf * bench_perf_create(void);
+void bench_perf_destroy(struct bench_perf *perf);
+
+void bench_perf_start(struct bench_perf *perf);
+void bench_perf_stop(struct bench_perf *perf);
+
+void bench_perf_format(const struct bench_perf *perf, uint64_t n,
+        char *buf, size_t len);
+
+#endif /* _BENCH_PERF_H_ */
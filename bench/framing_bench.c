@@ -0,0 +1,553 @@
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FRAMING_HAVE_TSC 1
+#endif
+
+#include <rho/rho.h>
+#include <rpc.h>
+#include <rpc_aead.h>
+#include <rpc_crc32c.h>
+#include <rpc_mempipe.h>
+
+/*
+ * Microbenchmarks of the library's own CPU cost: header (de)serialization,
+ * building a message, the rho_buf integer helpers, summing a body with
+ * CRC32C, sealing one with an AEAD cipher, and a full round trip
+ * through the agent state machine.  Each case reports the mean ns and TSC
+ * cycles per operation, for each body size.
+ *
+ * The round trip runs over an in-memory pipe (see rpc_mempipe.h), so that
+ * it measures only the library, or, with -S, over a unix socketpair.
+ */
+
+#define FRAMING_BENCH_MAX_SIZES 16
+#define FRAMING_BENCH_OPCODE    1
+
+#define FRAMING_BENCH_USAGE \
+    "usage: framing_bench [options] ITERATIONS\n" \
+    "\n" \
+    "OPTIONS:\n" \
+    "   -A CIPHER\n" \
+    "       Time sealing a body with CIPHER (aes-128-gcm, aes-256-gcm, or\n" \
+    "       chacha20-poly1305), and seal the round trip's messages with it\n" \
+    "\n" \
+    "   -f SHORT_PCT,AGAIN_PCT[,SEED]\n" \
+    "       Inject faults into the in-memory pipe: cut SHORT_PCT percent\n" \
+    "       of the sends and receives short, and fail AGAIN_PCT percent\n" \
+    "       with EAGAIN.  SEED seeds the choices (default 1).\n" \
+    "\n" \
+    "   -h\n" \
+    "       Show this help message and exit\n" \
+    "\n" \
+    "   -i\n" \
+    "       Send the round trip's requests with a CRC32C trailer\n" \
+    "\n" \
+    "   -M MAX_IO\n" \
+    "       Let each send and receive on the in-memory pipe move at most\n" \
+    "       MAX_IO bytes, so that every message larger than that takes the\n" \
+    "       agents' paths for resuming partial I/O.  With -M or -f, the\n" \
+    "       round trip also reports the partial and EAGAIN calls per\n" \
+    "       operation.\n" \
+    "\n" \
+    "   -s SIZE[,SIZE...]\n" \
+    "       The body sizes, in bytes, to run each case with.  Default is\n" \
+    "       0,64,1024,16384,65536.\n" \
+    "\n" \
+    "   -S\n" \
+    "       Run the round trip over a unix socketpair, not in memory\n" \
+    "\n" \
+    "ARGUMENTS:\n" \
+    "   ITERATIONS\n" \
+    "       The number of operations to time for each case and size\n"
+
+struct framing_timer {
+    uint64_t    ft_ns;
+    uint64_t    ft_cycles;
+};
+
+static uint8_t *framing_payload = NULL;
+
+/* with -A: the key for the round trip, and for timing sealing alone */
+static const uint8_t framing_aead_key[RPC_AEAD_MAX_KEYLEN] = { 1 };
+
+static void
+usage(int exitcode)
+{
+    fprintf(stderr, "%s\n", FRAMING_BENCH_USAGE);
+    exit(exitcode);
+}
+
+/**************************************
+ * TIMING
+ **************************************/
+static inline uint64_t
+framing_cycles(void)
+{
+#ifdef FRAMING_HAVE_TSC
+    return (__rdtsc());
+#else
+    return (0);
+#endif
+}
+
+static inline void
+framing_start(struct framing_timer *t)
+{
+    t->ft_ns = rpc_now_ns();
+    t->ft_cycles = framing_cycles();
+}
+
+static void
+framing_report(const struct framing_timer *t, const char *name, size_t size,
+        int n)
+{
+    uint64_t cycles = framing_cycles() - t->ft_cycles;
+    uint64_t ns = rpc_now_ns() - t->ft_ns;
+
+    printf("%-16s %8zu %12.1f ns/op", name, size, (double)ns / n);
+#ifdef FRAMING_HAVE_TSC
+    printf(" %12.1f cycles/op\n", (double)cycles / n);
+#else
+    (void)cycles;
+    printf(" %12s cycles/op\n", "-");
+#endif
+}
+
+/**************************************
+ * CASES
+ **************************************/
+static void
+bench_hdr_pack(size_t size, int n)
+{
+    struct rho_buf *buf = rho_buf_bounded_create(RPC_HDR_MAXLEN);
+    struct rpc_hdr hdr;
+    struct framing_timer t;
+    int i = 0;
+
+    rho_memzero(&hdr, sizeof(hdr));
+    hdr.rh_code = FRAMING_BENCH_OPCODE;
+    hdr.rh_bodylen = size;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++)
+        (void)rpc_hdr_pack(&hdr, buf);
+    framing_report(&t, "hdr_pack", size, n);
+
+    rho_buf_destroy(buf);
+}
+
+static void
+bench_hdr_roundtrip(size_t size, int n)
+{
+    struct rho_buf *buf = rho_buf_bounded_create(RPC_HDR_MAXLEN);
+    struct rpc_hdr hdr;
+    struct rpc_hdr out;
+    struct framing_timer t;
+    int i = 0;
+
+    rho_memzero(&hdr, sizeof(hdr));
+    hdr.rh_code = FRAMING_BENCH_OPCODE;
+    hdr.rh_bodylen = size;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++) {
+        (void)rpc_hdr_pack(&hdr, buf);
+        rho_buf_seek(buf, 0, SEEK_END);
+        if (rpc_hdr_unpack(&out, buf) != 0)
+            rho_die("rpc_hdr_unpack failed");
+    }
+    framing_report(&t, "hdr_pack+unpack", size, n);
+
+    if (out.rh_bodylen != size)
+        rho_die("header did not survive the round trip");
+
+    rho_buf_destroy(buf);
+}
+
+static void
+bench_new_msg(struct rpc_agent *agent, size_t size, int n)
+{
+    struct framing_timer t;
+    int i = 0;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++) {
+        rpc_agent_new_msg(agent, FRAMING_BENCH_OPCODE);
+        rho_buf_write(agent->ra_bodybuf, framing_payload, size);
+        rpc_agent_autoset_bodylen(agent);
+        if (rpc_agent_ready_send(agent) != 0)
+            rho_die("rpc_agent_ready_send failed");
+    }
+    framing_report(&t, "build_msg", size, n);
+}
+
+static void
+bench_buf_u32(size_t size, int n)
+{
+    struct rho_buf *buf = rho_buf_create();
+    size_t nwords = size / 4;
+    size_t j = 0;
+    uint32_t v = 0;
+    uint32_t sum = 0;
+    struct framing_timer t;
+    int i = 0;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++) {
+        rho_buf_clear(buf);
+        for (j = 0; j < nwords; j++)
+            rho_buf_writeu32be(buf, (uint32_t)j);
+        rho_buf_rewind(buf);
+        for (j = 0; j < nwords; j++) {
+            (void)rho_buf_readu32be(buf, &v);
+            sum += v;
+        }
+    }
+    framing_report(&t, "buf_u32_rw", size, n);
+
+    /* keep the reads from being optimized away */
+    if (sum == 1)
+        printf("\n");
+
+    rho_buf_destroy(buf);
+}
+
+static void
+bench_crc32c(size_t size, int n)
+{
+    struct framing_timer t;
+    uint32_t crc = 0;
+    int i = 0;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++)
+        crc = rpc_crc32c(crc, framing_payload, size);
+    framing_report(&t, "crc32c", size, n);
+
+    /* keep the sums from being optimized away */
+    if (crc == 1)
+        printf("\n");
+}
+
+static void
+bench_aead_seal(struct rpc_aead *aead, size_t size, int n)
+{
+    struct framing_timer t;
+    uint8_t tag[RPC_AEAD_TAG_LENGTH];
+    int i = 0;
+    int error = 0;
+
+    framing_start(&t);
+    for (i = 0; i < n && error == 0; i++) {
+        error = rpc_aead_seal_begin(aead, NULL, 0);
+        if (error == 0)
+            error = rpc_aead_seal_update(aead, framing_payload, size);
+        if (error == 0)
+            error = rpc_aead_seal_final(aead, tag);
+    }
+    if (error != 0)
+        rho_errno_die(error, "can't seal");
+    framing_report(&t, "aead_seal", size, n);
+}
+
+/* run one of agent's event-loop methods (which may make no progress) */
+static void
+framing_step(struct rpc_agent *agent)
+{
+    switch (agent->ra_state) {
+    case RPC_STATE_RECV_HDR:
+        rpc_agent_recv_hdr(agent);
+        break;
+    case RPC_STATE_RECV_BODY:
+        rpc_agent_recv_body(agent);
+        break;
+    case RPC_STATE_SEND_HDR:
+        rpc_agent_send_hdr(agent);
+        break;
+    case RPC_STATE_SEND_BODY:
+        rpc_agent_send_body(agent);
+        break;
+    default:
+        rho_die("agent is in state %s", rpc_state_to_str(agent->ra_state));
+    }
+}
+
+/*
+ * Step both agents, in turn, until cli reaches cli_state and srv srv_state.
+ * Taking turns lets a body larger than the socket buffer (or the pipe) get
+ * through: the sender's EAGAIN hands over to the receiver, which drains it.
+ */
+static void
+framing_pump(struct rpc_agent *cli, int cli_state, struct rpc_agent *srv,
+        int srv_state)
+{
+    while (cli->ra_state != cli_state || srv->ra_state != srv_state) {
+        if (cli->ra_state != cli_state)
+            framing_step(cli);
+        if (srv->ra_state != srv_state)
+            framing_step(srv);
+    }
+}
+
+/*
+ * A request with a size-byte body, and its empty response, through both
+ * agents' state machines.  Over a socketpair, this includes at least four
+ * send and four receive system calls (more, with EAGAIN, once the body
+ * outgrows the socket buffer).
+ */
+static void
+bench_agent_roundtrip(struct rpc_agent *cli, struct rpc_agent *srv,
+        size_t size, int n, bool show_io)
+{
+    struct framing_timer t;
+    struct rpc_io_stats io0 = *rpc_agent_io_stats(cli);
+    const struct rpc_io_stats *io = NULL;
+    int i = 0;
+
+    framing_start(&t);
+    for (i = 0; i < n; i++) {
+        rpc_agent_new_msg(cli, FRAMING_BENCH_OPCODE);
+        rho_buf_write(cli->ra_bodybuf, framing_payload, size);
+        rpc_agent_autoset_bodylen(cli);
+        if (rpc_agent_ready_send(cli) != 0)
+            rho_die("rpc_agent_ready_send failed");
+        framing_pump(cli, RPC_STATE_RECV_HDR, srv, RPC_STATE_DISPATCHABLE);
+
+        rpc_agent_new_msg(srv, 0);
+        if (rpc_agent_ready_send(srv) != 0)
+            rho_die("rpc_agent_ready_send failed");
+        framing_pump(cli, RPC_STATE_DISPATCHABLE, srv, RPC_STATE_RECV_HDR);
+    }
+    framing_report(&t, "agent_roundtrip", size, n);
+
+    /* the client's side, to show that the partial-I/O paths ran */
+    if (show_io) {
+        io = rpc_agent_io_stats(cli);
+        printf("%-16s %8zu %12.1f partial/op %8.1f again/op\n",
+                "  (client I/O)", size,
+                (double)(io->is_npartial - io0.is_npartial) / n,
+                (double)(io->is_nagain - io0.is_nagain) / n);
+    }
+}
+
+/*
+ * Give both agents a fresh AEAD state, as building messages on cli alone
+ * (bench_new_msg) leaves its count of messages sealed ahead of srv's.
+ */
+static void
+framing_set_aead(struct rpc_agent *cli, struct rpc_agent *srv, int cipher)
+{
+    size_t keylen = rpc_aead_keylen(cipher);
+
+    if (rpc_agent_set_aead(cli, cipher, framing_aead_key, keylen, true) != 0 ||
+            rpc_agent_set_aead(srv, cipher, framing_aead_key, keylen,
+                false) != 0)
+        rho_errno_die(errno, "rpc_agent_set_aead");
+}
+
+/* an agent for fd, or, if fd is -1, for end of pipe */
+static struct rpc_agent *
+framing_agent_create(int fd, struct rpc_mempipe *pipe, int end)
+{
+    struct rpc_agent *agent = NULL;
+    struct rho_event *event = NULL;
+
+    event = rho_event_create(fd, RHO_EVENT_READ, NULL, NULL);
+    if (fd != -1) {
+        agent = rpc_agent_create(rho_sock_unix_from_fd(fd), event);
+    } else {
+        agent = rpc_agent_create(NULL, event);
+        rpc_mempipe_attach(pipe, end, agent);
+    }
+    rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
+
+    return (agent);
+}
+
+static void
+framing_agent_destroy(struct rpc_agent *agent)
+{
+    struct rho_event *event = agent->ra_event;
+
+    rpc_agent_destroy(agent);
+    rho_event_destroy(event);
+}
+
+/**************************************
+ * MAIN
+ **************************************/
+static size_t
+framing_parse_sizes(char *s, size_t *sizes)
+{
+    size_t n = 0;
+    char *tok = NULL;
+
+    for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (n == FRAMING_BENCH_MAX_SIZES)
+            usage(EXIT_FAILURE);
+        sizes[n] = rho_str_touint32(tok, 10);
+        if (sizes[n] > RPC_MAX_BODYLEN)
+            usage(EXIT_FAILURE);
+        n++;
+    }
+
+    return (n);
+}
+
+static void
+framing_parse_faults(char *s, struct rpc_mempipe_faults *faults)
+{
+    char *tok = NULL;
+    int i = 0;
+
+    for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ","), i++) {
+        if (i == 0)
+            faults->mf_short_pct = rho_str_touint32(tok, 10);
+        else if (i == 1)
+            faults->mf_again_pct = rho_str_touint32(tok, 10);
+        else if (i == 2)
+            faults->mf_seed = rho_str_touint32(tok, 10);
+        else
+            usage(EXIT_FAILURE);
+    }
+
+    if (i < 2 || faults->mf_short_pct > 100 || faults->mf_again_pct >= 100)
+        usage(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c = 0;
+    int n = 0;
+    size_t sizes[FRAMING_BENCH_MAX_SIZES] = { 0, 64, 1024, 16384, 65536 };
+    size_t nsizes = 5;
+    size_t max_size = 0;
+    size_t i = 0;
+    int sv[2] = { -1, -1 };
+    bool use_sock = false;
+    bool use_faults = false;
+    bool use_crc = false;
+    int cipher = -1;
+    struct rpc_aead *aead = NULL;
+    struct rpc_mempipe_faults faults;
+    struct rpc_mempipe *pipe = NULL;
+    struct rpc_agent *cli = NULL;
+    struct rpc_agent *srv = NULL;
+
+    rho_memzero(&faults, sizeof(faults));
+    faults.mf_seed = 1;
+
+    while ((c = getopt(argc, argv, "A:f:hiM:s:S")) != -1) {
+        switch (c) {
+        case 'A':
+            cipher = rpc_aead_cipher_from_str(optarg);
+            if (cipher == -1)
+                usage(EXIT_FAILURE);
+            break;
+        case 'f':
+            framing_parse_faults(optarg, &faults);
+            use_faults = true;
+            break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'i':
+            use_crc = true;
+            break;
+        case 'M':
+            faults.mf_max_io = rho_str_touint32(optarg, 10);
+            if (faults.mf_max_io == 0)
+                usage(EXIT_FAILURE);
+            use_faults = true;
+            break;
+        case 's':
+            nsizes = framing_parse_sizes(optarg, sizes);
+            break;
+        case 'S':
+            use_sock = true;
+            break;
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || (use_sock && use_faults))
+        usage(EXIT_FAILURE);
+
+    n = rho_str_toint(argv[0], 10);
+    if (n <= 0)
+        usage(EXIT_FAILURE);
+
+    for (i = 0; i < nsizes; i++) {
+        if (sizes[i] > max_size)
+            max_size = sizes[i];
+    }
+    framing_payload = rhoL_zalloc(max_size + 1);
+
+    if (use_sock) {
+        /* non-blocking, as both ends are driven from this one thread */
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1)
+            rho_errno_die(errno, "socketpair");
+    } else {
+        /*
+         * room for a whole request (with the larger of the trailers), so
+         * that, without faults, it goes in one send
+         */
+        pipe = rpc_mempipe_create(RPC_HDR_MAXLEN + max_size +
+                RPC_AEAD_TAG_LENGTH);
+        if (use_faults)
+            rpc_mempipe_set_faults(pipe, &faults);
+    }
+    cli = framing_agent_create(sv[0], pipe, 0);
+    srv = framing_agent_create(sv[1], pipe, 1);
+    rpc_agent_set_crc(cli, use_crc);
+
+    if (cipher != -1) {
+        aead = rpc_aead_create(cipher, framing_aead_key,
+                rpc_aead_keylen(cipher), true);
+        if (aead == NULL)
+            rho_errno_die(errno, "rpc_aead_create");
+        printf("aead: %s\n", rpc_aead_cipher_to_str(cipher));
+    }
+
+    printf("crc32c: %s\n", rpc_crc32c_method());
+    printf("%-16s %8s %18s %22s\n", "case", "size", "time", "cycles");
+    for (i = 0; i < nsizes; i++) {
+        bench_hdr_pack(sizes[i], n);
+        bench_hdr_roundtrip(sizes[i], n);
+        if (aead != NULL)
+            framing_set_aead(cli, srv, cipher);
+        bench_new_msg(cli, sizes[i], n);
+        bench_buf_u32(sizes[i], n);
+        bench_crc32c(sizes[i], n);
+        if (aead != NULL) {
+            bench_aead_seal(aead, sizes[i], n);
+            framing_set_aead(cli, srv, cipher);
+        }
+        bench_agent_roundtrip(cli, srv, sizes[i], n, use_faults);
+    }
+
+    if (aead != NULL)
+        rpc_aead_destroy(aead);
+    framing_agent_destroy(cli);
+    framing_agent_destroy(srv);
+    if (pipe != NULL)
+        rpc_mempipe_destroy(pipe);
+    rhoL_free(framing_payload);
+
+    return (0);
+}
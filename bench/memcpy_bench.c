@@ -4,34 +4,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <immintrin.h>
+
 #include <rho/rho.h>
+#include <rpc_copy.h>
+
+#include "bench_perf.h"
 
-/* 
+/*
  * Note that emmintrin.h also defines the intrinsic _mm_clflush,
  * as an alternative to writing in-line assembly
  */
 
 #define CACHELINE_SIZE 64U
 
+/* how far ahead of the copy the prefetching variants read */
+#define PREFETCH_DISTANCE 512U
+
+static struct bench_perf *bench_perf = NULL;
+
 #define MEMCPY_BENCH_USAGE \
-    "usage: memcpy_bench [options] SIZE ITERATIONS\n" \
+    "usage: memcpy_bench [options] SIZE[,SIZE...] ITERATIONS\n" \
+    "\n" \
+    "Time each copy strategy at each SIZE.\n" \
     "\n" \
     "OPTIONS:\n" \
     "\n" \
     "   -b\n" \
-    "       Do both the non-flushed and cache-flushed\n" \
+    "       Do both the cache-hot and cache-flushed\n" \
     "       versions of the benchmark.\n" \
+    "   -c RPC_COPY_METHOD\n" \
+    "       Make rpc_copy use memcpy, sse2-nt, avx2-nt, or\n" \
+    "       avx512-nt (which it never picks by itself)\n" \
     "   -h\n" \
     "       Show this help message and exit\n" \
+    "   -H\n" \
+    "       Count cycles, instructions, cache misses, context\n" \
+    "       switches, and page faults over the copies, and report\n" \
+    "       them per copy (with -f, the flushes are counted too)\n" \
     "   -f\n" \
     "       Flush the src and dst buffers from the\n" \
-    "       CPU cache lines before each mempcy\n" \
+    "       CPU cache lines before each copy; only\n" \
+    "       the copies are timed\n" \
+    "   -m METHOD[,METHOD...]\n" \
+    "       The strategies to time.  Default is all that\n" \
+    "       the CPU supports:\n" \
+    "           memcpy       libc memcpy\n" \
+    "           movsb        rep movsb\n" \
+    "           avx2         AVX2 loads and stores\n" \
+    "           avx2-nt      AVX2 loads, non-temporal stores\n" \
+    "           avx2-nt-pf   avx2-nt, prefetching the source\n" \
+    "           avx512       AVX-512 loads and stores\n" \
+    "           avx512-nt    AVX-512 loads, non-temporal stores\n" \
+    "           avx512-nt-pf avx512-nt, prefetching the source\n" \
+    "           rpc_copy     the library's bulk copy\n" \
     "\n" \
     "ARGUMENTS:\n" \
     "   SIZE\n" \
-    "       The size of the buffer to memcpy\n" \
+    "       The size of the buffer to copy\n" \
     "\n" \
     "   ITERATIONS\n" \
     "       The number of copies to perform\n"
@@ -69,74 +102,277 @@ flushall(volatile void *addr, size_t size)
         flush(addr + i);
 }
 
-static double
-do_flush_buf_from_cache_bench(size_t size, int n)
+static uint64_t
+now_ns(void)
 {
-    int i = 0;
-    size_t offset = 0;
-    struct timeval start;
-    struct timeval tmp;
-    struct timeval end;
-    struct timeval elapsed;
-    double mean_gtod = 0.0;
-    double flush_total = 0.0;
-    double mean_flush = 0.0;
-    void *p = NULL;
-
-    /* measure the cost of gettimeofday */
-    (void)gettimeofday(&start, NULL);
-    for (i = 0; i < n; i++)
-        gettimeofday(&tmp, NULL);
-    (void)gettimeofday(&end, NULL);
-
-    rho_timeval_subtract(&end, &start, &elapsed);
-    mean_gtod = (rho_timeval_to_sec_double(&elapsed) / (1.0 * n));
-    printf("mean gettimeofday: %.9f (%.9g) s\n", mean_gtod, mean_gtod);
-
-    p = rhoL_malloc(size);
-
-    /* measure what a flush of a cacheline costs */
-    for (i = 0; i < n; i++) {
-        rho_rand_bytes(p, size);
-        (void)gettimeofday(&start, NULL);
-        for (offset = 0; offset < size; offset += CACHELINE_SIZE)
-            flush(p + offset);
-        (void)gettimeofday(&end, NULL);
-
-        rho_timeval_subtract(&end, &start, &elapsed);
-        flush_total += rho_timeval_to_sec_double(&elapsed);
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/******************************************************************************
+ * COPY STRATEGIES
+ *
+ * The vector copies handle the bytes before dst's first cache line boundary,
+ * and after its last, with memcpy, and store whole, aligned lines in between.
+ ******************************************************************************/
+static size_t
+copy_head(void *dst, const void *src, size_t len)
+{
+    size_t head = (CACHELINE_SIZE - ((uintptr_t)dst & (CACHELINE_SIZE - 1))) &
+        (CACHELINE_SIZE - 1);
+
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    return (head);
+}
+
+static void
+copy_memcpy(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+static void
+copy_movsb(void *dst, const void *src, size_t len)
+{
+    asm __volatile__ (
+        "rep movsb"
+        : "+D" (dst), "+S" (src), "+c" (len)
+        :
+        : "memory"
+        );
+}
+
+__attribute__((target("avx2")))
+static void
+copy_avx2_common(void *dst, const void *src, size_t len, bool nt, bool pf)
+{
+    size_t off = copy_head(dst, src, len);
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    __m256i a, b;
+
+    for (; off + CACHELINE_SIZE <= len; off += CACHELINE_SIZE) {
+        if (pf)
+            _mm_prefetch((const char *)(s + off + PREFETCH_DISTANCE),
+                    _MM_HINT_NTA);
+        a = _mm256_loadu_si256((const __m256i *)(s + off));
+        b = _mm256_loadu_si256((const __m256i *)(s + off + 32));
+        if (nt) {
+            _mm256_stream_si256((__m256i *)(d + off), a);
+            _mm256_stream_si256((__m256i *)(d + off + 32), b);
+        } else {
+            _mm256_store_si256((__m256i *)(d + off), a);
+            _mm256_store_si256((__m256i *)(d + off + 32), b);
+        }
     }
-    
-    /* we assume that gettimeofday is like a round-trip; 
-     * we subtract the "coming back" time on the first and the
-     * "going forth" time on the second call.
-     */
-    mean_flush = (flush_total / (1.0 * n)) - mean_gtod;
-    printf("mean flush: %.9f (%.9g) s\n", mean_flush, mean_flush);
+    if (nt)
+        _mm_sfence();
+    memcpy(d + off, s + off, len - off);
+}
+
+__attribute__((target("avx512f")))
+static void
+copy_avx512_common(void *dst, const void *src, size_t len, bool nt, bool pf)
+{
+    size_t off = copy_head(dst, src, len);
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    __m512i a;
+
+    for (; off + CACHELINE_SIZE <= len; off += CACHELINE_SIZE) {
+        if (pf)
+            _mm_prefetch((const char *)(s + off + PREFETCH_DISTANCE),
+                    _MM_HINT_NTA);
+        a = _mm512_loadu_si512((const void *)(s + off));
+        if (nt)
+            _mm512_stream_si512((void *)(d + off), a);
+        else
+            _mm512_store_si512((void *)(d + off), a);
+    }
+    if (nt)
+        _mm_sfence();
+    memcpy(d + off, s + off, len - off);
+}
+
+static void
+copy_avx2(void *dst, const void *src, size_t len)
+{
+    copy_avx2_common(dst, src, len, false, false);
+}
+
+static void
+copy_avx2_nt(void *dst, const void *src, size_t len)
+{
+    copy_avx2_common(dst, src, len, true, false);
+}
+
+static void
+copy_avx2_nt_pf(void *dst, const void *src, size_t len)
+{
+    copy_avx2_common(dst, src, len, true, true);
+}
+
+static void
+copy_avx512(void *dst, const void *src, size_t len)
+{
+    copy_avx512_common(dst, src, len, false, false);
+}
 
-    rhoL_free(p);
+static void
+copy_avx512_nt(void *dst, const void *src, size_t len)
+{
+    copy_avx512_common(dst, src, len, true, false);
+}
 
-    return (mean_flush);
+static void
+copy_avx512_nt_pf(void *dst, const void *src, size_t len)
+{
+    copy_avx512_common(dst, src, len, true, true);
 }
 
+static void
+copy_rpc_copy(void *dst, const void *src, size_t len)
+{
+    (void)rpc_copy(dst, src, len);
+}
+
+struct copy_method {
+    const char  *cm_name;
+    void        (*cm_copy)(void *dst, const void *src, size_t len);
+    const char  *cm_feature;    /* for __builtin_cpu_supports, or NULL */
+    bool        cm_selected;
+};
+
+static struct copy_method copy_methods[] = {
+    { "memcpy",         copy_memcpy,        NULL,       false },
+    { "movsb",          copy_movsb,         NULL,       false },
+    { "avx2",           copy_avx2,          "avx2",     false },
+    { "avx2-nt",        copy_avx2_nt,       "avx2",     false },
+    { "avx2-nt-pf",     copy_avx2_nt_pf,    "avx2",     false },
+    { "avx512",         copy_avx512,        "avx512f",  false },
+    { "avx512-nt",      copy_avx512_nt,     "avx512f",  false },
+    { "avx512-nt-pf",   copy_avx512_nt_pf,  "avx512f",  false },
+    { "rpc_copy",       copy_rpc_copy,      NULL,       false },
+};
+
+#define NCOPY_METHODS (sizeof(copy_methods) / sizeof(copy_methods[0]))
+
+static bool
+copy_method_supported(const struct copy_method *cm)
+{
+    /* __builtin_cpu_supports wants a string literal */
+    if (cm->cm_feature == NULL)
+        return (true);
+    if (strcmp(cm->cm_feature, "avx2") == 0)
+        return (__builtin_cpu_supports("avx2"));
+    if (strcmp(cm->cm_feature, "avx512f") == 0)
+        return (__builtin_cpu_supports("avx512f"));
+    return (false);
+}
+
+static void
+copy_methods_select(char *list)
+{
+    char *name = NULL;
+    size_t i = 0;
+
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        for (i = 0; i < NCOPY_METHODS; i++) {
+            if (strcmp(name, copy_methods[i].cm_name) == 0)
+                break;
+        }
+        if (i == NCOPY_METHODS) {
+            fprintf(stderr, "unknown copy method \"%s\"\n", name);
+            usage(1);
+        }
+        copy_methods[i].cm_selected = true;
+    }
+}
+
+/******************************************************************************
+ * BENCHMARK
+ ******************************************************************************/
+/* returns the mean ns per copy */
 static double
-do_memcpy_bench(void *src, void *dst, size_t size, int n)
+do_copy_bench(const struct copy_method *cm, void *dst, const void *src,
+        size_t size, int n, bool flushed)
 {
     int i = 0;
-    struct timeval start;
-    struct timeval end;
-    struct timeval elapsed;
-    double mean = 0;
+    uint64_t start = 0;
+    uint64_t total = 0;
+
+    /* fault the pages in, and, for cache-hot copies, warm the cache */
+    cm->cm_copy(dst, src, size);
+
+    if (bench_perf != NULL)
+        bench_perf_start(bench_perf);
+
+    if (flushed) {
+        for (i = 0; i < n; i++) {
+            flushall((volatile void *)src, size);
+            flushall(dst, size);
+            asm __volatile__ ("mfence" ::: "memory");
+            start = now_ns();
+            cm->cm_copy(dst, src, size);
+            total += now_ns() - start;
+        }
+    } else {
+        start = now_ns();
+        for (i = 0; i < n; i++)
+            cm->cm_copy(dst, src, size);
+        total = now_ns() - start;
+    }
+
+    if (bench_perf != NULL)
+        bench_perf_stop(bench_perf);
+
+    return ((double)total / n);
+}
 
-    (void)gettimeofday(&start, NULL);
-    for (i = 0; i < n; i++)
-        memcpy(src, dst, size);
-    (void)gettimeofday(&end, NULL);
+static void
+do_size_bench(size_t size, int n, bool hot, bool flushed)
+{
+    uint8_t *src = NULL;
+    uint8_t *dst = NULL;
+    size_t i = 0;
+    double mean = 0.0;
+    char perfline[256];
+    int pass = 0;
+
+    src = rhoL_malloc(size);
+    dst = rhoL_malloc(size);
+    memset(src, 0xa5, size);
+    memset(dst, 0, size);
 
-    rho_timeval_subtract(&end, &start, &elapsed);
-    mean = (rho_timeval_to_sec_double(&elapsed) / (1.0 * n));
+    for (pass = 0; pass < 2; pass++) {
+        if ((pass == 0 && !hot) || (pass == 1 && !flushed))
+            continue;
+        for (i = 0; i < NCOPY_METHODS; i++) {
+            if (!copy_methods[i].cm_selected)
+                continue;
 
-    return (mean);
+            mean = do_copy_bench(&copy_methods[i], dst, src, size, n,
+                    pass == 1);
+            if (memcmp(dst, src, size) != 0)
+                rho_die("%s produced a bad copy", copy_methods[i].cm_name);
+
+            printf("%10zu %-13s %-7s %14.1f ns %8.2f GB/s\n",
+                    size, copy_methods[i].cm_name,
+                    pass == 1 ? "flushed" : "hot",
+                    mean, mean > 0 ? size / mean : 0.0);
+            if (bench_perf != NULL) {
+                bench_perf_format(bench_perf, n, perfline, sizeof(perfline));
+                printf("    per copy: %s\n", perfline);
+            }
+        }
+    }
+
+    rhoL_free(src);
+    rhoL_free(dst);
 }
 
 int
@@ -145,23 +381,35 @@ main(int argc, char *argv[])
     int c = 0;
     unsigned int size = 0;
     int n = 0;
-    uint8_t *src = NULL;
-    uint8_t *dst = NULL;
     bool do_cacheflush_bench = false;
     bool do_both = false;
-    double mean = 0.0;
+    char *methods = NULL;
+    char *sizes = NULL;
+    size_t i = 0;
 
-    while ((c = getopt(argc, argv, "bhf")) != -1) {
+    while ((c = getopt(argc, argv, "bc:hHfm:")) != -1) {
         switch (c) {
+        case 'c':
+            if (rpc_copy_set_method(optarg) == -1)
+                rho_errno_die(errno, "can't make rpc_copy use \"%s\"",
+                        optarg);
+            break;
         case 'h':
             usage(EXIT_SUCCESS);
             break;
+        case 'H':
+            if (bench_perf == NULL)
+                bench_perf = bench_perf_create();
+            break;
         case 'b':
             do_both = true;
             break;
         case 'f':
             do_cacheflush_bench = true;
             break;
+        case 'm':
+            methods = optarg;
+            break;
         default:
             usage(1);
         }
@@ -172,23 +420,41 @@ main(int argc, char *argv[])
     if (argc != 2)
         usage(1);
 
-    size = rho_str_touint(argv[0], 10);
     n = rho_str_toint(argv[1], 10);
+    if (n <= 0)
+        usage(1);
 
-    src = rhoL_malloc(size);
-    dst = rhoL_malloc(size);
-
-    if (do_cacheflush_bench || do_both) {
-        mean = do_flush_buf_from_cache_bench(size, n);
-        printf("mean time to flush a buffer of size %u from cache (based on %d runs): %.9f s, (%.9g)\n",
-            size, n, mean, mean);
+    __builtin_cpu_init();
+    if (methods != NULL)
+        copy_methods_select(methods);
+    for (i = 0; i < NCOPY_METHODS; i++) {
+        if (methods == NULL) {
+            copy_methods[i].cm_selected = copy_method_supported(
+                    &copy_methods[i]);
+        } else if (copy_methods[i].cm_selected &&
+                !copy_method_supported(&copy_methods[i])) {
+            fprintf(stderr, "skipping %s: this CPU lacks %s\n",
+                    copy_methods[i].cm_name, copy_methods[i].cm_feature);
+            copy_methods[i].cm_selected = false;
+        }
     }
 
-    if (!do_cacheflush_bench || do_both) {
-        mean = do_memcpy_bench(src, dst, size, n);
-        printf("mean time for a memcpy of %u bytes (based on %d runs): %.9f s, (%.9g)\n",
-            size, n, mean, mean);
+    printf("rpc_copy: %s above %zu bytes\n", rpc_copy_method(),
+            rpc_copy_threshold());
+    printf("%10s %-13s %-7s %17s %13s\n", "SIZE", "METHOD", "CACHE",
+            "MEAN", "THROUGHPUT");
+
+    for (sizes = strtok(argv[0], ","); sizes != NULL;
+            sizes = strtok(NULL, ",")) {
+        size = rho_str_touint(sizes, 10);
+        if (size == 0)
+            usage(1);
+        do_size_bench(size, n, !do_cacheflush_bench || do_both,
+                do_cacheflush_bench || do_both);
     }
 
+    if (bench_perf != NULL)
+        bench_perf_destroy(bench_perf);
+
     return (0);
 }
@@ -8,40 +8,134 @@
 
 #include <rho/rho.h>
 #include <rpc.h>
+#include <rpc_copy.h>
 
 #include "bench.h"
+#include "bench_perf.h"
 
 static uint8_t *bench_payload = NULL;
 static uint32_t bench_upload_size = 0;
 static uint32_t bench_download_size = 0;
 static uint32_t bench_op_code = BENCH_OP_DOWNLOAD;
 static int bench_num_requests = 0;
+static size_t bench_memfd_threshold = 0;
+static int bench_ops_per_rpc = 1;
+static uint32_t bench_timeout_us = 0;
+static uint32_t bench_max_spins = 0;
+static int bench_num_expired = 0;
+static struct bench_perf *bench_perf = NULL;
+static bool bench_huge = false;
+static bool bench_crc = false;
+static int bench_aead = -1;
+static const char *bench_aead_keyfile = NULL;
+
+/* 
+ * Returns true if the request failed because it expired: either the server
+ * shed it, or we gave up waiting (which kills the connection).
+ */
+static bool
+bench_check_expired(int error)
+{
+    if (error == ETIMEDOUT) {
+        bench_num_expired++;
+        return (true);
+    }
+    if (error == -1 && errno == ETIMEDOUT)
+        rho_die("request timed out after %"PRIu32" us", bench_timeout_us);
+
+    return (false);
+}
+
+/*
+ * issue bench_ops_per_rpc copies of the benchmark's op as a single compound
+ * request
+ */
+static void
+do_compound_request(struct rpc_agent *agent,
+        const struct bench_upload_req *req)
+{
+    int i = 0;
+    int ret = 0;
+    size_t cookie = 0;
+    struct rpc_compound_iter iter;
+    struct bench_download_resp resp;
+    uint32_t status = 0;
+    const void *body = NULL;
+    size_t len = 0;
+
+    rpc_agent_new_compound(agent, RPC_COMPOUND_F_STOP_ON_ERROR);
+    for (i = 0; i < bench_ops_per_rpc; i++) {
+        cookie = rpc_agent_compound_begin_op(agent, bench_op_code, 0);
+        if (bench_op_code == BENCH_OP_UPLOAD)
+            bench_upload_req_encode(agent->ra_bodybuf, req);
+        rpc_agent_compound_end_op(agent, cookie);
+    }
+
+    ret = rpc_agent_request(agent);
+    if (ret != 0 && !bench_check_expired(ret))
+        rho_die("rpc_agent_request returned %d", ret);
+    if (bench_check_expired(agent->ra_hdr.rh_code))
+        return;
+    /*
+     * only the server knows its download size, and so whether the results
+     * fit in one response
+     */
+    if (agent->ra_hdr.rh_code == E2BIG)
+        rho_die("compound response would exceed %u bytes; lower -k",
+                RPC_MAX_BODYLEN);
+    if (agent->ra_hdr.rh_code != 0)
+        rho_die("compound request failed with status %"PRIu32,
+                agent->ra_hdr.rh_code);
+
+    if (rpc_compound_iter_init(&iter, agent) != bench_ops_per_rpc)
+        rho_die("compound response has the wrong number of results");
+
+    while ((ret = rpc_compound_iter_next(&iter, &status, &body, &len)) == 1) {
+        if (bench_op_code != BENCH_OP_DOWNLOAD)
+            continue;
+        if (bench_download_resp_decode(body, len, &resp) != 0)
+            rho_die("malformed download response");
+        bench_download_size = resp.payload_len;
+        if (bench_download_size > 0)
+            rpc_copy(bench_payload, resp.payload, bench_download_size);
+    }
+    if (ret == -1)
+        rho_die("malformed compound response");
+}
 
 static double
 do_upload_bench(struct rpc_agent *agent)
 {
     int i = 0;
     int error = 0;
-    struct rho_buf *buf = agent->ra_bodybuf;
+    struct bench_upload_req req;
     struct timeval start;
     struct timeval end;
     struct timeval elapsed;
 
+    req.payload = bench_payload;
+    req.payload_len = bench_upload_size;
+
+    if (bench_perf != NULL)
+        bench_perf_start(bench_perf);
     (void)gettimeofday(&start, NULL);
     for (i = 0; i < bench_num_requests; i++) {
-        rpc_agent_new_msg(agent, bench_op_code);
-        rpc_agent_set_bodylen(agent, bench_upload_size);
-        rho_buf_write(buf, bench_payload, bench_upload_size);
+        if (bench_ops_per_rpc > 1) {
+            do_compound_request(agent, &req);
+            continue;
+        }
 
-        error = rpc_agent_request(agent);
-        if (error != 0)
-            rho_die("rpc_agent_request returned %d", error);
+        error = bench_upload(agent, &req);
+        if (error != 0 && !bench_check_expired(error))
+            rho_die("bench_upload returned %d", error);
 
         rho_debug("%d/%d status=%"PRIu32", download size=%"PRIu32,
                 i, bench_num_requests,
                 agent->ra_hdr.rh_code, agent->ra_hdr.rh_bodylen);
     }
     (void)gettimeofday(&end, NULL);
+    if (bench_perf != NULL)
+        bench_perf_stop(bench_perf);
 
      rho_timeval_subtract(&end, &start, &elapsed);
 
@@ -53,28 +147,37 @@ do_download_bench(struct rpc_agent *agent)
 {
     int i = 0;
     int error = 0;
-    struct rho_buf *buf = agent->ra_bodybuf;
+    struct bench_download_resp resp;
     struct timeval start;
     struct timeval end;
     struct timeval elapsed;
 
+    if (bench_perf != NULL)
+        bench_perf_start(bench_perf);
     (void)gettimeofday(&start, NULL);
     for (i = 0; i < bench_num_requests; i++) {
-        rpc_agent_new_msg(agent, bench_op_code);
+        if (bench_ops_per_rpc > 1) {
+            do_compound_request(agent, NULL);
+            continue;
+        }
 
-        error = rpc_agent_request(agent);
+        error = bench_download(agent, &resp);
+        if (bench_check_expired(error))
+            continue;
         if (error != 0)
-            rho_die("rpc_agent_request returned %d", error);
+            rho_die("bench_download returned %d", error);
 
-        bench_download_size = agent->ra_hdr.rh_bodylen;
+        bench_download_size = resp.payload_len;
         if (bench_download_size > 0)
-            rho_buf_read(buf, bench_payload, bench_download_size);
+            rpc_copy(bench_payload, resp.payload, bench_download_size);
 
         rho_debug("%d/%d status=%"PRIu32", download size=%"PRIu32,
                 i, bench_num_requests, 
                 agent->ra_hdr.rh_code, agent->ra_hdr.rh_bodylen);
     }
     (void)gettimeofday(&end, NULL);
+    if (bench_perf != NULL)
+        bench_perf_stop(bench_perf);
 
     rho_timeval_subtract(&end, &start, &elapsed);
 
@@ -133,12 +236,49 @@ done:
     "usage: benchclient [options] URL\n" \
     "\n" \
     "OPTIONS:\n" \
+    "   -A CIPHER\n" \
+    "       Seal each message with CIPHER (aes-128-gcm, aes-256-gcm, or\n" \
+    "       chacha20-poly1305) instead of sending it through TLS.  The key\n" \
+    "       is exported from the TLS handshake (-r), or else read from -K.\n" \
+    "       The server must use the same -A.\n" \
+    "\n" \
     "   -c RPC_COMMAND\n" \
     "       Must be UPLOAD or DOWNLOAD.  Default is DOWNLOAD.\n" \
     "\n" \
+    "   -g\n" \
+    "       Back the payload buffer with huge pages, explicit or\n" \
+    "       transparent, if the kernel offers them.\n" \
+    "\n" \
     "   -h\n" \
     "       Show this help message and exit\n" \
     "\n" \
+    "   -H\n" \
+    "       Count cycles, instructions, cache misses, context switches,\n" \
+    "       and page faults (perf_event_open(2)) over the requests, and\n" \
+    "       report them per RPC.  Counters the machine doesn't offer\n" \
+    "       are reported as n/a.\n" \
+    "\n" \
+    "   -i\n" \
+    "       Send bodies with a CRC32C trailer, which the server checks\n" \
+    "       (and answers with its own).\n" \
+    "\n" \
+    "   -k OPS_PER_RPC\n" \
+    "       Send OPS_PER_RPC copies of the RPC_COMMAND as a single\n" \
+    "       compound request.  Default is 1 (a plain request).\n" \
+    "\n" \
+    "   -K KEY_FILE\n" \
+    "       Without TLS, the pre-shared key for -A: the first 16 (for\n" \
+    "       aes-128-gcm) or 32 bytes of KEY_FILE.\n" \
+    "\n" \
+    "   -m MEMFD_THRESHOLD\n" \
+    "       For unix sockets, send bodies of at least MEMFD_THRESHOLD\n" \
+    "       bytes as memfd attachments.  The server must also use -m.\n" \
+    "\n" \
+    "   -p MAX_SPINS\n" \
+    "       Poll for each response with up to MAX_SPINS non-blocking\n" \
+    "       peeks before blocking (the number used adapts to the\n" \
+    "       server's response time).  Default is 0 (always block).\n" \
+    "\n" \
     "   -r ROOT_CRT\n" \
     "       The root certificate path.  If specified, the RPCs\n" \
     "       use server-authenticated TLS.\n" \
@@ -148,6 +288,12 @@ done:
     "       This can be useful if using external profile tools\n" \
     "       that need the client's PID or TID.\n" \
     "\n" \
+    "   -t TIMEOUT_US\n" \
+    "       Give each RPC a deadline of TIMEOUT_US microseconds.  The\n" \
+    "       server replies ETIMEDOUT to RPCs that have already expired\n" \
+    "       when it gets to them; these are counted and reported.\n" \
+    "       Default is 0 (no deadline).\n" \
+    "\n" \
     "   -u UPLOAD_SIZE\n" \
     "       If testing UPLOADS, the size of the request body.\n" \
     "       Must be <= 10MB \n" \
@@ -174,34 +320,71 @@ main(int argc, char *argv[])
     struct rpc_agent *agent = NULL;
     const char *root_crt = NULL;
     double mean = 0;
+    const struct rpc_io_stats *io = NULL;
     uint32_t sleep_secs = 0;
+    bool count_perf = false;
+    char perfline[256];
+    uint8_t aead_key[RPC_AEAD_MAX_KEYLEN];
 
 
-    while ((c = getopt(argc, argv, "c:hr:s:u:")) != -1) {
+    while ((c = getopt(argc, argv, "A:c:ghHik:K:m:p:r:s:t:u:")) != -1) {
         switch (c) {
+        case 'A':
+            bench_aead = bench_aead_cipher(optarg);
+            break;
         case 'c':
             if (rho_str_equal_ci(optarg, "UPLOAD")) {
                 bench_op_code = BENCH_OP_UPLOAD;
             } else if (rho_str_equal_ci(optarg, "DOWNLOAD")) {
                 bench_op_code = BENCH_OP_DOWNLOAD;
             } else {
-                fprintf(stderr, "invalid option for -c \"%s\"", optarg);
+                fprintf(stderr, "invalid option for -c \"%s\"\n", optarg);
                 exit(1);
             }
             break;
+        case 'g':
+            bench_huge = true;
+            break;
         case 'h':
             usage(EXIT_SUCCESS);
             break;
+        case 'H':
+            count_perf = true;
+            break;
+        case 'i':
+            bench_crc = true;
+            break;
+        case 'k':
+            bench_ops_per_rpc = rho_str_toint(optarg, 10);
+            if (bench_ops_per_rpc < 1 ||
+                    bench_ops_per_rpc > RPC_COMPOUND_MAX_OPS) {
+                fprintf(stderr, "ops per rpc must be between 1 and %d\n",
+                        RPC_COMPOUND_MAX_OPS);
+                exit(1);
+            }
+            break;
+        case 'K':
+            bench_aead_keyfile = optarg;
+            break;
+        case 'm':
+            bench_memfd_threshold = rho_str_touint32(optarg, 10);
+            break;
+        case 'p':
+            bench_max_spins = rho_str_touint32(optarg, 10);
+            break;
         case 'r':
             root_crt = optarg;
             break;
         case 's':
             sleep_secs = rho_str_touint32(optarg, 10);
             break;
+        case 't':
+            bench_timeout_us = rho_str_touint32(optarg, 10);
+            break;
         case 'u':
             bench_upload_size = rho_str_touint32(optarg, 10);
             if (bench_upload_size > BENCH_MAX_PAYLOAD_SIZE) {
-                fprintf(stderr, "upload size must be less than %u",
+                fprintf(stderr, "upload size must be less than %u\n",
                         BENCH_MAX_PAYLOAD_SIZE);
                 exit(1);
             }
@@ -219,9 +402,37 @@ main(int argc, char *argv[])
     bench_num_requests = rho_str_toint(argv[1], 10);
     RHO_ASSERT(bench_num_requests > 0);
 
-    bench_payload = rhoL_zalloc(BENCH_MAX_PAYLOAD_SIZE);
+    if (bench_op_code == BENCH_OP_UPLOAD &&
+            (uint64_t)bench_ops_per_rpc *
+            (RPC_COMPOUND_OP_HDRLEN + bench_upload_size) +
+            RPC_COMPOUND_HDRLEN > RPC_MAX_BODYLEN) {
+        fprintf(stderr, "compound request would exceed %u bytes\n",
+                RPC_MAX_BODYLEN);
+        exit(1);
+    }
+
+    bench_payload = bench_payload_alloc(bench_huge, NULL);
 
     agent = do_connect(argv[0], root_crt);
+    if (bench_memfd_threshold > 0 &&
+            rpc_agent_set_memfd_threshold(agent, bench_memfd_threshold) == -1)
+        rho_errno_die(errno, "can't use memfd attachments");
+    if (bench_timeout_us > 0 &&
+            rpc_agent_set_timeout(agent, bench_timeout_us) == -1)
+        rho_errno_die(errno, "can't set the rpc timeout");
+    rpc_agent_set_spin(agent, bench_max_spins);
+    rpc_agent_set_crc(agent, bench_crc);
+    if (bench_aead != -1) {
+        if (root_crt == NULL && bench_aead_keyfile == NULL)
+            rho_die("-A needs TLS (-r) or a pre-shared key (-K)");
+        if (bench_aead_keyfile != NULL)
+            bench_aead_key_load(bench_aead_keyfile, bench_aead, aead_key);
+        if (bench_aead_enable(agent, bench_aead, aead_key, true) == -1)
+            rho_errno_die(errno, "can't use AEAD record mode");
+    }
+
+    if (count_perf)
+        bench_perf = bench_perf_create();
 
     if (sleep_secs > 0)
         sleep(sleep_secs);
@@ -233,17 +444,48 @@ main(int argc, char *argv[])
         mean = do_upload_bench(agent);
         printf("mean time for a BENCH_OP_UPLOAD RPC of %"PRIu32" bytes (based on %d runs): %.9f s, (%.9g)\n",
                 bench_upload_size, bench_num_requests, mean, mean);
+        if (bench_ops_per_rpc > 1)
+            printf("(each RPC was a compound of %d operations)\n",
+                    bench_ops_per_rpc);
     } else if (bench_op_code == BENCH_OP_DOWNLOAD) {
         rho_debug("doing %d download requests", bench_num_requests); 
         mean = do_download_bench(agent);
         printf("mean time for a BENCH_OP_DOWNLOAD RPC of %"PRIu32" bytes (based on %d runs): %.9f s, (%.9g)\n",
                 bench_download_size, bench_num_requests, mean, mean);
+        if (bench_ops_per_rpc > 1)
+            printf("(each RPC was a compound of %d operations)\n",
+                    bench_ops_per_rpc);
     } else {
         RHO_ASSERT("invalid bench op code");
     }
 
+    if (bench_max_spins > 0)
+        printf("spin: %"PRIu64" hits, %"PRIu64" misses, final limit %"PRIu32"\n",
+                agent->ra_spin_hits, agent->ra_spin_misses,
+                agent->ra_spin_limit);
+    if (bench_timeout_us > 0)
+        printf("%d of %d RPCs expired (deadline %"PRIu32" us)\n",
+                bench_num_expired, bench_num_requests, bench_timeout_us);
+
+    io = rpc_agent_io_stats(agent);
+    if (io->is_nmsgs_out > 0)
+        printf("per RPC: %.2f syscalls (%.2f recvs, %.2f sends), "
+                "%.2f EAGAIN, %.2f partial\n",
+                (double)(io->is_nrecvs + io->is_nsends) / io->is_nmsgs_out,
+                (double)io->is_nrecvs / io->is_nmsgs_out,
+                (double)io->is_nsends / io->is_nmsgs_out,
+                (double)io->is_nagain / io->is_nmsgs_out,
+                (double)io->is_npartial / io->is_nmsgs_out);
+
+    if (bench_perf != NULL) {
+        bench_perf_format(bench_perf, bench_num_requests, perfline,
+                sizeof(perfline));
+        printf("per RPC: %s\n", perfline);
+        bench_perf_destroy(bench_perf);
+    }
+
     rpc_agent_destroy(agent);
-    rhoL_free(bench_payload);
+    bench_payload_free(bench_payload, bench_huge);
 
     return (0);
 }
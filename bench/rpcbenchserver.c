@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     /* accept4 */
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -7,6 +9,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -22,43 +26,111 @@
 
 #include <rho/rho.h>
 #include <rpc.h>
+#include <rpc_admit.h>
+#include <rpc_copy.h>
+#include <rpc_poller.h>
+#include <rpc_pool.h>
+#include <rpc_stats.h>
+#include <rpc_trace.h>
 
 #include "bench.h"
+#include "bench_perf.h"
 
 struct bench_server {
     struct rho_sock *srv_sock;
     struct rho_ssl_ctx *srv_sc;
+    int srv_backlog;
+    int srv_spare_fd;   /* given up to shed a connection when out of fds */
     /* TODO: don't hardcode 108 */
     uint8_t srv_udspath[108];
 };
 
+/* listen(2) backlog, unless -B */
+#define BENCH_SERVER_BACKLOG    128
+
+/* connections accepted per call to bench_server_accept, at most */
+#define BENCH_ACCEPT_BATCH      64
+
+/* what bench_client_step leaves the client waiting for */
+#define BENCH_CLIENT_AGAIN      0   /* its event's flags */
+#define BENCH_CLIENT_PARKED     1   /* the worker pool */
+#define BENCH_CLIENT_DONE       2   /* nothing: destroy it */
+
 struct bench_client {
     struct rpc_agent *cli_agent;
+    struct rpc_admit_bucket cli_bucket;
+    uint32_t cli_opcode;    /* of the request being dispatched */
+    bool cli_admitted;      /* its response is yet to be sent */
+    uint8_t *cli_sink;      /* where its uploads are copied */
+    size_t cli_sinklen;
+    int cli_error;          /* from an offloaded dispatch */
+    int cli_id;             /* names its row in the trace */
 };
 
-typedef void (*bench_opcall)(struct bench_client *client);
+/* events kept per connection with -T */
+#define BENCH_TRACE_NEVENTS     4096
+
+/* how long an offloaded handshake may take, in all, at most */
+#define BENCH_HANDSHAKE_TIMEOUT_MS  10000
 
 /**************************************
  * FORWARD DECLARATIONS
  **************************************/
-static void bench_upload_proxy(struct bench_client *client);
-static void bench_download_proxy(struct bench_client *client);
+static void bench_upload_proxy(struct rpc_agent *agent,
+        const struct bench_upload_req *req, void *arg);
+static void bench_download_proxy(struct rpc_agent *agent, void *arg);
 
 static struct bench_client * bench_client_alloc(void);
 static struct bench_client * bench_client_create(struct rho_sock *sock);
 static void bench_client_destroy(struct bench_client *client);
 
-static void bench_client_dispatch_call(struct bench_client *client);
+static bool bench_client_dispatch_call(struct bench_client *client);
+static void bench_client_offload_call(struct rpc_agent *agent, void *arg);
+static int bench_client_finish_call(struct bench_client *client, int error);
+static void bench_client_offload_handshake(struct rpc_agent *agent,
+        void *arg);
+static bool bench_client_handshake_done(struct bench_client *client);
+static int bench_client_step(struct bench_client *client);
 static void bench_client_cb(struct rho_event *event, int what,
         struct rho_event_loop *loop);
+static void bench_client_poll_cb(struct rpc_poller *poller, int fd, int what,
+        void *arg);
 
 static void bench_server_destroy(struct bench_server *server);
 static void bench_server_config_ssl(struct bench_server *server,
         const char *cafile, const char *certfile, const char *keyfile);
 static void bench_server_socket_create(struct bench_server *server,
         const char *url, bool anonymous);
+static size_t bench_server_accept(struct bench_server *server, int fd,
+        struct bench_client **clients);
 static void bench_server_cb(struct rho_event *event, int what,
         struct rho_event_loop *loop);
+static void bench_server_poll_cb(struct rpc_poller *poller, int fd, int what,
+        void *arg);
+
+static void bench_pool_done(struct rpc_agent *agent, void *udata, void *arg);
+static void bench_pool_discard(struct rpc_agent *agent, void *udata,
+        void *arg);
+static void bench_pool_cb(struct rho_event *event, int what,
+        struct rho_event_loop *loop);
+static void bench_pool_poll_done(struct rpc_agent *agent, void *udata,
+        void *arg);
+static void bench_pool_poll_cb(struct rpc_poller *poller, int fd, int what,
+        void *arg);
+static void bench_hs_pool_done(struct rpc_agent *agent, void *udata,
+        void *arg);
+static void bench_hs_pool_cb(struct rho_event *event, int what,
+        struct rho_event_loop *loop);
+static void bench_hs_pool_poll_done(struct rpc_agent *agent, void *udata,
+        void *arg);
+static void bench_hs_pool_poll_cb(struct rpc_poller *poller, int fd,
+        int what, void *arg);
+
+static void bench_poller_sighandler(int signum);
+static void bench_poller_run(struct bench_server *server, uint32_t idle_us);
+
+static void bench_perf_request(void);
+static void bench_perf_idle(void);
 
 static void bench_log_init(const char *logfile, bool verbose);
 
@@ -72,10 +144,28 @@ static struct rho_log *bench_log = NULL;
 
 static uint8_t *bench_payload = NULL;
 static uint32_t bench_download_size = 0;
-
-static bench_opcall bench_opcalls[] = {
-    [BENCH_OP_UPLOAD]   = bench_upload_proxy,
-    [BENCH_OP_DOWNLOAD] = bench_download_proxy,
+static int bench_download_fd = -1;
+static size_t bench_memfd_threshold = 0;
+static struct rpc_admit *bench_admit = NULL;
+static struct rpc_pool *bench_pool = NULL;
+static struct rpc_pool *bench_hs_pool = NULL;   /* for TLS handshakes */
+static struct rpc_poller *bench_poller = NULL;
+static struct rpc_stats *bench_stats = NULL;
+static FILE *bench_trace_fp = NULL;
+static bool bench_huge = false;
+static int bench_aead = -1;
+static uint8_t bench_aead_key[RPC_AEAD_MAX_KEYLEN];
+static int bench_next_client_id = 1;
+static int bench_nclients = 0;
+
+/* with -H: counting from the first request until no client is left */
+static struct bench_perf *bench_perf = NULL;
+static bool bench_perf_running = false;
+static uint64_t bench_perf_nrpcs = 0;
+
+static const struct bench_ops bench_ops = {
+    .upload     = bench_upload_proxy,
+    .download   = bench_download_proxy,
 };
 
 /**************************************
@@ -87,19 +177,22 @@ static bench_opcall bench_opcalls[] = {
  * server responds with empty body
  */
 static void
-bench_upload_proxy(struct bench_client *client)
+bench_upload_proxy(struct rpc_agent *agent, const struct bench_upload_req *req,
+        void *arg)
 {
-    struct rpc_agent *agent = client->cli_agent;
-    struct rho_buf *buf = agent->ra_bodybuf;
-    uint32_t size = 0;
+    struct bench_client *client = arg;
 
     RHO_TRACE_ENTER("bodylen=%"PRIu32, agent->ra_hdr.rh_bodylen);
 
-    size = agent->ra_hdr.rh_bodylen;
-    if (size > 0)
-        rho_buf_read(buf, bench_payload, size);
+    /* per client, as offloaded uploads run concurrently */
+    if (req->payload_len > client->cli_sinklen) {
+        client->cli_sink = rhoL_realloc(client->cli_sink, req->payload_len);
+        client->cli_sinklen = req->payload_len;
+    }
+    if (req->payload_len > 0)
+        rpc_copy(client->cli_sink, req->payload, req->payload_len);
 
-    rpc_agent_new_msg(agent, 0);
+    bench_upload_reply(agent, 0);
 
     RHO_TRACE_EXIT();
     return;
@@ -113,18 +206,41 @@ bench_upload_proxy(struct bench_client *client)
 static uint32_t tot_rpcs = 0;
 #endif
 static void
-bench_download_proxy(struct bench_client *client)
+bench_download_proxy(struct rpc_agent *agent, void *arg)
 {
-    struct rpc_agent *agent = client->cli_agent;
-    struct rho_buf *buf = agent->ra_bodybuf;
+    struct bench_download_resp resp;
+    void *p = NULL;
+
+    (void)arg;
 
     RHO_TRACE_ENTER("bodylen=%"PRIu32, agent->ra_hdr.rh_bodylen);
 
-    rpc_agent_new_msg(agent, 0);
-    rpc_agent_set_bodylen(agent, bench_download_size);
+    if (bench_download_fd != -1) {
+        /* the body is sent straight from the page cache */
+        rpc_agent_new_msg(agent, 0);
+        if (rpc_agent_set_bodyfd(agent, bench_download_fd, 0,
+                    bench_download_size, false) != 0)
+            rpc_agent_new_msg(agent, EMSGSIZE);
+        goto done;
+    }
+
+    if (agent->ra_memfd_threshold != 0 &&
+            bench_download_size >= agent->ra_memfd_threshold) {
+        /* built straight in the memfd that is passed to the client */
+        rpc_agent_new_msg(agent, 0);
+        p = rpc_agent_memfd_body(agent, bench_download_size);
+        if (p != NULL) {
+            rpc_copy(p, bench_payload, bench_download_size);
+            goto done;
+        }
+    }
+
     /* XXX: ideally, the bench measuremnts wouldn't include this memcpy */
-    rho_buf_write(buf, bench_payload, bench_download_size);
+    resp.payload = bench_payload;
+    resp.payload_len = bench_download_size;
+    bench_download_reply(agent, 0, &resp);
 
+done:
 #if 0
     rho_log_info(bench_log, "RPC %"PRIu32, tot_rpcs);
     tot_rpcs++;
@@ -162,12 +278,18 @@ bench_client_create(struct rho_sock *sock)
     client = bench_client_alloc();
     agent = client->cli_agent;
     agent->ra_sock = sock;
+    rpc_admit_bucket_init(bench_admit, &client->cli_bucket);
+    client->cli_id = bench_next_client_id++;
+    bench_nclients++;
+    rpc_stats_agent_add(bench_stats, agent);
+    if (bench_trace_fp != NULL)
+        rpc_agent_set_trace(agent, BENCH_TRACE_NEVENTS);
 
     /* has an ssl_ctx */
     if (sock->ssl != NULL)
-        agent->ra_state = RPC_STATE_HANDSHAKE;
+        rpc_agent_set_state(agent, RPC_STATE_HANDSHAKE);
     else
-        agent->ra_state = RPC_STATE_RECV_HDR;
+        rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
 
     RHO_TRACE_EXIT();
     return (client);
@@ -176,77 +298,238 @@ bench_client_create(struct rho_sock *sock)
 static void
 bench_client_destroy(struct bench_client *client)
 {
+    char name[32];
+    const struct rpc_io_stats *io = NULL;
+
     RHO_ASSERT(client != NULL);
 
     RHO_TRACE_ENTER();
 
+    if (client->cli_agent->ra_trace != NULL) {
+        snprintf(name, sizeof(name), "client %d", client->cli_id);
+        rpc_trace_json_write(client->cli_agent->ra_trace, bench_trace_fp,
+                getpid(), client->cli_id, name);
+        fflush(bench_trace_fp);
+    }
+
+    io = rpc_agent_io_stats(client->cli_agent);
+    if (io->is_nmsgs_in > 0)
+        rho_log_info(bench_log,
+                "client %d: %"PRIu64" requests; per request, %.2f syscalls "
+                "(%.2f EAGAIN, %.2f partial) in %.2f passes",
+                client->cli_id, io->is_nmsgs_in,
+                (double)(io->is_nrecvs + io->is_nsends) / io->is_nmsgs_in,
+                (double)io->is_nagain / io->is_nmsgs_in,
+                (double)io->is_npartial / io->is_nmsgs_in,
+                (double)io->is_npasses / io->is_nmsgs_in);
+
+    if (client->cli_admitted)
+        rpc_admit_dropped(bench_admit);
+    rpc_stats_agent_del(bench_stats, client->cli_agent);
     rpc_agent_destroy(client->cli_agent);
+    if (client->cli_sink != NULL)
+        rhoL_free(client->cli_sink);
     rhoL_free(client);
+    rpc_admit_conn_closed(bench_admit);
+
+    bench_nclients--;
+    if (bench_nclients == 0)
+        bench_perf_idle();
 
     RHO_TRACE_EXIT();
 }
 
-static void
+/*
+ * Returns true if the request has been handed to the worker pool, in which
+ * case the agent stays DISPATCHABLE, and its event out of the loop, until
+ * bench_pool_done.
+ */
+static bool
 bench_client_dispatch_call(struct bench_client *client)
 {
     struct rpc_agent *agent = client->cli_agent;
     uint32_t opcode = agent->ra_hdr.rh_code;
-    bench_opcall opcall = NULL;
+    int error = 0;
 
     RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE);
     RHO_ASSERT(rho_buf_tell(agent->ra_bodybuf) == 0);
 
     RHO_TRACE_ENTER("fd=%d, opcode=%d", agent->ra_sock->fd, opcode);
 
-    if (opcode >= RHO_C_ARRAY_SIZE(bench_opcalls)) {
-        rho_log_warn(bench_log, "bad opcode (%"PRIu32")", opcode);
-        rpc_agent_new_msg(agent, ENOSYS);
+    client->cli_opcode = opcode;
+    rpc_stats_request(bench_stats, agent);
+    bench_perf_request();
+
+    /*
+     * answered even when overloaded: that is when it is most wanted.  If
+     * ready_send fails, the agent is left in RPC_STATE_ERROR, which
+     * bench_client_step sees.
+     */
+    if (rpc_stats_dispatch(bench_stats, agent)) {
+        rpc_stats_done(bench_stats, agent, opcode);
+        (void)rpc_agent_ready_send(agent);
         goto done;
-    } 
+    }
+
+    error = rpc_admit_request(bench_admit, &client->cli_bucket);
+    if (error != 0) {
+        rho_debug("refused request (opcode=%"PRIu32", error=%d)",
+                opcode, error);
+        rpc_agent_new_msg(agent, error);
+        rpc_stats_done(bench_stats, agent, opcode);
+        (void)rpc_agent_ready_send(agent);
+        goto done;
+    }
+    client->cli_admitted = true;
+
+    if (bench_pool != NULL && rpc_pool_wants(bench_pool, agent)) {
+        rpc_pool_submit(bench_pool, agent, bench_client_offload_call, client);
+        RHO_TRACE_EXIT("offloaded");
+        return (true);
+    }
 
-    opcall = bench_opcalls[opcode];
-    opcall(client);
+    error = bench_dispatch(agent, &bench_ops, client);
+    (void)bench_client_finish_call(client, error);
 
 done:
-    rpc_agent_ready_send(agent);
     RHO_TRACE_EXIT();
-    return;
+    return (false);
 }
 
+/* runs on a worker thread */
 static void
-bench_client_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
+bench_client_offload_call(struct rpc_agent *agent, void *arg)
+{
+    struct bench_client *client = arg;
+
+    client->cli_error = bench_dispatch(agent, &bench_ops, client);
+}
+
+/*
+ * Returns 0, or an errno value if the response can't be sent, in which case
+ * the agent is in RPC_STATE_ERROR, and the client must be dropped.  A
+ * response that is too long is replaced by an EMSGSIZE error.
+ */
+static int
+bench_client_finish_call(struct bench_client *client, int error)
 {
+    struct rpc_agent *agent = client->cli_agent;
+    uint32_t opcode = client->cli_opcode;
+
+    if (error == ENOSYS)
+        rho_log_warn(bench_log, "bad opcode (%"PRIu32")", opcode);
+    else if (error == ETIMEDOUT)
+        rho_debug("shed expired request (opcode=%"PRIu32")", opcode);
+    else if (error != 0)
+        rho_log_warn(bench_log, "malformed request (opcode=%"PRIu32")",
+                opcode);
+
+    rpc_stats_done(bench_stats, agent, opcode);
+
+    error = rpc_agent_ready_send(agent);
+    if (error == EMSGSIZE) {
+        rpc_agent_new_msg(agent, EMSGSIZE);
+        error = rpc_agent_ready_send(agent);
+    }
+    return (error);
+}
+
+/*
+ * Runs on a worker thread: the whole handshake, waiting on the (non-blocking)
+ * socket in poll(2) as it goes.  The handshake gets BENCH_HANDSHAKE_TIMEOUT_MS
+ * in all, so that a client that trickles its messages in can't hold the
+ * thread for longer.
+ */
+static void
+bench_client_offload_handshake(struct rpc_agent *agent, void *arg)
+{
+    struct bench_client *client = arg;
+    struct pollfd pfd;
+    uint64_t expiry = 0;
+    uint64_t now = 0;
     int ret = 0;
-    struct bench_client *client = NULL;
-    struct rpc_agent *agent = NULL;
 
-    RHO_ASSERT(event != NULL);
-    RHO_ASSERT(event->userdata != NULL);
-    RHO_ASSERT(loop != NULL);
+    client->cli_error = 0;
+    pfd.fd = agent->ra_sock->fd;
+    expiry = rpc_now_ns() + (uint64_t)BENCH_HANDSHAKE_TIMEOUT_MS * 1000000;
 
-    (void)what;
+    while ((ret = rho_ssl_do_handshake(agent->ra_sock)) != 0) {
+        if (ret != 1 && ret != 2) {
+            client->cli_error = EPROTO;
+            return;
+        }
+        now = rpc_now_ns();
+        if (now >= expiry) {
+            client->cli_error = ETIMEDOUT;
+            return;
+        }
+        pfd.events = (ret == 1) ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        /* rounded up, so as not to wake up just before expiry */
+        ret = poll(&pfd, 1, (int)((expiry - now + 999999) / 1000000));
+        if (ret == 0) {
+            client->cli_error = ETIMEDOUT;
+            return;
+        } else if (ret == -1 && errno != EINTR) {
+            client->cli_error = errno;
+            return;
+        }
+    }
+}
 
-    client = event->userdata;
-    agent = client->cli_agent;
+/* on to the first request; false if the connection can't be used */
+static bool
+bench_client_handshake_done(struct bench_client *client)
+{
+    struct rpc_agent *agent = client->cli_agent;
+
+    if (bench_aead != -1 &&
+            bench_aead_enable(agent, bench_aead, NULL, false) == -1) {
+        rho_log_warn(bench_log, "can't use AEAD record mode: %s",
+                strerror(errno));
+        rpc_agent_set_state(agent, RPC_STATE_ERROR);
+        return (false);
+    }
+    rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
+    agent->ra_event->flags = RHO_EVENT_READ;
+    return (true);
+}
+
+/*
+ * Advance the client's agent as far as it will go without blocking; the
+ * return value says what the client is then waiting for.
+ */
+static int
+bench_client_step(struct bench_client *client)
+{
+    int ret = 0;
+    struct rpc_agent *agent = client->cli_agent;
+    struct rho_event *event = agent->ra_event;
 
     if (agent->ra_state == RPC_STATE_HANDSHAKE) {
+        /* the client has started it: finish it off the loop's thread */
+        if (bench_hs_pool != NULL) {
+            rpc_pool_submit(bench_hs_pool, agent,
+                    bench_client_offload_handshake, client);
+            return (BENCH_CLIENT_PARKED);
+        }
         ret = rho_ssl_do_handshake(agent->ra_sock);
         if (ret == 0) {
             /* ssl handshake complete */
-            agent->ra_state  = RPC_STATE_RECV_HDR;
-            event->flags = RHO_EVENT_READ;
+            if (!bench_client_handshake_done(client))
+                return (BENCH_CLIENT_DONE);
         } else if (ret == 1) {
             /* ssl handshake still in progress */
             event->flags = RHO_EVENT_READ;
-            goto again;
+            return (BENCH_CLIENT_AGAIN);
         } else if (ret == 2) {
             /* ssl handshake still in progress: want_write */
             event->flags = RHO_EVENT_WRITE;
-            goto again;
+            return (BENCH_CLIENT_AGAIN);
         } else {
             /* an error occurred during the handshake */
-            agent->ra_state = RPC_STATE_ERROR; /* not needed */
-            goto done;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR); /* not needed */
+            return (BENCH_CLIENT_DONE);
         }
     }
 
@@ -256,8 +539,10 @@ bench_client_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
     if (agent->ra_state == RPC_STATE_RECV_BODY) 
         rpc_agent_recv_body(agent);
 
-    if (agent->ra_state == RPC_STATE_DISPATCHABLE)
-        bench_client_dispatch_call(client);
+    if (agent->ra_state == RPC_STATE_DISPATCHABLE) {
+        if (bench_client_dispatch_call(client))
+            return (BENCH_CLIENT_PARKED);
+    }
 
     if (agent->ra_state == RPC_STATE_SEND_HDR)
         rpc_agent_send_hdr(agent);
@@ -265,19 +550,276 @@ bench_client_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
     if (agent->ra_state == RPC_STATE_SEND_BODY)
         rpc_agent_send_body(agent);
 
+    if (client->cli_admitted && agent->ra_state == RPC_STATE_RECV_HDR) {
+        /* the response is all sent */
+        rpc_admit_done(bench_admit, agent);
+        client->cli_admitted = false;
+    }
+
     if ((agent->ra_state == RPC_STATE_ERROR) ||
             (agent->ra_state == RPC_STATE_CLOSED)) {
-        goto done;
+        return (BENCH_CLIENT_DONE);
     }
 
-again:
-    rho_event_loop_add(loop, event, NULL); 
-    return;
+    return (BENCH_CLIENT_AGAIN);
+}
+
+static void
+bench_client_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
+{
+    struct bench_client *client = NULL;
+    uint64_t t0 = 0;
+    int step = 0;
+
+    RHO_ASSERT(event != NULL);
+    RHO_ASSERT(event->userdata != NULL);
+    RHO_ASSERT(loop != NULL);
+
+    (void)what;
+
+    client = event->userdata;
+
+    t0 = rpc_now_ns();
+    step = bench_client_step(client);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+
+    switch (step) {
+    case BENCH_CLIENT_AGAIN:
+        rho_event_loop_add(loop, event, NULL); 
+        break;
+    case BENCH_CLIENT_PARKED:
+        break;
+    case BENCH_CLIENT_DONE:
+        rho_log_info(bench_log, "client disconnect");
+        bench_client_destroy(client);
+        break;
+    }
+}
+
+static int
+bench_poller_events(const struct rho_event *event)
+{
+    int events = 0;
+
+    if (event->flags & RHO_EVENT_READ)
+        events |= RPC_POLLER_READ;
+    if (event->flags & RHO_EVENT_WRITE)
+        events |= RPC_POLLER_WRITE;
+
+    return (events);
+}
+
+static void
+bench_client_poll_cb(struct rpc_poller *poller, int fd, int what, void *arg)
+{
+    struct bench_client *client = arg;
+    uint64_t t0 = 0;
+    int step = 0;
+
+    (void)what;
+
+    t0 = rpc_now_ns();
+    step = bench_client_step(client);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+
+    switch (step) {
+    case BENCH_CLIENT_AGAIN:
+        rpc_poller_set(poller, fd,
+                bench_poller_events(client->cli_agent->ra_event));
+        break;
+    case BENCH_CLIENT_PARKED:
+        rpc_poller_set(poller, fd, 0);
+        break;
+    case BENCH_CLIENT_DONE:
+        rho_log_info(bench_log, "client disconnect");
+        rpc_poller_del(poller, fd);
+        bench_client_destroy(client);
+        break;
+    }
+}
+
+/**************************************
+ * WORKER POOL
+ **************************************/
+static void
+bench_pool_done(struct rpc_agent *agent, void *udata, void *arg)
+{
+    struct bench_client *client = udata;
+    struct rho_event_loop *loop = arg;
+
+    RHO_ASSERT(agent == client->cli_agent);
+
+    if (bench_client_finish_call(client, client->cli_error) != 0) {
+        rho_log_info(bench_log, "client disconnect");
+        bench_client_destroy(client);
+        return;
+    }
+
+    /* back in the loop; bench_client_cb sends the response */
+    agent->ra_event->flags = RHO_EVENT_WRITE;
+    rho_event_loop_add(loop, agent->ra_event, NULL);
+}
+
+/* a job left in the pool at exit */
+static void
+bench_pool_discard(struct rpc_agent *agent, void *udata, void *arg)
+{
+    struct bench_client *client = udata;
+
+    (void)arg;
+
+    RHO_ASSERT(agent == client->cli_agent);
 
-done:
-    rho_log_info(bench_log, "client disconnect");
     bench_client_destroy(client);
-    return;
+}
+
+static void
+bench_pool_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
+{
+    uint64_t t0 = rpc_now_ns();
+
+    (void)event;
+    (void)what;
+
+    (void)rpc_pool_reap(bench_pool, bench_pool_done, loop);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+}
+
+static void
+bench_pool_poll_done(struct rpc_agent *agent, void *udata, void *arg)
+{
+    struct bench_client *client = udata;
+    struct rpc_poller *poller = arg;
+
+    RHO_ASSERT(agent == client->cli_agent);
+
+    if (bench_client_finish_call(client, client->cli_error) != 0) {
+        rho_log_info(bench_log, "client disconnect");
+        rpc_poller_del(poller, agent->ra_sock->fd);
+        bench_client_destroy(client);
+        return;
+    }
+    rpc_poller_set(poller, agent->ra_sock->fd, RPC_POLLER_WRITE);
+}
+
+static void
+bench_pool_poll_cb(struct rpc_poller *poller, int fd, int what, void *arg)
+{
+    uint64_t t0 = rpc_now_ns();
+
+    (void)fd;
+    (void)what;
+    (void)arg;
+
+    (void)rpc_pool_reap(bench_pool, bench_pool_poll_done, poller);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+}
+
+/**************************************
+ * HANDSHAKE POOL
+ **************************************/
+static void
+bench_hs_pool_done(struct rpc_agent *agent, void *udata, void *arg)
+{
+    struct bench_client *client = udata;
+    struct rho_event_loop *loop = arg;
+
+    RHO_ASSERT(agent == client->cli_agent);
+
+    if (client->cli_error != 0 || !bench_client_handshake_done(client)) {
+        if (client->cli_error != 0)
+            rho_log_info(bench_log, "handshake failed: %s",
+                    strerror(client->cli_error));
+        rho_log_info(bench_log, "client disconnect");
+        bench_client_destroy(client);
+        return;
+    }
+
+    rho_event_loop_add(loop, agent->ra_event, NULL);
+}
+
+static void
+bench_hs_pool_cb(struct rho_event *event, int what,
+        struct rho_event_loop *loop)
+{
+    uint64_t t0 = rpc_now_ns();
+
+    (void)event;
+    (void)what;
+
+    (void)rpc_pool_reap(bench_hs_pool, bench_hs_pool_done, loop);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+}
+
+static void
+bench_hs_pool_poll_done(struct rpc_agent *agent, void *udata, void *arg)
+{
+    struct bench_client *client = udata;
+    struct rpc_poller *poller = arg;
+
+    RHO_ASSERT(agent == client->cli_agent);
+
+    if (client->cli_error != 0 || !bench_client_handshake_done(client)) {
+        if (client->cli_error != 0)
+            rho_log_info(bench_log, "handshake failed: %s",
+                    strerror(client->cli_error));
+        rho_log_info(bench_log, "client disconnect");
+        rpc_poller_del(poller, agent->ra_sock->fd);
+        bench_client_destroy(client);
+        return;
+    }
+
+    rpc_poller_set(poller, agent->ra_sock->fd, RPC_POLLER_READ);
+}
+
+static void
+bench_hs_pool_poll_cb(struct rpc_poller *poller, int fd, int what,
+        void *arg)
+{
+    uint64_t t0 = rpc_now_ns();
+
+    (void)fd;
+    (void)what;
+    (void)arg;
+
+    (void)rpc_pool_reap(bench_hs_pool, bench_hs_pool_poll_done, poller);
+    rpc_stats_busy(bench_stats, rpc_now_ns() - t0);
+}
+
+/**************************************
+ * PERF COUNTERS
+ **************************************/
+/*
+ * The counters are the event loop thread's: work offloaded to the pool
+ * isn't counted.
+ */
+static void
+bench_perf_request(void)
+{
+    if (bench_perf == NULL)
+        return;
+
+    if (!bench_perf_running) {
+        bench_perf_nrpcs = 0;
+        bench_perf_start(bench_perf);
+        bench_perf_running = true;
+    }
+    bench_perf_nrpcs++;
+}
+
+static void
+bench_perf_idle(void)
+{
+    char line[256];
+
+    if (bench_perf == NULL || !bench_perf_running)
+        return;
+
+    bench_perf_stop(bench_perf);
+    bench_perf_running = false;
+    bench_perf_format(bench_perf, bench_perf_nrpcs, line, sizeof(line));
+    rho_log_info(bench_log, "%"PRIu64" requests; per request, %s",
+            bench_perf_nrpcs, line);
 }
 
 /**************************************
@@ -288,6 +830,8 @@ bench_server_alloc(void)
 {
     struct bench_server *server = NULL;
     server = rhoL_zalloc(sizeof(*server));
+    server->srv_backlog = BENCH_SERVER_BACKLOG;
+    server->srv_spare_fd = -1;
     return (server);
 }
 
@@ -304,6 +848,8 @@ bench_server_destroy(struct bench_server *server)
         }
         rho_sock_destroy(server->srv_sock);
     }
+    if (server->srv_spare_fd != -1)
+        (void)close(server->srv_spare_fd);
 
     rhoL_free(server);
 }
@@ -350,7 +896,9 @@ bench_server_socket_create(struct bench_server *server, const char *url,
     /* TODO: add rho_sock_server_create_from_url function */
     if (rho_str_equal(purl->scheme, "tcp")) {
         port = rho_str_toshort(purl->port, 10);
-        sock = rho_sock_tcp4server_create(purl->host, port, 5);
+        sock = rho_sock_tcp4server_create(purl->host, port,
+                server->srv_backlog);
+        /* accepted sockets inherit it */
         rhoL_setsockopt_disable_nagle(sock->fd);
     } else if (rho_str_equal(purl->scheme, "unix")) {
         pathlen = strlen(purl->path) + 1;
@@ -360,51 +908,184 @@ bench_server_socket_create(struct bench_server *server, const char *url,
         } else {
             strcpy((char *)server->srv_udspath, purl->path);
         }
-        sock = rho_sock_unixserver_create(server->srv_udspath, pathlen, 5);
+        sock = rho_sock_unixserver_create(server->srv_udspath, pathlen,
+                server->srv_backlog);
     } else {
         rho_die("invalid url scheme \"%s\" (url=\"%s\")", purl->scheme, url);
     }
 
     rho_sock_setnonblocking(sock);
     server->srv_sock = sock;
+
+    server->srv_spare_fd = bench_spare_fd_open();
 }
 
-static void
-bench_server_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
+/*
+ * Accept the connections waiting on fd (the non-blocking listening socket),
+ * BENCH_ACCEPT_BATCH at most, then create their clients into clients.
+ * Returns how many connections were accepted; a refused one leaves a NULL in
+ * clients.  If that's BENCH_ACCEPT_BATCH, more may be waiting.
+ */
+static size_t
+bench_server_accept(struct bench_server *server, int fd,
+        struct bench_client **clients)
 {
-    int cfd = 0;
-    struct sockaddr_un addr;
-    socklen_t addrlen = sizeof(addr);
+    int cfds[BENCH_ACCEPT_BATCH];
+    size_t n = 0;
+    size_t i = 0;
     struct rho_event *cevent = NULL;
     struct bench_client *client = NULL;
-    struct bench_server *server = NULL;
     struct rho_sock *csock = NULL;
 
+    while (n < BENCH_ACCEPT_BATCH) {
+        cfds[n] = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfds[n] != -1) {
+            n++;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            continue;
+        if (errno == EMFILE || errno == ENFILE) {
+            bench_accept_shed(bench_log, fd, &server->srv_spare_fd);
+            break;
+        }
+        if (errno == ENOBUFS || errno == ENOMEM) {
+            bench_accept_backoff(bench_log, errno);
+            break;
+        }
+        rho_errno_die(errno, "accept failed");
+    }
+
+    for (i = 0; i < n; i++) {
+        clients[i] = NULL;
+        if (!rpc_admit_conn(bench_admit)) {
+            rho_debug("refusing connection (%"PRIu32" open)",
+                    bench_admit->ad_nconns);
+            (void)close(cfds[i]);
+            continue;
+        }
+
+        csock = rho_sock_unix_from_fd(cfds[i]);
+        if (server->srv_sc != NULL)
+            rho_ssl_wrap(csock, server->srv_sc);
+        client = bench_client_create(csock);
+        if (bench_memfd_threshold > 0 &&
+                rpc_agent_set_memfd_threshold(client->cli_agent,
+                    bench_memfd_threshold) == -1)
+            rho_log_warn(bench_log, "can't use memfd attachments: %s",
+                    strerror(errno));
+        /* over TLS, the key is only known once the handshake is done */
+        if (bench_aead != -1 && csock->ssl == NULL &&
+                bench_aead_enable(client->cli_agent, bench_aead,
+                    bench_aead_key, false) == -1) {
+            rho_log_warn(bench_log, "can't use AEAD record mode: %s",
+                    strerror(errno));
+            bench_client_destroy(client);
+            continue;
+        }
+        rho_log_info(bench_log, "new connection");
+        /* 
+         * XXX: do we have a memory leak with event -- where does it get
+         * destroyed?
+         */
+        cevent = rho_event_create(cfds[i], RHO_EVENT_READ, bench_client_cb,
+                client);
+        client->cli_agent->ra_event = cevent;
+        clients[i] = client;
+    }
+
+    return (n);
+}
+
+static void
+bench_server_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
+{
+    struct bench_client *clients[BENCH_ACCEPT_BATCH];
+    size_t n = 0;
+    size_t i = 0;
+
     RHO_ASSERT(event != NULL);
     RHO_ASSERT(loop != NULL);
     RHO_ASSERT(event->userdata != NULL);
-    server = event->userdata;
 
     (void)what;
 
-    cfd = accept(event->fd, (struct sockaddr *)&addr, &addrlen);
-    if (cfd == -1)
-        rho_errno_die(errno, "accept failed");
-    /* TODO: check that addrlen == sizeof struct soackaddr_un */
-
-    csock = rho_sock_unix_from_fd(cfd);
-    rhoL_setsockopt_disable_nagle(csock->fd);
-    rho_sock_setnonblocking(csock);
-    if (server->srv_sc != NULL)
-        rho_ssl_wrap(csock, server->srv_sc);
-    client = bench_client_create(csock);
-    rho_log_info(bench_log, "new connection");
-    /* 
-     * XXX: do we have a memory leak with event -- where does it get destroyed?
-     */
-    cevent = rho_event_create(cfd, RHO_EVENT_READ, bench_client_cb, client);
-    client->cli_agent->ra_event = cevent;
-    rho_event_loop_add(loop, cevent, NULL); 
+    do {
+        n = bench_server_accept(event->userdata, event->fd, clients);
+        for (i = 0; i < n; i++) {
+            if (clients[i] != NULL)
+                rho_event_loop_add(loop, clients[i]->cli_agent->ra_event,
+                        NULL);
+        }
+    } while (n == BENCH_ACCEPT_BATCH);
+}
+
+static void
+bench_server_poll_cb(struct rpc_poller *poller, int fd, int what, void *arg)
+{
+    struct bench_client *clients[BENCH_ACCEPT_BATCH];
+    size_t n = 0;
+    size_t i = 0;
+
+    (void)what;
+
+    do {
+        n = bench_server_accept(arg, fd, clients);
+        for (i = 0; i < n; i++) {
+            if (clients[i] != NULL)
+                rpc_poller_add(poller, clients[i]->cli_agent->ra_sock->fd,
+                        RPC_POLLER_READ, bench_client_poll_cb, clients[i]);
+        }
+    } while (n == BENCH_ACCEPT_BATCH);
+}
+
+/**************************************
+ * POLLING MODE
+ **************************************/
+static void
+bench_poller_sighandler(int signum)
+{
+    (void)signum;
+
+    rpc_poller_stop(bench_poller);
+}
+
+static void
+bench_poller_run(struct bench_server *server, uint32_t idle_us)
+{
+    const struct rpc_poller_stats *st = NULL;
+    struct sigaction sa;
+
+    bench_poller = rpc_poller_create(idle_us);
+    rpc_poller_add(bench_poller, server->srv_sock->fd, RPC_POLLER_READ,
+            bench_server_poll_cb, server);
+    if (bench_pool != NULL)
+        rpc_poller_add(bench_poller, rpc_pool_fd(bench_pool), RPC_POLLER_READ,
+                bench_pool_poll_cb, NULL);
+    if (bench_hs_pool != NULL)
+        rpc_poller_add(bench_poller, rpc_pool_fd(bench_hs_pool),
+                RPC_POLLER_READ, bench_hs_pool_poll_cb, NULL);
+
+    /* stop (and report) on SIGINT or SIGTERM */
+    rho_memzero(&sa, sizeof(sa));
+    sa.sa_handler = bench_poller_sighandler;
+    sigemptyset(&sa.sa_mask);
+    (void)sigaction(SIGINT, &sa, NULL);
+    (void)sigaction(SIGTERM, &sa, NULL);
+
+    rpc_poller_run(bench_poller);
+
+    st = rpc_poller_get_stats(bench_poller);
+    rho_log_info(bench_log,
+            "polling: spun %.6f s in %"PRIu64" empty sweeps "
+            "(of %"PRIu64"); blocked %"PRIu64" times, for %.6f s",
+            st->ps_spin_ns / 1e9, st->ps_nempty, st->ps_nsweeps,
+            st->ps_nblocks, st->ps_block_ns / 1e9);
+
+    rpc_poller_destroy(bench_poller);
+    bench_poller = NULL;
 }
 
 /**************************************
@@ -445,19 +1126,97 @@ bench_log_init(const char *logfile, bool verbose)
     "       Treat URL path as an abstract socket\n" \
     "       (adds a leading nul byte to path)\n" \
     "\n" \
+    "   -A CIPHER\n" \
+    "       Seal each message with CIPHER (aes-128-gcm, aes-256-gcm, or\n" \
+    "       chacha20-poly1305) instead of sending it through TLS.  The key\n" \
+    "       is exported from each connection's TLS handshake (-Z), or else\n" \
+    "       read from -K.  Clients must use the same -A.\n" \
+    "\n" \
+    "   -b BURST\n" \
+    "       With -r, the number of requests a connection may send at\n" \
+    "       once.  Default is 1.\n" \
+    "\n" \
+    "   -B BACKLOG\n" \
+    "       The listen(2) backlog: how many connections may wait to be\n" \
+    "       accepted; at least 1.  Default is 128 (the kernel caps it at\n" \
+    "       net.core.somaxconn).\n" \
+    "\n" \
+    "   -c MAX_CONNS\n" \
+    "       Refuse connections while MAX_CONNS are open.\n" \
+    "\n" \
     "   -d\n" \
     "       Daemonize\n" \
     "\n" \
+    "   -f FILE\n" \
+    "       Serve the download body from the first DOWNLOAD_SIZE bytes\n" \
+    "       of FILE, using sendfile, instead of from memory.\n" \
+    "\n" \
+    "   -g\n" \
+    "       Back the payload buffer with huge pages, explicit or\n" \
+    "       transparent, if the kernel offers them.\n" \
+    "\n" \
     "   -h\n" \
     "       Show this help message and exit\n" \
     "\n" \
+    "   -H\n" \
+    "       Count cycles, instructions, cache misses, context switches,\n" \
+    "       and page faults (perf_event_open(2)) from the first request\n" \
+    "       until the last client disconnects, and log them per request.\n" \
+    "       Only the event loop thread is counted.\n" \
+    "\n" \
+    "   -K KEY_FILE\n" \
+    "       Without TLS, the pre-shared key for -A: the first 16 (for\n" \
+    "       aes-128-gcm) or 32 bytes of KEY_FILE.\n" \
+    "\n" \
     "   -l LOG_FILE\n" \
     "       Log file to use.  If not specified, logs are printed to stderr.\n" \
     "       If specified, stderr is also redirected to the log file.\n" \
     "\n" \
+    "   -L MAX_LATENCY_US\n" \
+    "       While the mean recent request latency is above\n" \
+    "       MAX_LATENCY_US microseconds, answer new requests EBUSY and\n" \
+    "       refuse new connections.\n" \
+    "\n" \
+    "   -m MEMFD_THRESHOLD\n" \
+    "       For unix sockets, send bodies of at least MEMFD_THRESHOLD\n" \
+    "       bytes as memfd attachments.  The client must also use -m.\n" \
+    "\n" \
+    "   -o OPCODE\n" \
+    "       With -w, run OPCODE (UPLOAD or DOWNLOAD) requests on the worker\n" \
+    "       pool rather than on the event loop.  May be repeated.\n" \
+    "\n" \
+    "   -P IDLE_US\n" \
+    "       Polling mode: rather than sleep until a socket is ready, sweep\n" \
+    "       the sockets with non-blocking polls, and only sleep once none\n" \
+    "       has been ready for IDLE_US microseconds.  On SIGINT or\n" \
+    "       SIGTERM, report the time spent spinning, and exit.\n" \
+    "\n" \
+    "   -q MAX_QUEUE\n" \
+    "       While MAX_QUEUE requests are unanswered, answer new requests\n" \
+    "       EBUSY and refuse new connections.\n" \
+    "\n" \
+    "   -r RATE\n" \
+    "       Limit each connection to RATE requests per second; requests\n" \
+    "       over the limit are answered EAGAIN.\n" \
+    "\n" \
     "   -v\n" \
     "       Verbose logging.\n" \
     "\n" \
+    "   -S NHANDSHAKERS\n" \
+    "       With -Z, do the TLS handshakes on a pool of NHANDSHAKERS\n" \
+    "       threads rather than on the event loop, so that a burst of new\n" \
+    "       connections doesn't hold up the requests of established ones.\n" \
+    "\n" \
+    "   -T TRACE_FILE\n" \
+    "       Trace each connection's state changes and socket I/O, and\n" \
+    "       write the traces to TRACE_FILE as Chrome trace events (for\n" \
+    "       chrome://tracing or Perfetto) as the connections close.  Only\n" \
+    "       the last 4096 events of a connection are kept.\n" \
+    "\n" \
+    "   -w NWORKERS\n" \
+    "       Start a pool of NWORKERS threads for the opcodes given by -o,\n" \
+    "       and for compound requests with an operation among them.\n" \
+    "\n" \
     "   -Z  CACERT CERT PRIVKEY\n" \
     "       Sets the path to the server certificate file and private key\n" \
     "       in PEM format.  This also causes the server to start SSL mode\n" \
@@ -490,28 +1249,106 @@ main(int argc, char *argv[])
     bool anonymous = false;
     bool daemonize  = false;
     const char *logfile = NULL;
+    const char *download_file = NULL;
     bool verbose = false;
+    struct stat st;
+    struct rpc_admit_params admit_params;
+    unsigned int nworkers = 0;
+    unsigned int nhandshakers = 0;
+    bool polling = false;
+    uint32_t idle_us = 0;
+    uint32_t offload_ops[2];
+    unsigned int noffload = 0;
+    unsigned int i = 0;
+    struct rho_event *pool_event = NULL;
+    struct rho_event *hs_pool_event = NULL;
+    const char *tracefile = NULL;
+    bool count_perf = false;
+    const char *aead_keyfile = NULL;
 
     rho_ssl_init();
 
+    rho_memzero(&admit_params, sizeof(admit_params));
+
     server  = bench_server_alloc();
-    while ((c = getopt(argc, argv, "adhl:vZ:")) != -1) {
+    while ((c = getopt(argc, argv, "aA:b:B:c:df:ghHK:l:L:m:o:P:q:r:S:T:vw:Z:")) != -1) {
         switch (c) {
         case 'a':
             anonymous = true;
             break;
+        case 'A':
+            bench_aead = bench_aead_cipher(optarg);
+            break;
+        case 'b':
+            admit_params.ap_burst = rho_str_touint32(optarg, 10);
+            break;
+        case 'B':
+            server->srv_backlog = rho_str_toint(optarg, 10);
+            if (server->srv_backlog <= 0)
+                rho_die("-B BACKLOG must be greater than 0");
+            break;
+        case 'c':
+            admit_params.ap_max_conns = rho_str_touint32(optarg, 10);
+            break;
         case 'd':
             daemonize = true;
             break;
+        case 'f':
+            download_file = optarg;
+            break;
+        case 'g':
+            bench_huge = true;
+            break;
         case 'h':
             usage(EXIT_SUCCESS);
             break;
+        case 'H':
+            count_perf = true;
+            break;
+        case 'K':
+            aead_keyfile = optarg;
+            break;
         case 'l':
             logfile = optarg;
             break;
+        case 'L':
+            admit_params.ap_max_latency_us = rho_str_touint32(optarg, 10);
+            break;
+        case 'm':
+            bench_memfd_threshold = rho_str_touint32(optarg, 10);
+            break;
+        case 'o':
+            if (noffload == sizeof(offload_ops) / sizeof(offload_ops[0]))
+                usage(EXIT_FAILURE);
+            if (rho_str_equal_ci(optarg, "UPLOAD"))
+                offload_ops[noffload++] = BENCH_OP_UPLOAD;
+            else if (rho_str_equal_ci(optarg, "DOWNLOAD"))
+                offload_ops[noffload++] = BENCH_OP_DOWNLOAD;
+            else
+                usage(EXIT_FAILURE);
+            break;
+        case 'P':
+            polling = true;
+            idle_us = rho_str_touint32(optarg, 10);
+            break;
+        case 'q':
+            admit_params.ap_max_queue = rho_str_touint32(optarg, 10);
+            break;
+        case 'r':
+            admit_params.ap_rate = rho_str_touint32(optarg, 10);
+            break;
+        case 'S':
+            nhandshakers = rho_str_touint32(optarg, 10);
+            break;
+        case 'T':
+            tracefile = optarg;
+            break;
         case 'v':
             verbose = true;
             break;
+        case 'w':
+            nworkers = rho_str_touint32(optarg, 10);
+            break;
         case 'Z':
             /* make sure there's three arguments */
             if ((argc - optind) < 2)
@@ -530,6 +1367,15 @@ main(int argc, char *argv[])
     if (argc != 2)
         usage(EXIT_FAILURE);
 
+    if (nhandshakers > 0 && server->srv_sc == NULL)
+        rho_die("-S needs TLS (-Z)");
+
+    if (bench_aead != -1 && server->srv_sc == NULL) {
+        if (aead_keyfile == NULL)
+            rho_die("-A needs TLS (-Z) or a pre-shared key (-K)");
+        bench_aead_key_load(aead_keyfile, bench_aead, bench_aead_key);
+    }
+
     if (daemonize)
         rho_daemon_daemonize(NULL, 0);
 
@@ -544,23 +1390,98 @@ main(int argc, char *argv[])
     rho_log_info(bench_log, "using a download size of %"PRIu32,
             bench_download_size);
 
-    bench_payload = rhoL_zalloc(BENCH_MAX_PAYLOAD_SIZE);
+    if (download_file != NULL) {
+        bench_download_fd = open(download_file, O_RDONLY);
+        if (bench_download_fd == -1)
+            rho_errno_die(errno, "can't open download file \"%s\"",
+                    download_file);
+        if (fstat(bench_download_fd, &st) == -1)
+            rho_errno_die(errno, "can't stat download file \"%s\"",
+                    download_file);
+        if ((uint64_t)st.st_size < bench_download_size)
+            rho_die("download file \"%s\" is smaller than %"PRIu32" bytes",
+                    download_file, bench_download_size);
+    }
+
+    if (tracefile != NULL) {
+        bench_trace_fp = fopen(tracefile, "w");
+        if (bench_trace_fp == NULL)
+            rho_errno_die(errno, "can't open trace file \"%s\"", tracefile);
+        rpc_trace_json_begin(bench_trace_fp, getpid());
+    }
+
+    if (count_perf)
+        bench_perf = bench_perf_create();
+
+    bench_payload = bench_payload_alloc(bench_huge, bench_log);
+    bench_admit = rpc_admit_create(&admit_params);
+    bench_stats = rpc_stats_create();
 
     bench_server_socket_create(server, argv[0], anonymous);
 
+    if (nworkers > 0) {
+        bench_pool = rpc_pool_create(nworkers);
+        for (i = 0; i < noffload; i++)
+            (void)rpc_pool_offload_op(bench_pool, offload_ops[i]);
+        rho_log_info(bench_log, "using %u workers for %u opcodes",
+                nworkers, noffload);
+    }
+
+    if (nhandshakers > 0) {
+        bench_hs_pool = rpc_pool_create(nhandshakers);
+        rho_log_info(bench_log, "using %u threads for TLS handshakes",
+                nhandshakers);
+    }
+
+    if (polling) {
+        bench_poller_run(server, idle_us);
+        goto done;
+    }
+
     event = rho_event_create(server->srv_sock->fd,
             RHO_EVENT_READ | RHO_EVENT_PERSIST, 
             bench_server_cb, server); 
 
     loop = rho_event_loop_create();
     rho_event_loop_add(loop, event, NULL); 
+
+    if (bench_pool != NULL) {
+        pool_event = rho_event_create(rpc_pool_fd(bench_pool),
+                RHO_EVENT_READ | RHO_EVENT_PERSIST, bench_pool_cb, NULL);
+        rho_event_loop_add(loop, pool_event, NULL);
+    }
+
+    if (bench_hs_pool != NULL) {
+        hs_pool_event = rho_event_create(rpc_pool_fd(bench_hs_pool),
+                RHO_EVENT_READ | RHO_EVENT_PERSIST, bench_hs_pool_cb, NULL);
+        rho_event_loop_add(loop, hs_pool_event, NULL);
+    }
+
     rho_event_loop_dispatch(loop);
 
     /* TODO: destroy event and event_loop */
     fprintf(stderr, "HERE\n");
 
+done:
+    /* before the admission control and stats their clients are counted in */
+    if (bench_pool != NULL)
+        rpc_pool_destroy(bench_pool, bench_pool_discard, NULL);
+    if (bench_hs_pool != NULL)
+        rpc_pool_destroy(bench_hs_pool, bench_pool_discard, NULL);
     bench_server_destroy(server);
-    rhoL_free(bench_payload);
+    /* after the discarded clients have written their traces */
+    if (bench_trace_fp != NULL) {
+        rpc_trace_json_end(bench_trace_fp);
+        (void)fclose(bench_trace_fp);
+        bench_trace_fp = NULL;
+    }
+    rpc_admit_destroy(bench_admit);
+    rpc_stats_destroy(bench_stats);
+    if (bench_perf != NULL)
+        bench_perf_destroy(bench_perf);
+    bench_payload_free(bench_payload, bench_huge);
+    if (bench_download_fd != -1)
+        (void)close(bench_download_fd);
 
     return (0);
 }
@@ -1,12 +1,17 @@
+#define _GNU_SOURCE     /* sched_setaffinity, CPU_SET */
+
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,11 +22,14 @@
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/ssl.h>
 
 #include <rho/rho.h>
+#include <rho/rho_ssl.h>
 #include <rpc.h>
+#include <rpc_copy.h>
 
 #include "bench.h"
 
@@ -33,16 +41,64 @@
     "       Treat URL path as an abstract socket\n" \
     "       (adds a leading nul byte to path)\n" \
     "\n" \
+    "   -A CIPHER\n" \
+    "       Seal each message with CIPHER (aes-128-gcm, aes-256-gcm, or\n" \
+    "       chacha20-poly1305) instead of sending it through TLS.  The key\n" \
+    "       is exported from each connection's TLS handshake (-Z), or else\n" \
+    "       generated at random and shared with the clients.\n" \
+    "\n" \
     "   -c RPC_COMMAND\n" \
     "       Must be UPLOAD or DOWNLOAD.  Default is DOWNLOAD.\n" \
     "\n" \
+    "   -C CPU[,CPU...]\n" \
+    "       Pin the clients to these CPUs: client i runs on the i-th CPU\n" \
+    "       of the list, wrapping around.  By default, clients float.\n" \
+    "\n" \
+    "   -g\n" \
+    "       Back the server's and the clients' payload buffers with huge\n" \
+    "       pages, explicit or transparent, if the kernel offers them.\n" \
+    "\n" \
     "   -h\n" \
     "       Show this help message and exit\n" \
     "\n" \
+    "   -i\n" \
+    "       The clients send bodies with a CRC32C trailer, which the\n" \
+    "       server checks (and answers with its own).\n" \
+    "\n" \
+    "   -k K\n" \
+    "       Connection-rate mode: each client opens REQUESTS connections\n" \
+    "       in turn, performs K RPCs (possibly 0) on each, and closes it.\n" \
+    "       Clients report connections per second, and percentiles of\n" \
+    "       the time from connect to the first response (with K = 0, to\n" \
+    "       the end of the handshake; without -Z, that only times the\n" \
+    "       client's connect(2), which the kernel completes before the\n" \
+    "       server accepts the connection); -s records those times.  A\n" \
+    "       pre-shared AEAD key (-A without -Z) can't be used with -k.\n" \
+    "\n" \
     "   -l LOG_FILE\n" \
     "       Log file to use.  If not specified, logs are printed to stderr.\n" \
     "       If specified, stderr is also redirected to the log file.\n" \
     "\n" \
+    "   -m MEMFD_THRESHOLD\n" \
+    "       For unix sockets, send bodies of at least MEMFD_THRESHOLD\n" \
+    "       bytes as memfd attachments.\n" \
+    "\n" \
+    "   -n CLIENTS\n" \
+    "       Fork CLIENTS client processes, each of which performs REQUESTS\n" \
+    "       requests on its own connection.  Default is 1.\n" \
+    "\n" \
+    "   -P CPU\n" \
+    "       Pin the server to CPU.  By default, the server floats.\n" \
+    "\n" \
+    "   -R\n" \
+    "       With -k and -Z (and only then), resume each client's first\n" \
+    "       TLS session on its later connections, rather than do full\n" \
+    "       handshakes.\n" \
+    "\n" \
+    "   -s SAMPLES_FILE\n" \
+    "       Time each RPC, and append the times (in ns, one per line) to\n" \
+    "       SAMPLES_FILE.  Each client appends its times with one write.\n" \
+    "\n" \
     "   -v\n" \
     "       Verbose logging.\n" \
     "\n" \
@@ -60,11 +116,18 @@
     "       The size of the download/upload body (must be <= 10 MiB)\n" \
     "\n" \
     "   REQUESTS\n" \
-    "       The number of requests to perform\n"
+    "       The number of requests to perform (with -k, of connections\n" \
+    "       to open)\n"
+
+#define BENCH_MAX_CPUS  64
+
+/* listen(2) backlog: enough for the clients of -k to reconnect at once */
+#define RPCSERVER_BACKLOG   128
 
 struct rpcserver {
     struct rho_sock *srv_sock;
     struct rho_ssl_ctx *srv_sc;
+    int srv_spare_fd;   /* given up to shed a connection when out of fds */
     /* TODO: don't hardcode 108 */
     uint8_t srv_udspath[108];
 };
@@ -73,13 +136,12 @@ struct rpcserver_client {
     struct rpc_agent *cli_agent;
 };
 
-typedef void (*bench_opcall)(struct rpcserver_client *client);
-
 /**************************************
  * FORWARD DECLARATIONS
  **************************************/
-static void rpcserver_upload_proxy(struct rpcserver_client *client);
-static void rpcserver_download_proxy(struct rpcserver_client *client);
+static void rpcserver_upload_proxy(struct rpc_agent *agent,
+        const struct bench_upload_req *req, void *arg);
+static void rpcserver_download_proxy(struct rpc_agent *agent, void *arg);
 
 static struct rpcserver_client * rpcserver_client_alloc(void);
 static struct rpcserver_client * rpcserver_client_create(struct rho_sock *sock);
@@ -96,8 +158,11 @@ static void rpcserver_socket_create(struct rpcserver *server,
         const char *url, bool anonymous);
 static void rpcserver_cb(struct rho_event *event, int what,
         struct rho_event_loop *loop);
+static void rpcserver_child_cb(struct rho_event *event, int what,
+        struct rho_event_loop *loop);
 
 static void bench_log_init(const char *logfile, bool verbose);
+static void bench_pin(int cpu);
 
 static void usage(int exitcode);
 
@@ -111,10 +176,23 @@ static uint8_t *g_bench_payload = NULL;
 static uint32_t g_bench_payload_size = 0;
 static uint32_t g_bench_op_code = BENCH_OP_DOWNLOAD;
 static int g_bench_num_requests = 0;
-
-static bench_opcall bench_opcalls[] = {
-    [BENCH_OP_UPLOAD]   = rpcserver_upload_proxy,
-    [BENCH_OP_DOWNLOAD] = rpcserver_download_proxy,
+static const char *g_bench_samples_path = NULL;
+static bool g_bench_huge = false;
+static bool g_bench_crc = false;
+static int g_bench_aead = -1;
+static uint8_t g_bench_aead_key[RPC_AEAD_MAX_KEYLEN];
+static uint64_t *g_bench_samples = NULL;   /* per-RPC ns, if timing each */
+static size_t g_bench_memfd_threshold = 0;
+static int g_bench_nclients = 1;
+static int g_bench_conn_rpcs = -1;      /* -k: RPCs per connection */
+static bool g_bench_resume = false;
+static uint32_t g_bench_nconns = 0;     /* the server's, for -k */
+static uint64_t g_bench_start_ns = 0;
+static pid_t *g_bench_children = NULL;
+
+static const struct bench_ops bench_ops = {
+    .upload     = rpcserver_upload_proxy,
+    .download   = rpcserver_download_proxy,
 };
 
 /**************************************
@@ -126,19 +204,17 @@ static bench_opcall bench_opcalls[] = {
  * server responds with empty body
  */
 static void
-rpcserver_upload_proxy(struct rpcserver_client *client)
+rpcserver_upload_proxy(struct rpc_agent *agent,
+        const struct bench_upload_req *req, void *arg)
 {
-    struct rpc_agent *agent = client->cli_agent;
-    struct rho_buf *buf = agent->ra_bodybuf;
-    uint32_t size = 0;
+    (void)arg;
 
     RHO_TRACE_ENTER("bodylen=%"PRIu32, agent->ra_hdr.rh_bodylen);
 
-    size = agent->ra_hdr.rh_bodylen;
-    if (size > 0)
-        rho_buf_read(buf, g_bench_payload, size);
+    if (req->payload_len > 0)
+        rpc_copy(g_bench_payload, req->payload, req->payload_len);
 
-    rpc_agent_new_msg(agent, 0);
+    bench_upload_reply(agent, 0);
 
     RHO_TRACE_EXIT();
     return;
@@ -152,17 +228,18 @@ rpcserver_upload_proxy(struct rpcserver_client *client)
 static uint32_t tot_rpcs = 0;
 #endif
 static void
-rpcserver_download_proxy(struct rpcserver_client *client)
+rpcserver_download_proxy(struct rpc_agent *agent, void *arg)
 {
-    struct rpc_agent *agent = client->cli_agent;
-    struct rho_buf *buf = agent->ra_bodybuf;
+    struct bench_download_resp resp;
+
+    (void)arg;
 
     RHO_TRACE_ENTER("bodylen=%"PRIu32, agent->ra_hdr.rh_bodylen);
 
-    rpc_agent_new_msg(agent, 0);
-    rpc_agent_set_bodylen(agent, g_bench_payload_size);
     /* XXX: ideally, the bench measuremnts wouldn't include this memcpy */
-    rho_buf_write(buf, g_bench_payload, g_bench_payload_size);
+    resp.payload = g_bench_payload;
+    resp.payload_len = g_bench_payload_size;
+    bench_download_reply(agent, 0, &resp);
 
 #if 0
     rho_log_info(bench_log, "RPC %"PRIu32, tot_rpcs);
@@ -205,9 +282,9 @@ rpcserver_client_create(struct rho_sock *sock)
 
     /* has an ssl_ctx */
     if (sock->ssl != NULL)
-        agent->ra_state = RPC_STATE_HANDSHAKE;
+        rpc_agent_set_state(agent, RPC_STATE_HANDSHAKE);
     else
-        agent->ra_state = RPC_STATE_RECV_HDR;
+        rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
 
     RHO_TRACE_EXIT();
     return (client);
@@ -216,10 +293,22 @@ rpcserver_client_create(struct rho_sock *sock)
 static void
 rpcserver_client_destroy(struct rpcserver_client *client)
 {
+    const struct rpc_io_stats *io = NULL;
+
     RHO_ASSERT(client != NULL);
 
     RHO_TRACE_ENTER();
 
+    io = rpc_agent_io_stats(client->cli_agent);
+    if (io->is_nmsgs_in > 0)
+        rho_log_info(bench_log,
+                "server: per request, %.2f syscalls (%.2f EAGAIN, "
+                "%.2f partial) in %.2f passes",
+                (double)(io->is_nrecvs + io->is_nsends) / io->is_nmsgs_in,
+                (double)io->is_nagain / io->is_nmsgs_in,
+                (double)io->is_npartial / io->is_nmsgs_in,
+                (double)io->is_npasses / io->is_nmsgs_in);
+
     rpc_agent_destroy(client->cli_agent);
     rhoL_free(client);
 
@@ -231,24 +320,27 @@ rpcserver_client_dispatch_call(struct rpcserver_client *client)
 {
     struct rpc_agent *agent = client->cli_agent;
     uint32_t opcode = agent->ra_hdr.rh_code;
-    bench_opcall opcall = NULL;
+    int error = 0;
 
     RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE);
     RHO_ASSERT(rho_buf_tell(agent->ra_bodybuf) == 0);
 
     RHO_TRACE_ENTER("fd=%d, opcode=%d", agent->ra_sock->fd, opcode);
 
-    if (opcode >= RHO_C_ARRAY_SIZE(bench_opcalls)) {
+    error = bench_dispatch(agent, &bench_ops, client);
+    if (error == ENOSYS)
         rho_log_warn(bench_log, "bad opcode (%"PRIu32")", opcode);
-        rpc_agent_new_msg(agent, ENOSYS);
-        goto done;
-    } 
-
-    opcall = bench_opcalls[opcode];
-    opcall(client);
-
-done:
-    rpc_agent_ready_send(agent);
+    else if (error == ETIMEDOUT)
+        rho_debug("shed expired request (opcode=%"PRIu32")", opcode);
+    else if (error != 0)
+        rho_log_warn(bench_log, "malformed request (opcode=%"PRIu32")",
+                opcode);
+
+    /* on failure, the agent is in RPC_STATE_ERROR, and the client dropped */
+    if (rpc_agent_ready_send(agent) == EMSGSIZE) {
+        rpc_agent_new_msg(agent, EMSGSIZE);
+        (void)rpc_agent_ready_send(agent);
+    }
     RHO_TRACE_EXIT();
     return;
 }
@@ -273,7 +365,15 @@ rpcserver_client_cb(struct rho_event *event, int what, struct rho_event_loop *lo
         ret = rho_ssl_do_handshake(agent->ra_sock);
         if (ret == 0) {
             /* ssl handshake complete */
-            agent->ra_state  = RPC_STATE_RECV_HDR;
+            if (g_bench_aead != -1 &&
+                    bench_aead_enable(agent, g_bench_aead, NULL,
+                        false) == -1) {
+                rho_log_warn(bench_log, "can't use AEAD record mode: %s",
+                        strerror(errno));
+                rpc_agent_set_state(agent, RPC_STATE_ERROR);
+                goto done;
+            }
+            rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
             event->flags = RHO_EVENT_READ;
         } else if (ret == 1) {
             /* ssl handshake still in progress */
@@ -285,7 +385,7 @@ rpcserver_client_cb(struct rho_event *event, int what, struct rho_event_loop *lo
             goto again;
         } else {
             /* an error occurred during the handshake */
-            agent->ra_state = RPC_STATE_ERROR; /* not needed */
+            rpc_agent_set_state(agent, RPC_STATE_ERROR); /* not needed */
             goto done;
         }
     }
@@ -329,6 +429,7 @@ rpcserver_alloc(void)
 {
     struct rpcserver *server = NULL;
     server = rhoL_zalloc(sizeof(*server));
+    server->srv_spare_fd = -1;
     return (server);
 }
 
@@ -345,6 +446,8 @@ rpcserver_destroy(struct rpcserver *server)
         }
         rho_sock_destroy(server->srv_sock);
     }
+    if (server->srv_spare_fd != -1)
+        (void)close(server->srv_spare_fd);
 
     rhoL_free(server);
 }
@@ -391,7 +494,8 @@ rpcserver_socket_create(struct rpcserver *server, const char *url,
     /* TODO: add rho_sock_server_create_from_url function */
     if (rho_str_equal(purl->scheme, "tcp")) {
         port = rho_str_toshort(purl->port, 10);
-        sock = rho_sock_tcp4server_create(purl->host, port, 5);
+        sock = rho_sock_tcp4server_create(purl->host, port,
+                RPCSERVER_BACKLOG);
         rhoL_setsockopt_disable_nagle(sock->fd);
     } else if (rho_str_equal(purl->scheme, "unix")) {
         pathlen = strlen(purl->path) + 1;
@@ -401,13 +505,16 @@ rpcserver_socket_create(struct rpcserver *server, const char *url,
         } else {
             strcpy((char *)server->srv_udspath, purl->path);
         }
-        sock = rho_sock_unixserver_create(server->srv_udspath, pathlen, 5);
+        sock = rho_sock_unixserver_create(server->srv_udspath, pathlen,
+                RPCSERVER_BACKLOG);
     } else {
         rho_die("invalid url scheme \"%s\" (url=\"%s\")", purl->scheme, url);
     }
 
     rho_sock_setnonblocking(sock);
     server->srv_sock = sock;
+
+    server->srv_spare_fd = bench_spare_fd_open();
 }
 
 static void
@@ -429,16 +536,43 @@ rpcserver_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
     (void)what;
 
     cfd = accept(event->fd, (struct sockaddr *)&addr, &addrlen);
-    if (cfd == -1)
+    if (cfd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED || errno == EPROTO)
+            return;
+        if (errno == EMFILE || errno == ENFILE) {
+            bench_accept_shed(bench_log, event->fd, &server->srv_spare_fd);
+            return;
+        }
+        if (errno == ENOBUFS || errno == ENOMEM) {
+            bench_accept_backoff(bench_log, errno);
+            return;
+        }
         rho_errno_die(errno, "accept failed");
+    }
     /* TODO: check that addrlen == sizeof struct soackaddr_un */
+    g_bench_nconns++;
 
     csock = rho_sock_unix_from_fd(cfd);
     rho_sock_setnonblocking(csock);
     if (server->srv_sc != NULL)
         rho_ssl_wrap(csock, server->srv_sc);
     client = rpcserver_client_create(csock);
-    rho_log_info(bench_log, "new connection");
+    if (g_bench_memfd_threshold > 0 &&
+            rpc_agent_set_memfd_threshold(client->cli_agent,
+                g_bench_memfd_threshold) == -1)
+        rho_log_warn(bench_log, "can't use memfd attachments: %s",
+                strerror(errno));
+    /* over TLS, the key is only known once the handshake is done */
+    if (g_bench_aead != -1 && csock->ssl == NULL &&
+            bench_aead_enable(client->cli_agent, g_bench_aead,
+                g_bench_aead_key, false) == -1) {
+        rho_log_warn(bench_log, "can't use AEAD record mode: %s",
+                strerror(errno));
+        rpcserver_client_destroy(client);
+        return;
+    }
+    rho_debug("new connection");
     /* 
      * XXX: do we have a memory leak with event -- where does it get destroyed?
      */
@@ -447,6 +581,86 @@ rpcserver_cb(struct rho_event *event, int what, struct rho_event_loop *loop)
     rho_event_loop_add(loop, cevent, NULL); 
 }
 
+/* 
+ * The clients (children) hold the write end of the pipe that event watches,
+ * so the pipe reads EOF once they have all exited; the server then exits,
+ * too: successfully if every client did.
+ */
+static void
+rpcserver_child_cb(struct rho_event *event, int what,
+        struct rho_event_loop *loop)
+{
+    int i = 0;
+    int status = 0;
+    int exitcode = EXIT_SUCCESS;
+    double secs = 0;
+    struct rpcserver *server = NULL;
+
+    RHO_ASSERT(event != NULL);
+    RHO_ASSERT(event->userdata != NULL);
+
+    (void)what;
+    (void)loop;
+
+    server = event->userdata;
+
+    for (i = 0; i < g_bench_nclients; i++) {
+        if (waitpid(g_bench_children[i], &status, 0) == -1)
+            rho_errno_die(errno, "waitpid failed");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            exitcode = EXIT_FAILURE;
+    }
+    rho_log_info(bench_log, "clients exited; shutting down");
+    if (g_bench_conn_rpcs != -1) {
+        secs = (rpc_now_ns() - g_bench_start_ns) / 1e9;
+        rho_log_info(bench_log,
+                "server: %"PRIu32" connections in %.6f s (%.1f per second)",
+                g_bench_nconns, secs, g_bench_nconns / secs);
+    }
+
+    rpcserver_destroy(server);
+    bench_payload_free(g_bench_payload, g_bench_huge);
+    rhoL_free(g_bench_children);
+    exit(exitcode);
+}
+
+/**************************************
+ * CPU PINNING
+ **************************************/
+
+/* pin the calling process to cpu (if cpu is -1, leave it free to float) */
+static void
+bench_pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu == -1)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        rho_errno_die(errno, "can't pin to cpu %d", cpu);
+}
+
+static int
+bench_parse_cpus(char *s, int *cpus)
+{
+    int n = 0;
+    char *tok = NULL;
+
+    for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (n == BENCH_MAX_CPUS)
+            usage(EXIT_FAILURE);
+        cpus[n] = rho_str_toint(tok, 10);
+        if (cpus[n] < 0 || cpus[n] >= CPU_SETSIZE)
+            usage(EXIT_FAILURE);
+        n++;
+    }
+
+    return (n);
+}
+
 /**************************************
  * LOG
  **************************************/
@@ -488,20 +702,24 @@ rpcclient_do_upload_bench(struct rpc_agent *agent)
 {
     int i = 0;
     int error = 0;
-    struct rho_buf *buf = agent->ra_bodybuf;
+    uint64_t t0 = 0;
+    struct bench_upload_req req;
     struct timeval start;
     struct timeval end;
     struct timeval elapsed;
 
+    req.payload = g_bench_payload;
+    req.payload_len = g_bench_payload_size;
+
     (void)gettimeofday(&start, NULL);
     for (i = 0; i < g_bench_num_requests; i++) {
-        rpc_agent_new_msg(agent, g_bench_op_code);
-        rpc_agent_set_bodylen(agent, g_bench_payload_size);
-        rho_buf_write(buf, g_bench_payload, g_bench_payload_size);
-
-        error = rpc_agent_request(agent);
+        if (g_bench_samples != NULL)
+            t0 = rpc_now_ns();
+        error = bench_upload(agent, &req);
         if (error != 0)
-            rho_die("rpc_agent_request returned %d", error);
+            rho_die("bench_upload returned %d", error);
+        if (g_bench_samples != NULL)
+            g_bench_samples[i] = rpc_now_ns() - t0;
 
         rho_debug("%d/%d status=%"PRIu32", download size=%"PRIu32,
                 i, g_bench_num_requests,
@@ -519,23 +737,24 @@ rpcclient_do_download_bench(struct rpc_agent *agent)
 {
     int i = 0;
     int error = 0;
-    struct rho_buf *buf = agent->ra_bodybuf;
-    uint32_t n = 0;
+    uint64_t t0 = 0;
+    struct bench_download_resp resp;
     struct timeval start;
     struct timeval end;
     struct timeval elapsed;
 
     (void)gettimeofday(&start, NULL);
     for (i = 0; i < g_bench_num_requests; i++) {
-        rpc_agent_new_msg(agent, g_bench_op_code);
-
-        error = rpc_agent_request(agent);
+        if (g_bench_samples != NULL)
+            t0 = rpc_now_ns();
+        error = bench_download(agent, &resp);
         if (error != 0)
-            rho_die("rpc_agent_request returned %d", error);
+            rho_die("bench_download returned %d", error);
+        if (g_bench_samples != NULL)
+            g_bench_samples[i] = rpc_now_ns() - t0;
 
-        n = agent->ra_hdr.rh_bodylen;
-        if (n > 0)
-            rho_buf_read(buf, g_bench_payload, n);
+        if (resp.payload_len > 0)
+            rpc_copy(g_bench_payload, resp.payload, resp.payload_len);
 
         rho_debug("%d/%d status=%"PRIu32", download size=%"PRIu32,
                 i, g_bench_num_requests, 
@@ -548,17 +767,65 @@ rpcclient_do_download_bench(struct rpc_agent *agent)
     return (rho_timeval_to_sec_double(&elapsed) / (1.0 * g_bench_num_requests));
 }
 
+/* 
+ * Append the per-RPC times to g_bench_samples_path.  The whole list is
+ * formatted first and written at once, so that the lines of clients that
+ * finish together don't interleave.
+ */
+static void
+rpcclient_write_samples(void)
+{
+    int fd = -1;
+    int i = 0;
+    size_t len = 0;
+    size_t cap = (size_t)g_bench_num_requests * 21;  /* a u64, newline */
+    char *text = rhoL_zalloc(cap + 1);
+
+    for (i = 0; i < g_bench_num_requests; i++)
+        len += snprintf(text + len, cap + 1 - len, "%"PRIu64"\n",
+                g_bench_samples[i]);
+
+    fd = open(g_bench_samples_path, O_WRONLY|O_APPEND|O_CREAT,
+            S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd == -1)
+        rho_errno_die(errno, "can't open samples file \"%s\"",
+                g_bench_samples_path);
+    if (write(fd, text, len) != (ssize_t)len)
+        rho_errno_die(errno, "can't write samples file \"%s\"",
+                g_bench_samples_path);
+    (void)close(fd);
+
+    rhoL_free(text);
+}
+
+static struct rho_ssl_ctx *
+rpcclient_ssl_ctx_create(const char *root_crt_path)
+{
+    struct rho_ssl_params *params = NULL;
+    struct rho_ssl_ctx *ctx = NULL;
+
+    rho_debug("using TLS");
+    params = rho_ssl_params_create();
+    rho_ssl_params_set_mode(params, RHO_SSL_MODE_CLIENT);
+    rho_ssl_params_set_protocol(params, RHO_SSL_PROTOCOL_TLSv1_2);
+    rho_ssl_params_set_ca_file(params, root_crt_path);
+    rho_ssl_params_set_verify(params, true);
+    ctx = rho_ssl_ctx_create(params);
+    rho_ssl_params_destroy(params);
+
+    return (ctx);
+}
+
+/* with ctx, over TLS, and resuming session if it isn't NULL */
 static struct rpc_agent *
-rpcclient_do_connect(const char *url, const char *root_crt_path)
+rpcclient_do_connect(const char *url, struct rho_ssl_ctx *ctx,
+        SSL_SESSION *session)
 {
     int error = 0;
     struct rho_sock *sock = NULL;
     struct rpc_agent *agent = NULL;
-    struct rho_ssl_params *params = NULL;
-    struct rho_ssl_ctx *ctx = NULL;
 
-    fprintf(stderr, "rpcclient_do_connect: url=\"%s\", root_crt_path=\"%s\"\n",
-            url, root_crt_path);
+    rho_debug("rpcclient_do_connect: url=\"%s\"", url);
 
     sock = rho_sock_from_url(url);
     if (sock == NULL)
@@ -569,20 +836,14 @@ rpcclient_do_connect(const char *url, const char *root_crt_path)
         rho_errno_die(errno, "cannot connect to url \"%s\"", url);
 
     if (rho_str_startswith(url, "tcp:") || rho_str_startswith(url, "tcp4:")) { 
-        fprintf(stderr, "disabling nagle's algorithm for tcp\n");
+        rho_debug("disabling nagle's algorithm for tcp");
         rhoL_setsockopt_disable_nagle(sock->fd);
     }
 
-    if (root_crt_path != NULL) {
-        rho_debug("using TLS");
-        params = rho_ssl_params_create();
-        rho_ssl_params_set_mode(params, RHO_SSL_MODE_CLIENT);
-        rho_ssl_params_set_protocol(params, RHO_SSL_PROTOCOL_TLSv1_2);
-        rho_ssl_params_set_ca_file(params, root_crt_path);
-        rho_ssl_params_set_verify(params, true);
-        ctx = rho_ssl_ctx_create(params);
+    if (ctx != NULL) {
         rho_ssl_wrap(sock, ctx);
-        rho_ssl_params_destroy(params);
+        if (session != NULL && SSL_set_session(sock->ssl->ssl, session) != 1)
+            rho_die("SSL_set_session failed");
 
         while (1) {
             error = rho_ssl_do_handshake(sock);
@@ -598,13 +859,178 @@ done:
     return (agent);
 }
 
+/* 
+ * Block until the server is listening: it writes a byte for each client to
+ * the pipe that fd reads, once its socket is ready.
+ */
+static void
+rpcclient_wait_ready(int fd)
+{
+    ssize_t n = 0;
+    uint8_t c = 0;
+
+    do {
+        n = read(fd, &c, 1);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+        rho_errno_die(errno, "can't read readiness pipe");
+    if (n == 0)
+        rho_die("server exited before it was ready");
+    (void)close(fd);
+}
+
+/* the per-connection options: -i, -A, -m */
+static void
+rpcclient_agent_setup(struct rpc_agent *agent)
+{
+    rpc_agent_set_crc(agent, g_bench_crc);
+    if (g_bench_aead != -1 &&
+            bench_aead_enable(agent, g_bench_aead, g_bench_aead_key,
+                true) == -1)
+        rho_errno_die(errno, "can't use AEAD record mode");
+    if (g_bench_memfd_threshold > 0 &&
+            rpc_agent_set_memfd_threshold(agent, g_bench_memfd_threshold) == -1)
+        rho_errno_die(errno, "can't use memfd attachments");
+}
+
+/* one RPC of the -c kind */
+static void
+rpcclient_do_call(struct rpc_agent *agent)
+{
+    int error = 0;
+    struct bench_upload_req req;
+    struct bench_download_resp resp;
+
+    if (g_bench_op_code == BENCH_OP_UPLOAD) {
+        req.payload = g_bench_payload;
+        req.payload_len = g_bench_payload_size;
+        error = bench_upload(agent, &req);
+    } else {
+        error = bench_download(agent, &resp);
+        if (error == 0 && resp.payload_len > 0)
+            rpc_copy(g_bench_payload, resp.payload, resp.payload_len);
+    }
+    if (error != 0)
+        rho_die("RPC returned %d", error);
+}
+
+static int
+rpcclient_sample_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return ((x > y) - (x < y));
+}
+
+/* the q-quantile of the n sorted samples (nearest rank), in seconds */
+static double
+rpcclient_quantile(const uint64_t *samples, int n, double q)
+{
+    int i = (int)(q * n + 0.999999);
+
+    if (i < 1)
+        i = 1;
+    return (samples[i - 1] / 1e9);
+}
+
+/*
+ * Connection-rate mode (-k): open g_bench_num_requests connections in turn,
+ * performing g_bench_conn_rpcs RPCs on each before closing it, and time
+ * each from the connect to its first response.
+ */
+static void
+rpcclient_do_conn_bench(const char *url, struct rho_ssl_ctx *ctx)
+{
+    int i = 0;
+    int j = 0;
+    int nresumed = 0;
+    int n = g_bench_num_requests;
+    uint64_t t0 = 0;
+    uint64_t start = 0;
+    double secs = 0;
+    struct rpc_agent *agent = NULL;
+    SSL *ssl = NULL;
+    SSL_SESSION *session = NULL;
+    const char *until = NULL;
+
+    g_bench_samples = rhoL_zalloc(n * sizeof(*g_bench_samples));
+
+    start = rpc_now_ns();
+    for (i = 0; i < n; i++) {
+        t0 = rpc_now_ns();
+        agent = rpcclient_do_connect(url, ctx, session);
+        rpcclient_agent_setup(agent);
+        for (j = 0; j < g_bench_conn_rpcs; j++) {
+            rpcclient_do_call(agent);
+            if (j == 0)
+                g_bench_samples[i] = rpc_now_ns() - t0;
+        }
+        if (g_bench_conn_rpcs == 0)
+            g_bench_samples[i] = rpc_now_ns() - t0;
+
+        if (ctx != NULL) {
+            ssl = agent->ra_sock->ssl->ssl;
+            if (SSL_session_reused(ssl))
+                nresumed++;
+            if (g_bench_resume && session == NULL)
+                session = SSL_get1_session(ssl);
+        }
+        rpc_agent_destroy(agent);
+    }
+    secs = (rpc_now_ns() - start) / 1e9;
+
+    if (session != NULL)
+        SSL_SESSION_free(session);
+    if (g_bench_samples_path != NULL)
+        rpcclient_write_samples();
+
+    if (g_bench_conn_rpcs > 0)
+        until = "first response";
+    else if (ctx != NULL)
+        until = "handshake";
+    else
+        until = "connected";
+
+    qsort(g_bench_samples, n, sizeof(*g_bench_samples), rpcclient_sample_cmp);
+    printf("%d connections (%d resumed) of %d RPCs in %.6f s: "
+            "%.1f connections/s\n",
+            n, nresumed, g_bench_conn_rpcs, secs, n / secs);
+    printf("connect to %s: p50 %.9f s, p90 %.9f s, p99 %.9f s, "
+            "max %.9f s\n", until,
+            rpcclient_quantile(g_bench_samples, n, 0.50),
+            rpcclient_quantile(g_bench_samples, n, 0.90),
+            rpcclient_quantile(g_bench_samples, n, 0.99),
+            g_bench_samples[n - 1] / 1e9);
+
+    rhoL_free(g_bench_samples);
+}
+
 static void
 rpcclient_main(const char *url, const char *root_crt)
 {
     struct rpc_agent *agent = NULL;
+    struct rho_ssl_ctx *ctx = NULL;
     double mean = 0;
+    const struct rpc_io_stats *io = NULL;
+    struct rusage ru0;
+    struct rusage ru1;
+
+    if (root_crt != NULL)
+        ctx = rpcclient_ssl_ctx_create(root_crt);
 
-    agent = rpcclient_do_connect(url, root_crt);
+    if (g_bench_conn_rpcs != -1) {
+        rpcclient_do_conn_bench(url, ctx);
+        goto done;
+    }
+
+    agent = rpcclient_do_connect(url, ctx, NULL);
+    rpcclient_agent_setup(agent);
+    if (g_bench_samples_path != NULL)
+        g_bench_samples = rhoL_zalloc(g_bench_num_requests *
+                sizeof(*g_bench_samples));
+    (void)getrusage(RUSAGE_SELF, &ru0);
     if (g_bench_op_code == BENCH_OP_UPLOAD) {
         rho_debug("doing %d upload requests", g_bench_num_requests);
         mean = rpcclient_do_upload_bench(agent);
@@ -618,9 +1044,35 @@ rpcclient_main(const char *url, const char *root_crt)
     } else {
         RHO_ASSERT("invalid bench op code");
     }
+    (void)getrusage(RUSAGE_SELF, &ru1);
+
+    /* the body buffers' growth, on the first RPCs, shows up here */
+    printf("per RPC: %.2f page faults (%.2f major)\n",
+            (double)(ru1.ru_minflt - ru0.ru_minflt + ru1.ru_majflt -
+                ru0.ru_majflt) / g_bench_num_requests,
+            (double)(ru1.ru_majflt - ru0.ru_majflt) / g_bench_num_requests);
+
+    io = rpc_agent_io_stats(agent);
+    if (io->is_nmsgs_out > 0)
+        printf("per RPC: %.2f syscalls (%.2f recvs, %.2f sends), "
+                "%.2f EAGAIN, %.2f partial\n",
+                (double)(io->is_nrecvs + io->is_nsends) / io->is_nmsgs_out,
+                (double)io->is_nrecvs / io->is_nmsgs_out,
+                (double)io->is_nsends / io->is_nmsgs_out,
+                (double)io->is_nagain / io->is_nmsgs_out,
+                (double)io->is_npartial / io->is_nmsgs_out);
+
+    if (g_bench_samples != NULL) {
+        rpcclient_write_samples();
+        rhoL_free(g_bench_samples);
+    }
 
    rpc_agent_destroy(agent);
-   rhoL_free(g_bench_payload);
+
+done:
+   if (ctx != NULL)
+       rho_ssl_ctx_destroy(ctx);
+   bench_payload_free(g_bench_payload, g_bench_huge);
 }
 
 static void
@@ -641,17 +1093,26 @@ main(int argc, char *argv[])
     bool anonymous = false;
     const char *logfile = NULL;
     bool verbose = false;
+    int i = 0;
     pid_t pid;
+    int ready_fds[2];
+    int child_fds[2];
+    int server_cpu = -1;
+    int client_cpus[BENCH_MAX_CPUS];
+    int nclient_cpus = 0;
     const char *root_crt = NULL;
 
     rho_ssl_init();
 
     server  = rpcserver_alloc();
-    while ((c = getopt(argc, argv, "ac:dhl:vZ:")) != -1) {
+    while ((c = getopt(argc, argv, "aA:c:C:dghik:l:m:n:P:Rs:vZ:")) != -1) {
         switch (c) {
         case 'a':
             anonymous = true;
             break;
+        case 'A':
+            g_bench_aead = bench_aead_cipher(optarg);
+            break;
         case 'c':
             if (rho_str_equal_ci(optarg, "UPLOAD")) {
                 g_bench_op_code = BENCH_OP_UPLOAD;
@@ -662,12 +1123,45 @@ main(int argc, char *argv[])
                 exit(1);
             }
             break;
+        case 'C':
+            nclient_cpus = bench_parse_cpus(optarg, client_cpus);
+            break;
+        case 'g':
+            g_bench_huge = true;
+            break;
         case 'h':
             usage(EXIT_SUCCESS);
             break;
+        case 'i':
+            g_bench_crc = true;
+            break;
+        case 'k':
+            g_bench_conn_rpcs = rho_str_toint(optarg, 10);
+            if (g_bench_conn_rpcs < 0)
+                usage(EXIT_FAILURE);
+            break;
         case 'l':
             logfile = optarg;
             break;
+        case 'm':
+            g_bench_memfd_threshold = rho_str_touint32(optarg, 10);
+            break;
+        case 'n':
+            g_bench_nclients = rho_str_toint(optarg, 10);
+            if (g_bench_nclients <= 0)
+                usage(EXIT_FAILURE);
+            break;
+        case 'P':
+            server_cpu = rho_str_toint(optarg, 10);
+            if (server_cpu < 0 || server_cpu >= CPU_SETSIZE)
+                usage(EXIT_FAILURE);
+            break;
+        case 'R':
+            g_bench_resume = true;
+            break;
+        case 's':
+            g_bench_samples_path = optarg;
+            break;
         case 'v':
             verbose = true;
             break;
@@ -700,32 +1194,68 @@ main(int argc, char *argv[])
     g_bench_num_requests = rho_str_toint(argv[2], 10);
     RHO_ASSERT(g_bench_num_requests > 0);
 
-    pid = fork();
-    if (pid > 0) {
-        /* server */
-        g_bench_payload = rhoL_zalloc(BENCH_MAX_PAYLOAD_SIZE);
-
-        bench_log_init(logfile, verbose);
-
-        rpcserver_socket_create(server, argv[0], anonymous);
-        event = rho_event_create(server->srv_sock->fd,
-                RHO_EVENT_READ | RHO_EVENT_PERSIST, 
-                rpcserver_cb, server); 
-
-        loop = rho_event_loop_create();
-        rho_event_loop_add(loop, event, NULL); 
-        rho_event_loop_dispatch(loop);
-
-        rpcserver_destroy(server);
-        rhoL_free(g_bench_payload);
-    } else if (pid == 0) {
-        /* child */
-        sleep(5);
-        g_bench_payload = rhoL_zalloc(BENCH_MAX_PAYLOAD_SIZE);
-        rpcclient_main(argv[0], root_crt);
-    } else {
-        rho_errno_die(errno, "fork failed");
+    if (g_bench_resume && (g_bench_conn_rpcs == -1 || root_crt == NULL))
+        rho_die("-R needs -k and -Z");
+    if (g_bench_conn_rpcs != -1 && g_bench_aead != -1 && root_crt == NULL)
+        rho_die("-k can't be used with a pre-shared AEAD key (-A without -Z)");
+
+    /* without TLS, a pre-shared key: the clients inherit it */
+    if (g_bench_aead != -1 && root_crt == NULL &&
+            RAND_bytes(g_bench_aead_key, sizeof(g_bench_aead_key)) != 1)
+        rho_die("RAND_bytes failed");
+
+    if (pipe(ready_fds) == -1 || pipe(child_fds) == -1)
+        rho_errno_die(errno, "pipe failed");
+
+    g_bench_children = rhoL_zalloc(g_bench_nclients * sizeof(pid_t));
+    for (i = 0; i < g_bench_nclients; i++) {
+        pid = fork();
+        if (pid == -1)
+            rho_errno_die(errno, "fork failed");
+        if (pid == 0) {
+            /* client; keeps child_fds[1] open until it exits */
+            (void)close(ready_fds[1]);
+            (void)close(child_fds[0]);
+            if (nclient_cpus > 0)
+                bench_pin(client_cpus[i % nclient_cpus]);
+            rpcclient_wait_ready(ready_fds[0]);
+            g_bench_payload = bench_payload_alloc(g_bench_huge, NULL);
+            rpcclient_main(argv[0], root_crt);
+            return (0);
+        }
+        g_bench_children[i] = pid;
+    }
+
+    /* server */
+    (void)close(ready_fds[0]);
+    (void)close(child_fds[1]);
+    bench_pin(server_cpu);
+
+    bench_log_init(logfile, verbose);
+    g_bench_payload = bench_payload_alloc(g_bench_huge, bench_log);
+
+    rpcserver_socket_create(server, argv[0], anonymous);
+    event = rho_event_create(server->srv_sock->fd,
+            RHO_EVENT_READ | RHO_EVENT_PERSIST, 
+            rpcserver_cb, server); 
+
+    /* listening: let the clients connect */
+    g_bench_start_ns = rpc_now_ns();
+    for (i = 0; i < g_bench_nclients; i++) {
+        if (write(ready_fds[1], "", 1) != 1)
+            rho_errno_die(errno, "can't write readiness pipe");
     }
+    (void)close(ready_fds[1]);
+
+    loop = rho_event_loop_create();
+    rho_event_loop_add(loop, event, NULL); 
+    rho_event_loop_add(loop, rho_event_create(child_fds[0],
+                RHO_EVENT_READ, rpcserver_child_cb, server), NULL);
+    rho_event_loop_dispatch(loop);
+
+    rpcserver_destroy(server);
+    bench_payload_free(g_bench_payload, g_bench_huge);
+    rhoL_free(g_bench_children);
 
     return (0);
 }
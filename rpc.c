@@ -1,42 +1,134 @@
+#define _GNU_SOURCE     /* memfd_create, F_ADD_SEALS, MSG_CMSG_CLOEXEC */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
 
 #include <rho/rho_buf.h>
 #include <rho/rho_event.h>
 #include <rho/rho_log.h>
 #include <rho/rho_mem.h>
 #include <rho/rho_sock.h>
+#include <rho/rho_ssl.h>
 
 #include "rpc.h"
+#include "rpc_aead.h"
+#include "rpc_copy.h"
+#include "rpc_crc32c.h"
+#include "rpc_trace.h"
 
 /*********************************************************
  * SERIALIZING/DESERIALIZING HEADER
  *********************************************************/
+/* ra_hdrbuf's size: with a PSK, the first header sent follows a salt */
+#define RPC_HDRBUF_LENGTH   (RPC_AEAD_SALT_LENGTH + RPC_HDR_MAXLEN)
+
+static uint32_t
+rpc_getu32be(const uint8_t *p)
+{
+    return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+            ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
 static void
-rpc_agent_pack_hdr(struct rpc_agent *agent)
+rpc_putu32be(uint8_t *p, uint32_t v)
 {
-    struct rho_buf *buf = agent->ra_hdrbuf;
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* hdr as rpc_hdr_pack writes it, into p; returns its length */
+static size_t
+rpc_hdr_encode(const struct rpc_hdr *hdr, uint8_t *p)
+{
+    rpc_putu32be(p, hdr->rh_code);
+    rpc_putu32be(p + 4, hdr->rh_bodylen | hdr->rh_flags);
+    if (hdr->rh_flags & RPC_HDR_F_DEADLINE) {
+        rpc_putu32be(p + 8, hdr->rh_deadline_us);
+        return (RPC_HDR_LENGTH + 4);
+    }
+
+    return (RPC_HDR_LENGTH);
+}
+
+/*
+ * write hdr to buf, which is left rewound; returns 0, or EMSGSIZE if the
+ * body length is over RPC_MAX_BODYLEN
+ */
+int
+rpc_hdr_pack(const struct rpc_hdr *hdr, struct rho_buf *buf)
+{
+    if (hdr->rh_bodylen > RPC_MAX_BODYLEN)
+        return (EMSGSIZE);
 
     rho_buf_rewind(buf);
-    rho_buf_writeu32be(buf, agent->ra_hdr.rh_code);
-    rho_buf_writeu32be(buf, agent->ra_hdr.rh_bodylen);
+    rho_buf_writeu32be(buf, hdr->rh_code);
+    rho_buf_writeu32be(buf, hdr->rh_bodylen | hdr->rh_flags);
+    if (hdr->rh_flags & RPC_HDR_F_DEADLINE)
+        rho_buf_writeu32be(buf, hdr->rh_deadline_us);
     rho_buf_rewind(buf);
+    return (0);
 }
 
-static int 
-rpc_agent_unpack_hdr(struct rpc_agent *agent)
+static int
+rpc_agent_pack_hdr(struct rpc_agent *agent)
+{
+    return (rpc_hdr_pack(&agent->ra_hdr, agent->ra_hdrbuf));
+}
+
+/* 
+ * The number of bytes of header still to be received into buf: the fixed
+ * part first, and then, once the flags are known, any extension.
+ */
+static size_t
+rpc_hdr_need(struct rho_buf *buf)
+{
+    size_t len = rho_buf_length(buf);
+    const uint8_t *p = NULL;
+    size_t want = RPC_HDR_LENGTH;
+
+    if (len >= RPC_HDR_LENGTH) {
+        p = rho_buf_raw(buf, 0, SEEK_SET);
+        if (rpc_getu32be(p + 4) & RPC_HDR_F_DEADLINE)
+            want += 4;
+    }
+
+    return (want - len);
+}
+
+/*
+ * Parse the full header in buf into hdr, and clear buf.  Returns 0, or
+ * EPROTO if buf does not hold a full header, or the header has a flag that
+ * isn't defined.
+ */
+int 
+rpc_hdr_unpack(struct rpc_hdr *hdr, struct rho_buf *buf)
 {
     int error = 0;
-    struct rho_buf *buf = agent->ra_hdrbuf;
     uint32_t code = 0;
     uint32_t bodylen = 0;
 
     RHO_TRACE_ENTER();
 
-    if (rho_buf_length(buf) != RPC_HDR_LENGTH) {
-        rho_warn("rho_buf_length(buf)=%zu != RPC_HDR_LENGTH",
+    if (rho_buf_length(buf) < RPC_HDR_LENGTH || rpc_hdr_need(buf) != 0) {
+        rho_warn("rho_buf_length(buf)=%zu is not a full header",
                 rho_buf_length(buf));
         error = EPROTO;
         goto out;
@@ -58,18 +150,1090 @@ rpc_agent_unpack_hdr(struct rpc_agent *agent)
         goto out;
     }
 
-    agent->ra_hdr.rh_code = code;
-    agent->ra_hdr.rh_bodylen = bodylen;
+    if (bodylen & RPC_HDR_FLAGS_MASK & ~RPC_HDR_F_ALL) {
+        rho_warn("unknown header flags (word=0x%08"PRIx32")", bodylen);
+        error = EPROTO;
+        goto out;
+    }
+
+    hdr->rh_code = code;
+    hdr->rh_bodylen = bodylen & RPC_HDR_BODYLEN_MASK;
+    hdr->rh_flags = bodylen & RPC_HDR_FLAGS_MASK;
+    hdr->rh_deadline_us = 0;
+    if (hdr->rh_flags & RPC_HDR_F_DEADLINE)
+        (void)rho_buf_readu32be(buf, &hdr->rh_deadline_us);
     rho_buf_clear(buf);
 
     rho_debug("rh_code=%"PRIu32", rh_bodylen=%"PRIu32,
-            agent->ra_hdr.rh_code, agent->ra_hdr.rh_bodylen);
+            hdr->rh_code, hdr->rh_bodylen);
 
 out:
     RHO_TRACE_EXIT();
     return (error);
 }
 
+static int 
+rpc_agent_unpack_hdr(struct rpc_agent *agent)
+{
+    return (rpc_hdr_unpack(&agent->ra_hdr, agent->ra_hdrbuf));
+}
+
+/* like rpc_hdr_need, but with a PSK, the peer's salt comes first */
+static size_t
+rpc_agent_hdr_need(const struct rpc_agent *agent)
+{
+    if (agent->ra_salt_in)
+        return (RPC_AEAD_SALT_LENGTH - rho_buf_length(agent->ra_hdrbuf));
+
+    return (rpc_hdr_need(agent->ra_hdrbuf));
+}
+
+/*********************************************************
+ * DEADLINES
+ *********************************************************/
+/* the CLOCK_MONOTONIC time, in nanoseconds */
+uint64_t
+rpc_now_ns(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/*
+ * Bound each rpc_agent_request on agent to usec microseconds (0 to wait
+ * forever).  The bound is also sent with each request as its deadline, so
+ * that the server can skip requests the client has stopped waiting for.
+ *
+ * A request that times out fails with ETIMEDOUT, and leaves the agent in
+ * RPC_STATE_ERROR: the response may still arrive, so the connection can't
+ * be used for further requests.
+ */
+int
+rpc_agent_set_timeout(struct rpc_agent *agent, uint32_t usec)
+{
+    struct timeval tv = { 0, 0 };
+
+    /* 
+     * clear any bound that an earlier timed request left on the socket; new
+     * requests set their own
+     */
+    if (usec == 0 && agent->ra_timeout_us != 0 && agent->ra_sock != NULL) {
+        if (setsockopt(agent->ra_sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+                    sizeof(tv)) == -1)
+            return (-1);
+        if (setsockopt(agent->ra_sock->fd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+                    sizeof(tv)) == -1)
+            return (-1);
+    }
+
+    agent->ra_timeout_us = usec;
+    return (0);
+}
+
+/* 
+ * Whether the request just received has a deadline, and it has passed.
+ * A server should then reply with ETIMEDOUT rather than do the work.
+ */
+bool
+rpc_agent_deadline_expired(const struct rpc_agent *agent)
+{
+    return (agent->ra_deadline_ns != 0 &&
+            rpc_now_ns() >= agent->ra_deadline_ns);
+}
+
+/* 
+ * Set the socket's optname (SO_RCVTIMEO or SO_SNDTIMEO) to the time left
+ * until expiry; fails with ETIMEDOUT if there is none left.  A transport
+ * never blocks, so for one this only checks the time.
+ */
+static int
+rpc_agent_arm_timeout(struct rpc_agent *agent, int optname, uint64_t expiry)
+{
+    uint64_t now = rpc_now_ns();
+    uint64_t left = 0;
+    struct timeval tv;
+
+    if (now >= expiry) {
+        errno = ETIMEDOUT;
+        return (-1);
+    }
+
+    if (agent->ra_xops != NULL)
+        return (0);
+
+    /* round up, as a zero timeval would mean no timeout at all */
+    left = (expiry - now + 999) / 1000;
+    tv.tv_sec = left / 1000000;
+    tv.tv_usec = left % 1000000;
+    return (setsockopt(agent->ra_sock->fd, SOL_SOCKET, optname, &tv,
+                sizeof(tv)));
+}
+
+/*********************************************************
+ * TRANSPORT
+ *********************************************************/
+/*
+ * Move agent's bytes with ops (passing ctx) rather than a socket; see
+ * struct rpc_transport_ops.  The agent must have been created without a
+ * socket.
+ */
+void
+rpc_agent_set_transport(struct rpc_agent *agent,
+        const struct rpc_transport_ops *ops, void *ctx)
+{
+    RHO_ASSERT(agent->ra_sock == NULL);
+    RHO_ASSERT(agent->ra_memfd_threshold == 0);
+
+    agent->ra_xops = ops;
+    agent->ra_xctx = ctx;
+}
+
+/*
+ * The socket to move messages over: for ra_raw, a plain socket on ra_sock's
+ * fd, under its TLS layer.
+ */
+static struct rho_sock *
+rpc_agent_sock(const struct rpc_agent *agent)
+{
+    return (agent->ra_raw ? agent->ra_rawsock : agent->ra_sock);
+}
+
+static ssize_t
+rpc_agent_recv_buf(struct rpc_agent *agent, struct rho_buf *buf, size_t len)
+{
+    if (agent->ra_xops != NULL)
+        return (agent->ra_xops->xo_recv(agent->ra_xctx, buf, len));
+    else
+        return (rho_sock_recv_buf(rpc_agent_sock(agent), buf, len));
+}
+
+static ssize_t
+rpc_agent_send_buf(struct rpc_agent *agent, struct rho_buf *buf, size_t len)
+{
+    if (agent->ra_xops != NULL)
+        return (agent->ra_xops->xo_send(agent->ra_xctx, buf, len));
+    else
+        return (rho_sock_send_buf(rpc_agent_sock(agent), buf, len));
+}
+
+/* for messages: the socket's fd, or -1 over a transport */
+static int
+rpc_agent_fd(const struct rpc_agent *agent)
+{
+    return (agent->ra_sock != NULL ? agent->ra_sock->fd : -1);
+}
+
+/*********************************************************
+ * FILE-BACKED BODIES
+ *********************************************************/
+static void
+rpc_agent_clear_bodyfd(struct rpc_agent *agent)
+{
+    if (agent->ra_bodyfd != -1 && agent->ra_bodyfd_close)
+        (void)close(agent->ra_bodyfd);
+
+    agent->ra_bodyfd = -1;
+    agent->ra_bodyfd_close = false;
+    agent->ra_bodyfd_off = 0;
+    agent->ra_bodyfd_left = 0;
+}
+
+/*
+ * sendfile only helps when the socket carries the bytes verbatim; for a TLS
+ * socket, the file range has to be encrypted in user space anyway, so we read
+ * it into ra_bodybuf and send it like any other body.
+ */
+static int
+rpc_agent_slurp_bodyfd(struct rpc_agent *agent)
+{
+    int error = 0;
+    uint8_t chunk[16384];
+    size_t want = 0;
+    ssize_t n = 0;
+
+    RHO_TRACE_ENTER();
+
+    rho_buf_clear(agent->ra_bodybuf);
+    while (agent->ra_bodyfd_left > 0) {
+        want = agent->ra_bodyfd_left;
+        if (want > sizeof(chunk))
+            want = sizeof(chunk);
+        n = pread(agent->ra_bodyfd, chunk, want, agent->ra_bodyfd_off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            error = errno;
+            rho_errno_warn(errno, "pread(fd=%d) failed", agent->ra_bodyfd);
+            goto done;
+        }
+        if (n == 0) {
+            /* file is shorter than the advertised bodylen */
+            error = EIO;
+            rho_warn("unexpected EOF on body fd %d", agent->ra_bodyfd);
+            goto done;
+        }
+        rho_buf_write(agent->ra_bodybuf, chunk, n);
+        agent->ra_bodyfd_off += n;
+        agent->ra_bodyfd_left -= n;
+    }
+
+    rpc_agent_clear_bodyfd(agent);
+
+done:
+    RHO_TRACE_EXIT();
+    return (error);
+}
+
+/* 
+ * returns the number of bytes sent, or -1 on error.  On a premature EOF of
+ * the file, errno is set to EIO.
+ */
+static ssize_t
+rpc_agent_sendfile(struct rpc_agent *agent)
+{
+    ssize_t n = 0;
+
+    n = sendfile(agent->ra_sock->fd, agent->ra_bodyfd, &agent->ra_bodyfd_off,
+            agent->ra_bodyfd_left);
+    if (n == 0) {
+        errno = EIO;
+        return (-1);
+    }
+    if (n > 0)
+        agent->ra_bodyfd_left -= n;
+
+    return (n);
+}
+
+/*********************************************************
+ * BODY CHECKSUMS
+ *********************************************************/
+/*
+ * Send bodies with a CRC32C trailer (RPC_HDR_F_CRC32C), for an end-to-end
+ * check on connections that TLS doesn't protect.  Bodies that go as memfd
+ * attachments don't get one; bodies set with rpc_agent_set_bodyfd are read
+ * into memory, to be summed, rather than sent with sendfile.
+ */
+void
+rpc_agent_set_crc(struct rpc_agent *agent, bool on)
+{
+    agent->ra_crc_out = on;
+}
+
+/* the number of bytes that follow the header: the body, and any trailer */
+static size_t
+rpc_agent_wire_bodylen(const struct rpc_agent *agent)
+{
+    size_t len = agent->ra_hdr.rh_bodylen;
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_MEMFD)
+        return (0);
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_CRC32C)
+        len += RPC_TRAILER_LENGTH;
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_AEAD)
+        len += RPC_AEAD_TAG_LENGTH;
+    return (len);
+}
+
+/* sum the body in ra_bodybuf, and append the trailer */
+static void
+rpc_agent_add_crc(struct rpc_agent *agent)
+{
+    struct rho_buf *buf = agent->ra_bodybuf;
+    uint32_t crc = 0;
+
+    crc = rpc_crc32c(0, rho_buf_raw(buf, 0, SEEK_SET),
+            agent->ra_hdr.rh_bodylen);
+    rho_buf_seek(buf, 0, SEEK_END);
+    rho_buf_writeu32be(buf, crc);
+    agent->ra_hdr.rh_flags |= RPC_HDR_F_CRC32C;
+}
+
+/*
+ * Add the body bytes among ra_bodybuf's [off, off + len) -- just received
+ * -- to ra_crc; trailer bytes are skipped.
+ */
+static void
+rpc_agent_sum_received(struct rpc_agent *agent, size_t off, size_t len)
+{
+    size_t end = off + len;
+
+    if (end > agent->ra_hdr.rh_bodylen)
+        end = agent->ra_hdr.rh_bodylen;
+    if (off < end)
+        agent->ra_crc = rpc_crc32c(agent->ra_crc,
+                rho_buf_raw(agent->ra_bodybuf, off, SEEK_SET), end - off);
+}
+
+/*
+ * Check ra_crc, the sum of the body received, against its trailer.
+ * Returns 0, or EBADMSG if they differ.
+ */
+static int
+rpc_agent_check_crc(const struct rpc_agent *agent)
+{
+    const uint8_t *p = NULL;
+    uint32_t want = 0;
+
+    p = rho_buf_raw(agent->ra_bodybuf, agent->ra_hdr.rh_bodylen, SEEK_SET);
+    want = rpc_getu32be(p);
+    if (want != agent->ra_crc) {
+        rho_warn("body checksum mismatch (code=%"PRIu32", bodylen=%"PRIu32
+                ", crc32c=0x%08"PRIx32", trailer=0x%08"PRIx32")",
+                agent->ra_hdr.rh_code, agent->ra_hdr.rh_bodylen,
+                agent->ra_crc, want);
+        return (EBADMSG);
+    }
+
+    return (0);
+}
+
+/*********************************************************
+ * AEAD RECORD MODE
+ *********************************************************/
+/* the exporter label (RFC 5705) for rpc_agent_set_aead_from_tls's key */
+#define RPC_AEAD_EXPORTER_LABEL     "EXPORTER-librpc-aead"
+
+static void
+rpc_agent_install_aead(struct rpc_agent *agent, struct rpc_aead *aead)
+{
+    if (agent->ra_aead != NULL)
+        rpc_aead_destroy(agent->ra_aead);
+    agent->ra_aead = aead;
+}
+
+/* defined with rpc_agent_request, below */
+static ssize_t rpc_agent_sendn(struct rpc_agent *agent, struct rho_buf *buf,
+        size_t len, uint64_t expiry);
+static int rpc_agent_recvn(struct rpc_agent *agent, struct rho_buf *buf,
+        size_t len, bool hdr, uint64_t expiry);
+
+/*
+ * Seal every message on agent's connection with cipher (RPC_AEAD_*) and
+ * keys derived from the pre-shared key psk, and require every message
+ * received to be sealed (see rpc_aead.h).  Both ends must set the same
+ * cipher and key, with different initiator values, before the first
+ * message, and the initiator must send first.  The connection's keys are
+ * derived from the PSK and a salt from each end, so that a PSK may be used
+ * for any number of connections: the responder sends its salt at once, and
+ * the initiator's first rpc_agent_ready_send (or rpc_agent_request) waits
+ * for it, then sends its own in front of its first header.  Returns 0, or
+ * -1 with errno set: EINVAL for a bad cipher or keylen, or the error in
+ * sending the responder's salt.
+ *
+ * Memfd attachments are not used, and bodies set with rpc_agent_set_bodyfd
+ * are read into memory, to be encrypted.
+ */
+int
+rpc_agent_set_aead(struct rpc_agent *agent, int cipher, const uint8_t *psk,
+        size_t keylen, bool initiator)
+{
+    struct rpc_aead *aead = NULL;
+    struct rho_buf *buf = agent->ra_hdrbuf;
+    ssize_t n = 0;
+    int error = 0;
+
+    aead = rpc_aead_create_psk(cipher, psk, keylen, initiator);
+    if (aead == NULL)
+        return (-1);
+
+    if (!initiator) {
+        /* a new connection's send buffer has room for it */
+        rho_buf_clear(buf);
+        rho_buf_write(buf, rpc_aead_salt(aead), RPC_AEAD_SALT_LENGTH);
+        rho_buf_rewind(buf);
+        n = rpc_agent_sendn(agent, buf, RPC_AEAD_SALT_LENGTH, 0);
+        rho_buf_clear(buf);
+        if (n == -1) {
+            error = errno;
+            rho_errno_warn(error, "can't send the salt");
+            rpc_aead_destroy(aead);
+            errno = error;
+            return (-1);
+        }
+    }
+
+    rpc_agent_install_aead(agent, aead);
+    agent->ra_salt_out = initiator;
+    agent->ra_salt_in = true;
+    return (0);
+}
+
+/*
+ * Like rpc_agent_set_aead, with a key exported from the TLS 1.2 session of
+ * agent's socket, whose handshake has just completed; the client is the
+ * initiator.  The key is the session's own, so no salts are exchanged.
+ * From then on, the connection's messages bypass TLS, and are only sealed.
+ * Both ends must call this before either sends a message.  Returns 0, or
+ * -1 with errno set: EINVAL if the socket has no TLS session or the cipher
+ * is unknown, EPROTO if the session is not TLS 1.2 (TLS 1.3 sends records,
+ * such as session tickets, after the handshake, which would be read as
+ * messages) or the key can't be exported.
+ */
+int
+rpc_agent_set_aead_from_tls(struct rpc_agent *agent, int cipher)
+{
+    uint8_t key[RPC_AEAD_MAX_KEYLEN];
+    size_t keylen = rpc_aead_keylen(cipher);
+    struct rpc_aead *aead = NULL;
+    SSL *ssl = NULL;
+
+    if (agent->ra_sock == NULL || agent->ra_sock->ssl == NULL ||
+            keylen == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    ssl = agent->ra_sock->ssl->ssl;
+    if (SSL_version(ssl) != TLS1_2_VERSION) {
+        rho_warn("AEAD record mode needs TLS 1.2, not %s",
+                SSL_get_version(ssl));
+        errno = EPROTO;
+        return (-1);
+    }
+
+    if (SSL_export_keying_material(ssl, key, keylen,
+                RPC_AEAD_EXPORTER_LABEL, strlen(RPC_AEAD_EXPORTER_LABEL),
+                NULL, 0, 0) != 1) {
+        rho_warn("SSL_export_keying_material failed");
+        errno = EPROTO;
+        return (-1);
+    }
+
+    aead = rpc_aead_create(cipher, key, keylen, !SSL_is_server(ssl));
+    rho_memzero(key, sizeof(key));
+    if (aead == NULL)
+        return (-1);
+
+    rpc_agent_install_aead(agent, aead);
+    if (agent->ra_rawsock == NULL)
+        agent->ra_rawsock = rho_sock_unix_from_fd(agent->ra_sock->fd);
+    agent->ra_raw = true;
+    return (0);
+}
+
+/*
+ * With a PSK: put our salt in front of the header being packed, for the
+ * first message we send.
+ */
+static void
+rpc_agent_pack_salted_hdr(struct rpc_agent *agent)
+{
+    uint8_t hdr[RPC_HDR_MAXLEN];
+    size_t hdrlen = 0;
+
+    hdrlen = rpc_hdr_encode(&agent->ra_hdr, hdr);
+    rho_buf_clear(agent->ra_hdrbuf);
+    rho_buf_write(agent->ra_hdrbuf, rpc_aead_salt(agent->ra_aead),
+            RPC_AEAD_SALT_LENGTH);
+    rho_buf_write(agent->ra_hdrbuf, hdr, hdrlen);
+    rho_buf_rewind(agent->ra_hdrbuf);
+    agent->ra_salt_out = false;
+}
+
+/*
+ * With a PSK: the peer's salt is in ra_hdrbuf (for the responder, in front
+ * of the initiator's first header); derive the keys that were waiting on
+ * it.  Returns 0, or an errno value.
+ */
+static int
+rpc_agent_salt_received(struct rpc_agent *agent)
+{
+    int error = 0;
+
+    error = rpc_aead_set_peer_salt(agent->ra_aead,
+            rho_buf_raw(agent->ra_hdrbuf, 0, SEEK_SET));
+    if (error != 0)
+        rho_errno_warn(error, "can't derive the connection's keys");
+
+    rho_buf_clear(agent->ra_hdrbuf);
+    agent->ra_salt_in = false;
+    return (error);
+}
+
+/*
+ * With a PSK, for the initiator: wait (until expiry, if nonzero) for the
+ * responder's salt, which comes before anything else, and derive the keys
+ * from it.  Returns 0, or an errno value.
+ */
+static int
+rpc_agent_await_salt(struct rpc_agent *agent, uint64_t expiry)
+{
+    rho_buf_clear(agent->ra_hdrbuf);
+    if (rpc_agent_recvn(agent, agent->ra_hdrbuf, RPC_AEAD_SALT_LENGTH, false,
+                expiry) == -1)
+        return (errno);
+
+    return (rpc_agent_salt_received(agent));
+}
+
+/*
+ * Encrypt the body in ra_bodybuf in place, and append the tag; the header,
+ * which must already have RPC_HDR_F_AEAD set, is the associated data.
+ * Returns 0, or an errno value.
+ */
+static int
+rpc_agent_seal_body(struct rpc_agent *agent)
+{
+    struct rho_buf *buf = agent->ra_bodybuf;
+    uint8_t aad[RPC_HDR_MAXLEN];
+    uint8_t tag[RPC_AEAD_TAG_LENGTH];
+    size_t aadlen = 0;
+    int error = 0;
+
+    aadlen = rpc_hdr_encode(&agent->ra_hdr, aad);
+    error = rpc_aead_seal_begin(agent->ra_aead, aad, aadlen);
+    if (error == 0 && agent->ra_hdr.rh_bodylen > 0)
+        error = rpc_aead_seal_update(agent->ra_aead,
+                rho_buf_raw(buf, 0, SEEK_SET), agent->ra_hdr.rh_bodylen);
+    if (error == 0)
+        error = rpc_aead_seal_final(agent->ra_aead, tag);
+    if (error != 0) {
+        rho_errno_warn(error, "can't seal message");
+        return (error);
+    }
+
+    rho_buf_seek(buf, 0, SEEK_END);
+    rho_buf_write(buf, tag, sizeof(tag));
+    return (0);
+}
+
+/*
+ * Called with the header just received: check that it is sealed if and
+ * only if the connection is, and start opening it.  Returns 0, or an
+ * errno value.
+ */
+static int
+rpc_agent_open_begin(struct rpc_agent *agent)
+{
+    uint8_t aad[RPC_HDR_MAXLEN];
+    size_t aadlen = 0;
+    uint32_t flags = agent->ra_hdr.rh_flags;
+    int error = 0;
+
+    if (agent->ra_aead == NULL) {
+        rho_warn("RPC_HDR_F_AEAD set, but the connection has no key");
+        return (EPROTO);
+    }
+    if (!(flags & RPC_HDR_F_AEAD)) {
+        rho_warn("unsealed message on a sealed connection (code=%"PRIu32")",
+                agent->ra_hdr.rh_code);
+        return (EPROTO);
+    }
+    if (flags & (RPC_HDR_F_MEMFD | RPC_HDR_F_CRC32C)) {
+        rho_warn("RPC_HDR_F_AEAD set with MEMFD or CRC32C");
+        return (EPROTO);
+    }
+
+    aadlen = rpc_hdr_encode(&agent->ra_hdr, aad);
+    error = rpc_aead_open_begin(agent->ra_aead, aad, aadlen);
+    if (error != 0)
+        rho_errno_warn(error, "can't open message");
+
+    return (error);
+}
+
+/*********************************************************
+ * TRAILERS
+ *
+ * A body received with a trailer (a checksum, or an AEAD tag) is processed
+ * as it arrives, and the trailer checked once it is all in, before the
+ * message is handed over.
+ *********************************************************/
+/*
+ * Called after bytes [off, off + len) of the body and its trailer have
+ * been received into ra_bodybuf.  Returns 0, or an errno value.
+ */
+static int
+rpc_agent_body_received(struct rpc_agent *agent, size_t off, size_t len)
+{
+    size_t end = off + len;
+    int error = 0;
+
+    if (rho_buf_length(agent->ra_bodybuf) > agent->ra_bodycap)
+        agent->ra_bodycap = rho_buf_length(agent->ra_bodybuf);
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_CRC32C) {
+        rpc_agent_sum_received(agent, off, len);
+    } else if (agent->ra_hdr.rh_flags & RPC_HDR_F_AEAD) {
+        if (end > agent->ra_hdr.rh_bodylen)
+            end = agent->ra_hdr.rh_bodylen;
+        if (off < end)
+            error = rpc_aead_open_update(agent->ra_aead,
+                    rho_buf_raw(agent->ra_bodybuf, off, SEEK_SET), end - off);
+    }
+
+    return (error);
+}
+
+/*
+ * Check the trailer of the body just received in full.  Returns 0, or
+ * EBADMSG if the body is corrupt or (with AEAD) not authentic.
+ */
+static int
+rpc_agent_check_trailer(struct rpc_agent *agent)
+{
+    const uint8_t *tag = NULL;
+    int error = 0;
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_CRC32C)
+        return (rpc_agent_check_crc(agent));
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_AEAD) {
+        tag = rho_buf_raw(agent->ra_bodybuf, agent->ra_hdr.rh_bodylen,
+                SEEK_SET);
+        error = rpc_aead_open_final(agent->ra_aead, tag);
+        if (error != 0)
+            rho_warn("message failed to open (code=%"PRIu32", bodylen=%"
+                    PRIu32")", agent->ra_hdr.rh_code,
+                    agent->ra_hdr.rh_bodylen);
+    }
+
+    return (error);
+}
+
+/*********************************************************
+ * MEMFD ATTACHMENTS
+ *********************************************************/
+#define RPC_MEMFD_SEALS \
+    (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+static void
+rpc_agent_clear_bodymap(struct rpc_agent *agent)
+{
+    if (agent->ra_bodymap != NULL)
+        (void)munmap((void *)agent->ra_bodymap, agent->ra_bodymaplen);
+
+    agent->ra_bodymap = NULL;
+    agent->ra_bodymaplen = 0;
+}
+
+static void
+rpc_agent_clear_fds(struct rpc_agent *agent)
+{
+    if (agent->ra_txmap != NULL)
+        (void)munmap(agent->ra_txmap, agent->ra_txmaplen);
+    if (agent->ra_txfd != -1)
+        (void)close(agent->ra_txfd);
+    if (agent->ra_rxfd != -1)
+        (void)close(agent->ra_rxfd);
+
+    agent->ra_txmap = NULL;
+    agent->ra_txmaplen = 0;
+    agent->ra_txfd = -1;
+    agent->ra_rxfd = -1;
+}
+
+/*
+ * Make the body of the new message being built (which has no body yet) a
+ * memfd attachment of len bytes, and return a writable mapping of it, for
+ * the caller to build the body in place: it then never goes through
+ * ra_bodybuf, and isn't copied to be sent.  The mapping is valid until
+ * rpc_agent_ready_send, which unmaps and seals the memfd.  The body length
+ * is set to len.
+ *
+ * Needs memfd attachments (rpc_agent_set_memfd_threshold) and no AEAD
+ * record mode.  Returns NULL with errno set -- EPROTONOSUPPORT, EINVAL for
+ * an empty body, EMSGSIZE for one over RPC_MAX_BODYLEN, or an error from
+ * memfd_create, ftruncate or mmap -- and the caller can then build the body
+ * in ra_bodybuf as usual.
+ */
+void *
+rpc_agent_memfd_body(struct rpc_agent *agent, size_t len)
+{
+    int fd = -1;
+    int errsv = 0;
+    void *p = NULL;
+
+    RHO_ASSERT(rho_buf_length(agent->ra_bodybuf) == 0);
+    RHO_ASSERT(agent->ra_bodyfd == -1);
+
+    RHO_TRACE_ENTER("len=%zu", len);
+
+    if (agent->ra_memfd_threshold == 0 || agent->ra_aead != NULL) {
+        errno = EPROTONOSUPPORT;
+        goto done;
+    }
+    if (len == 0 || len > RPC_MAX_BODYLEN) {
+        errno = len == 0 ? EINVAL : EMSGSIZE;
+        goto done;
+    }
+
+    fd = memfd_create("rpc-body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+        goto done;
+    if (ftruncate(fd, len) == -1)
+        goto fail;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        p = NULL;
+        goto fail;
+    }
+
+    rpc_agent_clear_fds(agent);
+    agent->ra_txfd = fd;
+    agent->ra_txmap = p;
+    agent->ra_txmaplen = len;
+    agent->ra_hdr.rh_bodylen = len;
+    goto done;
+
+fail:
+    errsv = errno;
+    (void)close(fd);
+    errno = errsv;
+done:
+    RHO_TRACE_EXIT();
+    return (p);
+}
+
+/*
+ * Seal the body built in place by rpc_agent_memfd_body.  The mapping must go
+ * first: the kernel won't seal a memfd against writes while it has a
+ * writable shared mapping.  Returns 0, or an errno value.
+ */
+static int
+rpc_agent_seal_txmap(struct rpc_agent *agent)
+{
+    int error = 0;
+
+    (void)munmap(agent->ra_txmap, agent->ra_txmaplen);
+    agent->ra_txmap = NULL;
+    agent->ra_txmaplen = 0;
+
+    if (fcntl(agent->ra_txfd, F_ADD_SEALS, RPC_MEMFD_SEALS) == -1) {
+        error = errno;
+        rho_errno_warn(errno, "sealing memfd failed");
+        return (error);
+    }
+
+    agent->ra_hdr.rh_flags |= RPC_HDR_F_MEMFD;
+    return (0);
+}
+
+/*
+ * Move the body from ra_bodybuf into a sealed memfd that is passed with the
+ * header.  This costs a copy and a few system calls, which bodies built
+ * with rpc_agent_memfd_body avoid.  The copy is a rpc_copy, as the peer,
+ * not us, reads the body next.  If the memfd can't be created (e.g., the
+ * kernel or enclave runtime does not support it), the body is simply sent
+ * inline.
+ */
+static void
+rpc_agent_attach_memfd(struct rpc_agent *agent)
+{
+    int fd = -1;
+    size_t len = agent->ra_hdr.rh_bodylen;
+    const uint8_t *p = rho_buf_raw(agent->ra_bodybuf, 0, SEEK_SET);
+    void *map = NULL;
+
+    RHO_TRACE_ENTER("len=%zu", len);
+
+    fd = memfd_create("rpc-body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        rho_errno_warn(errno, "memfd_create failed; sending body inline");
+        goto done;
+    }
+
+    if (ftruncate(fd, len) == -1) {
+        rho_errno_warn(errno, "sizing memfd failed; sending body inline");
+        goto fail;
+    }
+    /* populated up front, rather than a page fault per page */
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, 0);
+    if (map == MAP_FAILED) {
+        rho_errno_warn(errno, "mapping memfd failed; sending body inline");
+        goto fail;
+    }
+    rpc_copy(map, p, len);
+    (void)munmap(map, len);
+
+    if (fcntl(fd, F_ADD_SEALS, RPC_MEMFD_SEALS) == -1) {
+        rho_errno_warn(errno, "sealing memfd failed; sending body inline");
+        goto fail;
+    }
+
+    agent->ra_txfd = fd;
+    agent->ra_hdr.rh_flags |= RPC_HDR_F_MEMFD;
+    rho_buf_clear(agent->ra_bodybuf);
+    goto done;
+
+fail:
+    (void)close(fd);
+done:
+    RHO_TRACE_EXIT();
+}
+
+/* 
+ * Map the memfd that arrived with a RPC_HDR_F_MEMFD header as the body.
+ * The sender must have sealed it against writes and shrinking; otherwise it
+ * could change the body under us or make us fault on a truncated mapping.
+ */
+static int
+rpc_agent_map_memfd(struct rpc_agent *agent)
+{
+    int error = 0;
+    int fd = agent->ra_rxfd;
+    int seals = 0;
+    struct stat st;
+    void *p = NULL;
+    size_t len = agent->ra_hdr.rh_bodylen;
+
+    RHO_TRACE_ENTER();
+
+    agent->ra_rxfd = -1;
+
+    if (fd == -1) {
+        rho_warn("RPC_HDR_F_MEMFD set, but no fd was received");
+        error = EPROTO;
+        goto done;
+    }
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 ||
+            (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) !=
+            (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+        rho_warn("received memfd is not sealed (seals=%d)", seals);
+        error = EPROTO;
+        goto done;
+    }
+
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < len || len == 0) {
+        rho_warn("received memfd is smaller than bodylen %zu", len);
+        error = EPROTO;
+        goto done;
+    }
+
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        error = errno;
+        rho_errno_warn(errno, "mmap of received memfd failed");
+        goto done;
+    }
+
+    agent->ra_bodymap = p;
+    agent->ra_bodymaplen = len;
+
+done:
+    if (fd != -1)
+        (void)close(fd);
+    RHO_TRACE_EXIT();
+    return (error);
+}
+
+/* 
+ * like rho_sock_send_buf, but passes agent->ra_txfd with the first byte
+ * sent.
+ */
+static ssize_t
+rpc_agent_sendfd_buf(struct rpc_agent *agent, struct rho_buf *buf, size_t len)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    ssize_t n = 0;
+
+    memset(&msg, 0x00, sizeof(msg));
+    memset(&u, 0x00, sizeof(u));
+
+    iov.iov_base = rho_buf_raw(buf, 0, SEEK_CUR);
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &agent->ra_txfd, sizeof(int));
+
+    n = sendmsg(agent->ra_sock->fd, &msg, MSG_NOSIGNAL);
+    if (n > 0) {
+        rho_buf_seek(buf, n, SEEK_CUR);
+        (void)close(agent->ra_txfd);
+        agent->ra_txfd = -1;
+    }
+
+    return (n);
+}
+
+/* 
+ * like rho_sock_recv_buf, but stashes any fd that arrives with the bytes in
+ * agent->ra_rxfd.
+ */
+static ssize_t
+rpc_agent_recvfd_buf(struct rpc_agent *agent, struct rho_buf *buf, size_t len)
+{
+    uint8_t tmp[RPC_HDRBUF_LENGTH];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg = NULL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    int fd = -1;
+    ssize_t n = 0;
+
+    RHO_ASSERT(len <= sizeof(tmp));
+
+    memset(&msg, 0x00, sizeof(msg));
+
+    iov.iov_base = tmp;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    n = recvmsg(agent->ra_sock->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return (n);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (agent->ra_rxfd != -1)
+            (void)close(agent->ra_rxfd);
+        agent->ra_rxfd = fd;
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC)
+        rho_warn("control data truncated on fd %d", agent->ra_sock->fd);
+
+    rho_buf_write(buf, tmp, n);
+    return (n);
+}
+
+static ssize_t
+rpc_agent_recv_hdr_buf(struct rpc_agent *agent, struct rho_buf *buf,
+        size_t len)
+{
+    if (agent->ra_memfd_threshold > 0)
+        return (rpc_agent_recvfd_buf(agent, buf, len));
+    else
+        return (rpc_agent_recv_buf(agent, buf, len));
+}
+
+static ssize_t
+rpc_agent_send_hdr_buf(struct rpc_agent *agent, struct rho_buf *buf,
+        size_t len)
+{
+    if (agent->ra_txfd != -1)
+        return (rpc_agent_sendfd_buf(agent, buf, len));
+    else
+        return (rpc_agent_send_buf(agent, buf, len));
+}
+
+/*
+ * Called once a header has been received.  Returns 0 if the agent should
+ * go on to receive the body inline, 1 if the body is already present (it
+ * is empty or arrived as an attachment), or an errno value on error.
+ */
+static int
+rpc_agent_hdr_received(struct rpc_agent *agent)
+{
+    int error = 0;
+
+    error = rpc_agent_unpack_hdr(agent);
+    if (error != 0)
+        return (error);
+
+    /* the caller has set ra_recv_ns */
+    agent->ra_deadline_ns = 0;
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_DEADLINE)
+        agent->ra_deadline_ns = agent->ra_recv_ns +
+            (uint64_t)agent->ra_hdr.rh_deadline_us * 1000;
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_CRC32C) {
+        if ((agent->ra_hdr.rh_flags & RPC_HDR_F_MEMFD) ||
+                agent->ra_hdr.rh_bodylen == 0) {
+            rho_warn("RPC_HDR_F_CRC32C set, but the body isn't inline");
+            return (EPROTO);
+        }
+        agent->ra_crc = 0;
+        agent->ra_crc_out = true;
+    }
+
+    if (agent->ra_aead != NULL || (agent->ra_hdr.rh_flags & RPC_HDR_F_AEAD)) {
+        error = rpc_agent_open_begin(agent);
+        if (error != 0)
+            return (error);
+    }
+
+    if (agent->ra_hdr.rh_flags & RPC_HDR_F_MEMFD) {
+        /* or a body length of 2 GiB or more, from a peer without flags */
+        if (agent->ra_memfd_threshold == 0) {
+            rho_warn("RPC_HDR_F_MEMFD set, but attachments aren't enabled");
+            return (EPROTO);
+        }
+        error = rpc_agent_map_memfd(agent);
+        return (error != 0 ? error : 1);
+    }
+
+    /* a stray fd; don't leak it */
+    if (agent->ra_rxfd != -1) {
+        (void)close(agent->ra_rxfd);
+        agent->ra_rxfd = -1;
+    }
+
+    return (rpc_agent_wire_bodylen(agent) > 0 ? 0 : 1);
+}
+
+/*
+ * Enable memfd attachments for bodies of at least threshold bytes (0
+ * disables them).  Both ends of the connection must enable attachments,
+ * as the receiver needs to use recvmsg to collect the fd.  Returns 0 on
+ * success, or -1 with errno set to EPROTONOSUPPORT if the agent's socket
+ * is not a plain unix domain socket.
+ */
+int
+rpc_agent_set_memfd_threshold(struct rpc_agent *agent, size_t threshold)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+
+    if (threshold > 0) {
+        if (agent->ra_sock == NULL || agent->ra_sock->ssl != NULL)
+            goto unsupported;
+        if (getsockname(agent->ra_sock->fd, (struct sockaddr *)&ss,
+                    &sslen) == -1)
+            return (-1);
+        if (ss.ss_family != AF_UNIX)
+            goto unsupported;
+    }
+
+    agent->ra_memfd_threshold = threshold;
+    return (0);
+
+unsupported:
+    errno = EPROTONOSUPPORT;
+    return (-1);
+}
+
+/*
+ * Returns a pointer to the body of the message just received, whether it
+ * arrived inline (ra_bodybuf) or as a memfd attachment.
+ */
+const void *
+rpc_agent_body(const struct rpc_agent *agent)
+{
+    if (agent->ra_bodymap != NULL)
+        return (agent->ra_bodymap);
+    else
+        return (rho_buf_raw(agent->ra_bodybuf, 0, SEEK_SET));
+}
+
 /*********************************************************
  * STATE CHANGE HELPERS
  *********************************************************/
@@ -106,25 +1270,188 @@ rpc_state_to_str(int state)
         rho_die("unknown rpc agent state: %d", state);
     }
 
-    return (s);
+    return (s);
+}
+
+/*
+ * All state changes go through here, so that a traced agent records them
+ * (with the code of the message at hand).
+ */
+void
+rpc_agent_set_state(struct rpc_agent *agent, int state)
+{
+    agent->ra_state = state;
+    RPC_AGENT_TRACE(agent, RPC_TRACE_STATE, 0, agent->ra_hdr.rh_code);
+}
+
+/*
+ * Keep a ring of the last nevents trace events for agent (see rpc_trace.h);
+ * 0 turns tracing off and discards the ring.
+ */
+void
+rpc_agent_set_trace(struct rpc_agent *agent, uint32_t nevents)
+{
+    if (agent->ra_trace != NULL) {
+        rpc_trace_destroy(agent->ra_trace);
+        agent->ra_trace = NULL;
+    }
+
+    if (nevents > 0)
+        agent->ra_trace = rpc_trace_create(nevents);
+}
+
+/* add io's counts to sum's */
+void
+rpc_io_stats_add(struct rpc_io_stats *sum, const struct rpc_io_stats *io)
+{
+    sum->is_nrecvs += io->is_nrecvs;
+    sum->is_nsends += io->is_nsends;
+    sum->is_bytes_in += io->is_bytes_in;
+    sum->is_bytes_out += io->is_bytes_out;
+    sum->is_nagain += io->is_nagain;
+    sum->is_npartial += io->is_npartial;
+    sum->is_npasses += io->is_npasses;
+    sum->is_nmsgs_in += io->is_nmsgs_in;
+    sum->is_nmsgs_out += io->is_nmsgs_out;
+}
+
+/*
+ * Account for (and trace) a send or receive (type RPC_TRACE_SEND or
+ * RPC_TRACE_RECV) that asked for want bytes, and got n (or -1).
+ */
+static void
+rpc_agent_note_io(struct rpc_agent *agent, uint16_t type, ssize_t n,
+        size_t want)
+{
+    struct rpc_io_stats *io = &agent->ra_io;
+    int errsv = errno;
+    uint8_t flags = 0;
+
+    if (type == RPC_TRACE_RECV)
+        io->is_nrecvs++;
+    else
+        io->is_nsends++;
+
+    if (n == -1) {
+        if (errsv != EAGAIN && errsv != EWOULDBLOCK)
+            return;     /* the change to RPC_STATE_ERROR says it all */
+        io->is_nagain++;
+        flags = RPC_TRACE_F_PARTIAL | RPC_TRACE_F_AGAIN;
+        n = 0;
+    } else {
+        if (type == RPC_TRACE_RECV)
+            io->is_bytes_in += n;
+        else
+            io->is_bytes_out += n;
+        if (n > 0 && (size_t)n < want) {
+            io->is_npartial++;
+            flags = RPC_TRACE_F_PARTIAL;
+        }
+    }
+
+    if (agent->ra_trace != NULL) {
+        rpc_trace_record(agent->ra_trace, type, agent->ra_state, flags,
+                (uint32_t)n);
+        errno = errsv;
+    }
 }
 
 static void
 rpc_agent_set_dispatchable(struct rpc_agent *agent)
 {
-    agent->ra_state = RPC_STATE_DISPATCHABLE;
+    rpc_agent_set_state(agent, RPC_STATE_DISPATCHABLE);
     /* buf is at the start of body */
     rho_buf_rewind(agent->ra_bodybuf);
 }
 
-void
+/*
+ * Finish the message built in agent, and move the agent to
+ * RPC_STATE_SEND_HDR.  Returns 0, or an errno value:
+ *
+ *  - EMSGSIZE if the body is longer than RPC_MAX_BODYLEN.  Nothing has
+ *    changed, and the caller may build another message instead.
+ *  - anything else if the body can't be read from its bodyfd or sealed
+ *    (or, with a PSK, the initiator's wait for the responder's salt
+ *    failed).  The agent is then in RPC_STATE_ERROR, and its connection
+ *    must be closed.
+ */
+int
 rpc_agent_ready_send(struct rpc_agent *agent)
 {
-    RHO_ASSERT(rho_buf_length(agent->ra_bodybuf) == agent->ra_hdr.rh_bodylen);
+    int error = 0;
+
+    if (agent->ra_hdr.rh_bodylen > RPC_MAX_BODYLEN ||
+            (agent->ra_bodyfd == -1 &&
+             rho_buf_length(agent->ra_bodybuf) > RPC_MAX_BODYLEN)) {
+        rho_warn("body is over RPC_MAX_BODYLEN (code=%"PRIu32")",
+                agent->ra_hdr.rh_code);
+        return (EMSGSIZE);
+    }
+
+    if (agent->ra_txmap != NULL) {
+        RHO_ASSERT(agent->ra_aead == NULL);
+        error = rpc_agent_seal_txmap(agent);
+        if (error != 0) {
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
+            return (error);
+        }
+        goto pack;
+    }
+
+    if (agent->ra_bodyfd != -1) {
+        RHO_ASSERT(rho_buf_length(agent->ra_bodybuf) == 0);
+        RHO_ASSERT(agent->ra_bodyfd_left == agent->ra_hdr.rh_bodylen);
+        if (agent->ra_xops != NULL || agent->ra_sock->ssl != NULL ||
+                agent->ra_crc_out || agent->ra_aead != NULL) {
+            error = rpc_agent_slurp_bodyfd(agent);
+            if (error != 0) {
+                rpc_agent_clear_bodyfd(agent);
+                rpc_agent_set_state(agent, RPC_STATE_ERROR);
+                return (error);
+            }
+        }
+    }
+
+    RHO_ASSERT(agent->ra_bodyfd != -1 ||
+            rho_buf_length(agent->ra_bodybuf) == agent->ra_hdr.rh_bodylen);
+
+    if (agent->ra_aead != NULL) {
+        /* with a PSK, nothing can be sealed before the peer's salt is in */
+        if (agent->ra_salt_in) {
+            error = rpc_agent_await_salt(agent, 0);
+            if (error != 0) {
+                rpc_agent_set_state(agent, RPC_STATE_ERROR);
+                return (error);
+            }
+        }
+        agent->ra_hdr.rh_flags |= RPC_HDR_F_AEAD;
+        error = rpc_agent_seal_body(agent);
+        if (error != 0) {
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
+            return (error);
+        }
+    } else {
+        if (agent->ra_memfd_threshold > 0 && agent->ra_bodyfd == -1 &&
+                agent->ra_hdr.rh_bodylen >= agent->ra_memfd_threshold)
+            rpc_agent_attach_memfd(agent);
+
+        if (agent->ra_crc_out && agent->ra_hdr.rh_bodylen > 0 &&
+                !(agent->ra_hdr.rh_flags & RPC_HDR_F_MEMFD))
+            rpc_agent_add_crc(agent);
+    }
 
-    rpc_agent_pack_hdr(agent);
+pack:
+    if (rho_buf_length(agent->ra_bodybuf) > agent->ra_bodycap)
+        agent->ra_bodycap = rho_buf_length(agent->ra_bodybuf);
+
+    /* the length was checked above */
+    if (agent->ra_salt_out)
+        rpc_agent_pack_salted_hdr(agent);
+    else
+        (void)rpc_agent_pack_hdr(agent);
     rho_buf_rewind(agent->ra_bodybuf);
-    agent->ra_state = RPC_STATE_SEND_HDR;
+    rpc_agent_set_state(agent, RPC_STATE_SEND_HDR);
+    return (0);
 }
 
 /*********************************************************
@@ -138,11 +1465,14 @@ rpc_agent_create(struct rho_sock *sock, struct rho_event *event)
     RHO_TRACE_ENTER();
 
     agent = rhoL_zalloc(sizeof(*agent));
-    agent->ra_state = RPC_STATE_HANDSHAKE;
-    agent->ra_hdrbuf = rho_buf_bounded_create(RPC_HDR_LENGTH);
+    rpc_agent_set_state(agent, RPC_STATE_HANDSHAKE);
+    agent->ra_hdrbuf = rho_buf_bounded_create(RPC_HDRBUF_LENGTH);
     agent->ra_bodybuf = rho_buf_create();
     agent->ra_event = event;
     agent->ra_sock = sock;
+    agent->ra_bodyfd = -1;
+    agent->ra_txfd = -1;
+    agent->ra_rxfd = -1;
 
     RHO_TRACE_EXIT();
     return (agent);
@@ -155,6 +1485,18 @@ rpc_agent_destroy(struct rpc_agent *agent)
 
     rho_buf_destroy(agent->ra_hdrbuf);
     rho_buf_destroy(agent->ra_bodybuf);
+    rpc_agent_clear_bodyfd(agent);
+    rpc_agent_clear_bodymap(agent);
+    rpc_agent_clear_fds(agent);
+    if (agent->ra_trace != NULL)
+        rpc_trace_destroy(agent->ra_trace);
+    if (agent->ra_aead != NULL)
+        rpc_aead_destroy(agent->ra_aead);
+    if (agent->ra_rawsock != NULL) {
+        /* the fd is ra_sock's, and closed with it */
+        agent->ra_rawsock->fd = -1;
+        rho_sock_destroy(agent->ra_rawsock);
+    }
     if (agent->ra_sock != NULL)
         rho_sock_destroy(agent->ra_sock);
     rhoL_free(agent);
@@ -171,10 +1513,64 @@ rpc_agent_new_msg(struct rpc_agent *agent, uint32_t code)
     rho_buf_clear(agent->ra_hdrbuf);
     rho_memzero(&agent->ra_hdr, sizeof(agent->ra_hdr));
     rho_buf_clear(agent->ra_bodybuf);
+    rpc_agent_clear_bodyfd(agent);
+    rpc_agent_clear_bodymap(agent);
+    rpc_agent_clear_fds(agent);
     
     agent->ra_hdr.rh_code = code;
 }
 
+/* 
+ * Use the len bytes of fd, starting at offset, as the message body.  The
+ * bytes are sent with sendfile(2), and thus never copied into user space
+ * (except for TLS sockets, where they must be encrypted, and transports).
+ * The agent's bodylen is set to len; do not call rpc_agent_autoset_bodylen
+ * afterwards.
+ *
+ * If close_when_sent is true, the agent owns fd and closes it once the body
+ * has been sent (or the message is discarded); otherwise, the caller must
+ * keep fd open until then.  Returns 0, or EMSGSIZE if len is over
+ * RPC_MAX_BODYLEN; fd is then closed at once if close_when_sent is true.
+ */
+int
+rpc_agent_set_bodyfd(struct rpc_agent *agent, int fd, off_t offset,
+        size_t len, bool close_when_sent)
+{
+    RHO_ASSERT(fd >= 0);
+    RHO_ASSERT(rho_buf_length(agent->ra_bodybuf) == 0);
+
+    if (len > RPC_MAX_BODYLEN) {
+        rho_warn("body fd range of %zu bytes is over RPC_MAX_BODYLEN", len);
+        if (close_when_sent)
+            (void)close(fd);
+        return (EMSGSIZE);
+    }
+
+    rpc_agent_clear_bodyfd(agent);
+    agent->ra_bodyfd = fd;
+    agent->ra_bodyfd_close = close_when_sent;
+    agent->ra_bodyfd_off = offset;
+    agent->ra_bodyfd_left = len;
+    return (rpc_agent_set_bodylen(agent, len));
+}
+
+/*
+ * Set the body length of the message being built.  Returns 0, or EMSGSIZE
+ * (leaving it unchanged) if it is over RPC_MAX_BODYLEN, as it would spill
+ * into the header's flags.
+ */
+int
+rpc_agent_set_bodylen(struct rpc_agent *agent, size_t bodylen)
+{
+    if (bodylen > RPC_MAX_BODYLEN) {
+        rho_warn("body length %zu is over RPC_MAX_BODYLEN", bodylen);
+        return (EMSGSIZE);
+    }
+
+    agent->ra_hdr.rh_bodylen = (uint32_t)bodylen;
+    return (0);
+}
+
 /*********************************************************
  * CORE EVENT-LOOP METHODS
  *********************************************************/
@@ -182,38 +1578,61 @@ void
 rpc_agent_recv_hdr(struct rpc_agent *agent)
 {
     struct rho_buf *buf = agent->ra_hdrbuf;
-    struct rho_sock *sock = agent->ra_sock;
     size_t need = 0;
     ssize_t got = 0;
+    int ret = 0;
 
     RHO_ASSERT(agent->ra_state == RPC_STATE_RECV_HDR);
-    RHO_ASSERT(rho_buf_length(buf) < RPC_HDR_LENGTH);
+    RHO_ASSERT(rho_buf_length(buf) < RPC_HDRBUF_LENGTH);
 
     RHO_TRACE_ENTER();
 
-    need = RPC_HDR_LENGTH - rho_buf_length(buf);
+    agent->ra_io.is_npasses++;
+    if (rho_buf_length(buf) == 0) {
+        rpc_agent_clear_bodymap(agent);
+        /* the header may trickle in over several passes; time the first */
+        agent->ra_recv_ns = rpc_now_ns();
+    }
+
+again:
+    need = rpc_agent_hdr_need(agent);
     RHO_ASSERT(need != 0);
-    got = rho_sock_recv_buf(sock, buf, need);
+    got = rpc_agent_recv_hdr_buf(agent, buf, need);
+    rpc_agent_note_io(agent, RPC_TRACE_RECV, got, need);
 
     if (got == -1) {
         if (errno != EAGAIN) {
-            agent->ra_state = RPC_STATE_ERROR;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
             rho_errno_warn(errno, "rho_sock_recv_buf(sock->fd=%d) failed",
-                    sock->fd);
+                    rpc_agent_fd(agent));
         }
     } else if (got == 0) {
-        agent->ra_state = RPC_STATE_CLOSED;
+        rpc_agent_set_state(agent, RPC_STATE_CLOSED);
     } else if ((size_t)got == need) {
-        (void)rpc_agent_unpack_hdr(agent);
+        if (agent->ra_salt_in) {
+            /* the peer's salt is in; its header follows */
+            if (rpc_agent_salt_received(agent) == 0)
+                goto again;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
+            goto done;
+        }
+        /* the fixed part is in, and says that an extension follows */
+        if (rpc_hdr_need(buf) != 0)
+            goto again;
+        ret = rpc_agent_hdr_received(agent);
         rho_debug("bodylen: %"PRIu32, rpc_agent_get_bodylen(agent));
-        if (rpc_agent_get_bodylen(agent) > 0) {
-            agent->ra_state = RPC_STATE_RECV_BODY;
-        } else {
+        if (ret == 0) {
+            rpc_agent_set_state(agent, RPC_STATE_RECV_BODY);
+        } else if (ret == 1) {
+            agent->ra_io.is_nmsgs_in++;
             agent->ra_event->flags = RHO_EVENT_WRITE;
             rpc_agent_set_dispatchable(agent);
+        } else {
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
         }
     }
 
+done:
     RHO_TRACE_EXIT("need=%zu, got=%zd, state=%s",
             need, got, rpc_state_to_str(agent->ra_state));
 }
@@ -222,7 +1641,7 @@ void
 rpc_agent_recv_body(struct rpc_agent *agent)
 {
     struct rho_buf *buf = agent->ra_bodybuf;
-    struct rho_sock *sock = agent->ra_sock;
+    size_t have = 0;
     size_t need = 0;
     ssize_t got = 0;
 
@@ -230,11 +1649,14 @@ rpc_agent_recv_body(struct rpc_agent *agent)
 
     RHO_TRACE_ENTER();
 
+    agent->ra_io.is_npasses++;
+
     /* 
      * XXX: is this necessary -- should we even be in this function
      * if this condition is met?
      */
-    need = agent->ra_hdr.rh_bodylen - rho_buf_length(buf);
+    have = rho_buf_length(buf);
+    need = rpc_agent_wire_bodylen(agent) - have;
     RHO_ASSERT(need != 0);
 #if 0
     if (need == 0) {
@@ -244,20 +1666,31 @@ rpc_agent_recv_body(struct rpc_agent *agent)
     }
 #endif
 
-    got = rho_sock_recv_buf(sock, buf, need);
+    got = rpc_agent_recv_buf(agent, buf, need);
+    rpc_agent_note_io(agent, RPC_TRACE_RECV, got, need);
+    if (got > 0 && rpc_agent_body_received(agent, have, got) != 0) {
+        rpc_agent_set_state(agent, RPC_STATE_ERROR);
+        goto done;
+    }
     if (got == -1) {
         if (errno != EAGAIN) {
-            agent->ra_state = RPC_STATE_ERROR;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
             rho_errno_warn(errno, "rho_sock_recv_buf(sock->fd=%d) failed",
-                    sock->fd);
+                    rpc_agent_fd(agent));
         }
     } else if (got == 0) {
-        agent->ra_state = RPC_STATE_CLOSED;
+        rpc_agent_set_state(agent, RPC_STATE_CLOSED);
     } else if ((size_t)got == need) {
+        if (rpc_agent_check_trailer(agent) != 0) {
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
+            goto done;
+        }
+        agent->ra_io.is_nmsgs_in++;
         agent->ra_event->flags = RHO_EVENT_WRITE;
         rpc_agent_set_dispatchable(agent);
     }
 
+done:
     RHO_TRACE_EXIT("need=%zu, got=%zd, state=%s", need, got, 
             rpc_state_to_str(agent->ra_state));
 }
@@ -265,7 +1698,6 @@ rpc_agent_recv_body(struct rpc_agent *agent)
 void
 rpc_agent_send_hdr(struct rpc_agent *agent)
 {
-    struct rho_sock *sock = agent->ra_sock;
     struct rho_buf *buf = agent->ra_hdrbuf;
     size_t left = 0;
     ssize_t nput = 0;
@@ -274,21 +1706,25 @@ rpc_agent_send_hdr(struct rpc_agent *agent)
 
     RHO_TRACE_ENTER();
 
+    agent->ra_io.is_npasses++;
+
     left = rho_buf_left(buf);
-    nput = rho_sock_send_buf(sock, buf, left);
+    nput = rpc_agent_send_hdr_buf(agent, buf, left);
+    rpc_agent_note_io(agent, RPC_TRACE_SEND, nput, left);
 
     if (nput == -1) {
         if (errno != EAGAIN) {
-            agent->ra_state = RPC_STATE_ERROR;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
             rho_errno_warn(errno, "rho_sock_send_hdr(sock->fd=%d) failed",
-                    sock->fd);
+                    rpc_agent_fd(agent));
         }
     } else if ((size_t)nput == left) {
-        if (agent->ra_hdr.rh_bodylen > 0) {
-            agent->ra_state = RPC_STATE_SEND_BODY;
+        if (rpc_agent_wire_bodylen(agent) > 0) {
+            rpc_agent_set_state(agent, RPC_STATE_SEND_BODY);
             agent->ra_event->flags = RHO_EVENT_WRITE;
         } else {
-            agent->ra_state = RPC_STATE_RECV_HDR;
+            agent->ra_io.is_nmsgs_out++;
+            rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
             agent->ra_event->flags = RHO_EVENT_READ;
         }
         
@@ -302,7 +1738,6 @@ rpc_agent_send_hdr(struct rpc_agent *agent)
 void
 rpc_agent_send_body(struct rpc_agent *agent)
 {
-    struct rho_sock *sock = agent->ra_sock;
     struct rho_buf *buf = agent->ra_bodybuf;
     size_t left = 0;
     ssize_t nput = 0;
@@ -311,19 +1746,29 @@ rpc_agent_send_body(struct rpc_agent *agent)
 
     RHO_TRACE_ENTER();
 
-    left = rho_buf_left(buf);
-    nput = rho_sock_send_buf(sock, buf, left);
+    agent->ra_io.is_npasses++;
+
+    if (agent->ra_bodyfd != -1) {
+        left = agent->ra_bodyfd_left;
+        nput = rpc_agent_sendfile(agent);
+    } else {
+        left = rho_buf_left(buf);
+        nput = rpc_agent_send_buf(agent, buf, left);
+    }
+    rpc_agent_note_io(agent, RPC_TRACE_SEND, nput, left);
 
     if (nput == -1) {
         if (errno != EAGAIN) {
-            agent->ra_state = RPC_STATE_ERROR;
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
             rho_errno_warn(errno, "rho_sock_send_body(sock->fd=%d) failed",
-                    sock->fd);
+                    rpc_agent_fd(agent));
         }
     } else if ((size_t)nput == left) {
-        agent->ra_state = RPC_STATE_RECV_HDR;
+        agent->ra_io.is_nmsgs_out++;
+        rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
         agent->ra_event->flags = RHO_EVENT_READ;
         rho_buf_clear(agent->ra_bodybuf);
+        rpc_agent_clear_bodyfd(agent);
     }
 
     RHO_TRACE_EXIT();
@@ -332,59 +1777,603 @@ rpc_agent_send_body(struct rpc_agent *agent)
 /*********************************************************
  * SIMPLE, SERIAL INTERFACE (e.g., NON EVENT-LOOP)
  *********************************************************/
+/* the learned spin limit never falls below this, so that it can grow back */
+#define RPC_SPIN_MIN    16
+
+/*
+ * Let rpc_agent_request spin for up to max_spins non-blocking peeks at the
+ * socket before blocking for the response (0, the default, always blocks).
+ * When responses come back quickly, this avoids sleeping in the kernel --
+ * and, in an enclave, the exit that a blocking call costs.  The number of
+ * spins actually used adapts to how long responses have been taking.
+ */
+void
+rpc_agent_set_spin(struct rpc_agent *agent, uint32_t max_spins)
+{
+    agent->ra_spin_max = max_spins;
+    agent->ra_spin_limit = max_spins;
+    agent->ra_spin_hits = 0;
+    agent->ra_spin_misses = 0;
+}
+
+/*
+ * Spin until the response starts to arrive, or the spin limit is reached.
+ * A hit moves the limit toward four times the spins it took, leaving room
+ * for jitter; a miss cuts it by a quarter, so that a server that has gone
+ * slow soon stops costing us CPU.
+ *
+ * The probe only sees the socket, so a response that OpenSSL has already
+ * read (with the previous record) ends the wait before it starts; SSL_read
+ * then returns it without touching the socket.
+ */
+static void
+rpc_agent_spin(struct rpc_agent *agent)
+{
+    uint32_t i = 0;
+    uint8_t c = 0;
+    uint64_t want = 0;
+    ssize_t n = 0;
+
+    if (agent->ra_spin_max == 0 || agent->ra_xops != NULL)
+        return;
+
+    if (agent->ra_sock->ssl != NULL && !agent->ra_raw &&
+            SSL_pending(agent->ra_sock->ssl->ssl) > 0)
+        return;
+
+    for (i = 0; i < agent->ra_spin_limit; i++) {
+        n = recv(agent->ra_sock->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        agent->ra_io.is_nrecvs++;
+        if (n != -1 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR))
+            break;  /* data, EOF, or an error for the real recv to report */
+        agent->ra_io.is_nagain++;
+    }
+
+    if (i < agent->ra_spin_limit) {
+        agent->ra_spin_hits++;
+        want = (uint64_t)i * 4;
+        if (want > agent->ra_spin_max)
+            want = agent->ra_spin_max;
+        agent->ra_spin_limit = (agent->ra_spin_limit * 7ULL + want) / 8;
+    } else {
+        agent->ra_spin_misses++;
+        agent->ra_spin_limit -= agent->ra_spin_limit / 4;
+    }
+
+    if (agent->ra_spin_limit < RPC_SPIN_MIN)
+        agent->ra_spin_limit = RPC_SPIN_MIN < agent->ra_spin_max ?
+            RPC_SPIN_MIN : agent->ra_spin_max;
+}
+
+/*
+ * Send the len bytes of buf from its position, as rho_sock_sendn_buf does
+ * (and with the socket's SO_SNDTIMEO bounding each send).  Over a transport,
+ * EAGAIN is retried until expiry (if nonzero).  Returns len or -1 with errno
+ * set.
+ */
+static ssize_t
+rpc_agent_sendn(struct rpc_agent *agent, struct rho_buf *buf, size_t len,
+        uint64_t expiry)
+{
+    ssize_t n = 0;
+    size_t left = len;
+
+    if (agent->ra_xops == NULL) {
+        n = rho_sock_sendn_buf(rpc_agent_sock(agent), buf, len);
+        rpc_agent_note_io(agent, RPC_TRACE_SEND, n, len);
+        return (n);
+    }
+
+    while (left > 0) {
+        if (expiry != 0 &&
+                rpc_agent_arm_timeout(agent, SO_SNDTIMEO, expiry) == -1)
+            return (-1);
+
+        n = rpc_agent_send_buf(agent, buf, left);
+        rpc_agent_note_io(agent, RPC_TRACE_SEND, n, left);
+        if (n == -1) {
+            if (errno == EAGAIN)
+                (void)sched_yield();    /* let the peer drain it */
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return (-1);
+        }
+        left -= n;
+    }
+
+    return ((ssize_t)len);
+}
+
+/*
+ * Receive len more bytes into buf (with rpc_agent_recv_hdr_buf if hdr, so
+ * that an attached fd is collected).  If expiry is nonzero, each recv is
+ * bounded by the time left until then, and running out fails with
+ * ETIMEDOUT.  Over a transport, EAGAIN is retried.  Returns 0 or -1 with
+ * errno set.
+ */
+static int
+rpc_agent_recvn(struct rpc_agent *agent, struct rho_buf *buf, size_t len,
+        bool hdr, uint64_t expiry)
+{
+    ssize_t n = 0;
+
+    if (expiry == 0 && agent->ra_xops == NULL &&
+            !(hdr && agent->ra_memfd_threshold > 0)) {
+        n = rho_sock_precvn_buf(rpc_agent_sock(agent), buf, len);
+        rpc_agent_note_io(agent, RPC_TRACE_RECV, n, len);
+        rho_debug("rho_sock_precvn_buf returned %zd", n);
+        return (n == -1 ? -1 : 0);
+    }
+
+    while (len > 0) {
+        if (expiry != 0 &&
+                rpc_agent_arm_timeout(agent, SO_RCVTIMEO, expiry) == -1)
+            return (-1);
+
+        if (hdr)
+            n = rpc_agent_recv_hdr_buf(agent, buf, len);
+        else
+            n = rpc_agent_recv_buf(agent, buf, len);
+        rpc_agent_note_io(agent, RPC_TRACE_RECV, n, len);
+
+        if (n == -1) {
+            if (errno == EAGAIN && agent->ra_xops != NULL) {
+                (void)sched_yield();    /* let the peer fill it */
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                errno = ETIMEDOUT;
+            return (-1);
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return (-1);
+        }
+        len -= n;
+    }
+
+    return (0);
+}
+
 /* 
- * on success, ra_bodybuf is the response body 
- * TODO: what does this function return?
+ * Send the message built in agent as a request, and wait for the response.
+ * Returns 0, with the response in ra_hdr and ra_bodybuf, or -1 with errno
+ * set.  After a timeout (ETIMEDOUT), the response may yet arrive, so the
+ * agent is left in RPC_STATE_ERROR, and any further request on it fails
+ * with EPIPE: the connection must be closed.
  */
 int
 rpc_agent_request(struct rpc_agent *agent)
 {
     int error = 0;
+    int ret = 0;
     ssize_t n = 0;
-    struct rho_sock *sock = agent->ra_sock;
+    size_t len = 0;
+    uint64_t expiry = 0;
     struct rho_buf *hdrbuf = agent->ra_hdrbuf;
     struct rho_buf *bodybuf = agent->ra_bodybuf;
     struct rpc_hdr *hdr = &agent->ra_hdr;
 
     RHO_TRACE_ENTER();
 
-    rpc_agent_ready_send(agent);
+    if (agent->ra_state == RPC_STATE_ERROR) {
+        RHO_TRACE_EXIT("agent is in RPC_STATE_ERROR");
+        errno = EPIPE;
+        return (-1);
+    }
 
-    n = rho_sock_sendn_buf(sock, hdrbuf, rho_buf_length(hdrbuf));
-    if (n == -1) {
-        error = -1;
-        goto done;
+    if (agent->ra_timeout_us != 0) {
+        expiry = rpc_now_ns() + (uint64_t)agent->ra_timeout_us * 1000;
+        rpc_agent_set_deadline(agent, agent->ra_timeout_us);
+        if (rpc_agent_arm_timeout(agent, SO_SNDTIMEO, expiry) == -1) {
+            error = -1;
+            goto done;
+        }
     }
 
-    n = rho_sock_sendn_buf(sock, bodybuf, rho_buf_length(bodybuf));
-    if (n == -1) {
+    if (agent->ra_salt_in) {
+        ret = rpc_agent_await_salt(agent, expiry);
+        if (ret != 0) {
+            errno = ret;
+            error = -1;
+            goto done;
+        }
+    }
+
+    ret = rpc_agent_ready_send(agent);
+    if (ret != 0) {
+        errno = ret;
         error = -1;
         goto done;
     }
 
+    if (agent->ra_txfd != -1) {
+        do {
+            len = rho_buf_left(hdrbuf);
+            n = rpc_agent_sendfd_buf(agent, hdrbuf, len);
+            rpc_agent_note_io(agent, RPC_TRACE_SEND, n, len);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1) {
+            error = -1;
+            goto done;
+        }
+    }
+
+    len = rho_buf_left(hdrbuf);
+    if (len > 0) {
+        n = rpc_agent_sendn(agent, hdrbuf, len, expiry);
+        if (n == -1) {
+            error = -1;
+            goto done;
+        }
+    }
+    rpc_agent_set_state(agent, RPC_STATE_SEND_BODY);
+
+    while (agent->ra_bodyfd != -1 && agent->ra_bodyfd_left > 0) {
+        len = agent->ra_bodyfd_left;
+        n = rpc_agent_sendfile(agent);
+        rpc_agent_note_io(agent, RPC_TRACE_SEND, n, len);
+        if (n == -1 && errno != EINTR) {
+            error = -1;
+            goto done;
+        }
+    }
+    rpc_agent_clear_bodyfd(agent);
+
+    len = rho_buf_length(bodybuf);
+    if (len > 0) {
+        n = rpc_agent_sendn(agent, bodybuf, len, expiry);
+        if (n == -1) {
+            error = -1;
+            goto done;
+        }
+    }
+    agent->ra_io.is_nmsgs_out++;
+
     rho_buf_clear(hdrbuf);
     rho_buf_clear(bodybuf);
+    rpc_agent_clear_bodymap(agent);
 
-    n = rho_sock_precvn_buf(sock, hdrbuf, RPC_HDR_LENGTH);
-    rho_debug("rho_sock_prcevn_buf for the hdr returned %zd", n);
-    if (n == -1) {
+    rpc_agent_set_state(agent, RPC_STATE_RECV_HDR);
+    rpc_agent_spin(agent);
+    agent->ra_recv_ns = rpc_now_ns();
+    error = rpc_agent_recvn(agent, hdrbuf, RPC_HDR_LENGTH, true, expiry);
+    if (error == 0 && rpc_hdr_need(hdrbuf) != 0)
+        error = rpc_agent_recvn(agent, hdrbuf, rpc_hdr_need(hdrbuf), true,
+                expiry);
+    if (error == -1)
+        goto done;
+
+    ret = rpc_agent_hdr_received(agent);
+    if (ret == 1)
+        goto done;
+    if (ret != 0) {
+        errno = ret;
         error = -1;
         goto done;
     }
 
-    (void)rpc_agent_unpack_hdr(agent);
-    if (hdr->rh_bodylen > 0) {
+    len = rpc_agent_wire_bodylen(agent);
+    if (len > 0) {
         rho_debug("response code=%"PRIu32", bodylen=%"PRIu32, hdr->rh_code,
                 hdr->rh_bodylen);
         rho_debug("receiving rpc body");
-        n = rho_sock_precvn_buf(sock, bodybuf, hdr->rh_bodylen);
-        if (n == -1) {
-            error = -1;
-            goto done;
+        rpc_agent_set_state(agent, RPC_STATE_RECV_BODY);
+        error = rpc_agent_recvn(agent, bodybuf, len, false, expiry);
+        if (error == 0) {
+            ret = rpc_agent_body_received(agent, 0, len);
+            if (ret == 0)
+                ret = rpc_agent_check_trailer(agent);
+            if (ret != 0) {
+                errno = ret;
+                error = -1;
+            }
+        }
+    }
+
+done:
+    if (error == -1 && expiry != 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            errno = ETIMEDOUT;
+        /* the response may yet arrive; the connection is out of step */
+        if (errno == ETIMEDOUT)
+            rpc_agent_set_state(agent, RPC_STATE_ERROR);
+    }
+    if (error == 0)
+        agent->ra_io.is_nmsgs_in++;
+    RPC_AGENT_TRACE(agent, RPC_TRACE_DONE, 0,
+            error == 0 ? hdr->rh_code : (uint32_t)errno);
+    RHO_TRACE_EXIT();
+    return (error);
+}
+
+/*********************************************************
+ * COMPOUND REQUESTS
+ *********************************************************/
+/* overwrite the u32 at offset off of buf, leaving the position unchanged */
+static void
+rpc_buf_patchu32be(struct rho_buf *buf, size_t off, uint32_t v)
+{
+    size_t pos = rho_buf_tell(buf);
+
+    rho_buf_seek(buf, off, SEEK_SET);
+    rho_buf_writeu32be(buf, v);
+    rho_buf_seek(buf, pos, SEEK_SET);
+}
+
+void
+rpc_agent_new_compound(struct rpc_agent *agent, uint32_t flags)
+{
+    rpc_agent_new_msg(agent, RPC_OP_COMPOUND);
+    rho_buf_writeu32be(agent->ra_bodybuf, flags);
+    rho_buf_writeu32be(agent->ra_bodybuf, 0);   /* nops */
+    rpc_agent_autoset_bodylen(agent);
+}
+
+/* 
+ * Start a new operation of the compound request; the operation's body is
+ * whatever is written to agent->ra_bodybuf before the matching
+ * rpc_agent_compound_end_op, which takes the returned cookie.
+ */
+size_t
+rpc_agent_compound_begin_op(struct rpc_agent *agent, uint32_t code,
+        uint32_t opflags)
+{
+    struct rho_buf *buf = agent->ra_bodybuf;
+    size_t cookie = 0;
+
+    RHO_ASSERT(agent->ra_hdr.rh_code == RPC_OP_COMPOUND);
+    RHO_ASSERT(code != RPC_OP_COMPOUND);
+
+    rho_buf_writeu32be(buf, code);
+    rho_buf_writeu32be(buf, opflags);
+    cookie = rho_buf_tell(buf);
+    rho_buf_writeu32be(buf, 0);     /* len */
+
+    return (cookie);
+}
+
+void
+rpc_agent_compound_end_op(struct rpc_agent *agent, size_t cookie)
+{
+    struct rho_buf *buf = agent->ra_bodybuf;
+    const uint8_t *p = NULL;
+    uint32_t nops = 0;
+
+    p = rho_buf_raw(buf, 4, SEEK_SET);
+    nops = rpc_getu32be(p);
+    RHO_ASSERT(nops < RPC_COMPOUND_MAX_OPS);
+
+    rpc_buf_patchu32be(buf, cookie, rho_buf_length(buf) - cookie - 4);
+    rpc_buf_patchu32be(buf, 4, nops + 1);
+    rpc_agent_autoset_bodylen(agent);
+}
+
+void
+rpc_agent_compound_add(struct rpc_agent *agent, uint32_t code,
+        uint32_t opflags, const void *body, size_t len)
+{
+    size_t cookie = 0;
+
+    cookie = rpc_agent_compound_begin_op(agent, code, opflags);
+    if (len > 0)
+        rho_buf_write(agent->ra_bodybuf, body, len);
+    rpc_agent_compound_end_op(agent, cookie);
+}
+
+/*
+ * Iterate over the per-operation results of a compound response.  Returns
+ * the number of results, or -1 if the response body is malformed.
+ */
+int
+rpc_compound_iter_init(struct rpc_compound_iter *iter,
+        const struct rpc_agent *agent)
+{
+    iter->ci_p = rpc_agent_body(agent);
+    iter->ci_left = rpc_agent_get_bodylen(agent);
+    if (iter->ci_left < RPC_COMPOUND_RESP_HDRLEN)
+        return (-1);
+
+    iter->ci_nleft = rpc_getu32be(iter->ci_p);
+    iter->ci_p += RPC_COMPOUND_RESP_HDRLEN;
+    iter->ci_left -= RPC_COMPOUND_RESP_HDRLEN;
+
+    if (iter->ci_nleft > RPC_COMPOUND_MAX_OPS)
+        return (-1);
+
+    return (iter->ci_nleft);
+}
+
+/* 
+ * Returns 1 and sets status/body/len to the next result, 0 if there are no
+ * more results, or -1 if the response body is malformed.  body points into
+ * the agent's response, and so is valid until the agent's next message.
+ */
+int
+rpc_compound_iter_next(struct rpc_compound_iter *iter, uint32_t *status,
+        const void **body, size_t *len)
+{
+    uint32_t n = 0;
+
+    if (iter->ci_nleft == 0)
+        return (0);
+
+    if (iter->ci_left < RPC_COMPOUND_RESULT_HDRLEN)
+        return (-1);
+
+    *status = rpc_getu32be(iter->ci_p);
+    n = rpc_getu32be(iter->ci_p + 4);
+    if (n > iter->ci_left - RPC_COMPOUND_RESULT_HDRLEN)
+        return (-1);
+
+    *body = iter->ci_p + RPC_COMPOUND_RESULT_HDRLEN;
+    *len = n;
+
+    iter->ci_p += RPC_COMPOUND_RESULT_HDRLEN + n;
+    iter->ci_left -= RPC_COMPOUND_RESULT_HDRLEN + n;
+    iter->ci_nleft--;
+
+    return (1);
+}
+
+/*
+ * Run each operation of the DISPATCHABLE compound request in agent through
+ * dispatch, and replace the request with the compound response.  While an
+ * operation runs, the agent looks exactly like a DISPATCHABLE request for that
+ * operation alone, so dispatch needs no knowledge of compounds.  Returns 0,
+ * EPROTO if the request is malformed, or E2BIG if the combined response
+ * would be too large (in either case, that is also the response's code).
+ */
+int
+rpc_agent_dispatch_compound(struct rpc_agent *agent, rpc_dispatch_fn dispatch,
+        void *arg)
+{
+    int error = 0;
+    const uint8_t *p = rpc_agent_body(agent);
+    size_t left = rpc_agent_get_bodylen(agent);
+    struct rho_buf *reqbuf = agent->ra_bodybuf;
+    const uint8_t *reqmap = agent->ra_bodymap;
+    size_t reqmaplen = agent->ra_bodymaplen;
+    struct rho_buf *respbuf = NULL;
+    struct rho_buf *opbuf = NULL;
+    struct rho_buf *prevbuf = NULL;
+    struct rho_buf *tmp = NULL;
+    uint32_t flags = 0;
+    uint32_t nops = 0;
+    uint32_t code = 0;
+    uint32_t opflags = 0;
+    uint32_t oplen = 0;
+    uint32_t status = 0;
+    uint32_t first_error = 0;
+    uint32_t i = 0;
+
+    RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE);
+    RHO_ASSERT(agent->ra_hdr.rh_code == RPC_OP_COMPOUND);
+
+    RHO_TRACE_ENTER();
+
+    if (left < RPC_COMPOUND_HDRLEN) {
+        error = EPROTO;
+        goto done;
+    }
+    flags = rpc_getu32be(p);
+    nops = rpc_getu32be(p + 4);
+    p += RPC_COMPOUND_HDRLEN;
+    left -= RPC_COMPOUND_HDRLEN;
+    if (nops > RPC_COMPOUND_MAX_OPS) {
+        error = EPROTO;
+        goto done;
+    }
+
+    /* the request body must stay put while the operations run */
+    agent->ra_bodymap = NULL;
+    agent->ra_bodymaplen = 0;
+
+    respbuf = rho_buf_create();
+    opbuf = rho_buf_create();
+    prevbuf = rho_buf_create();
+    rho_buf_writeu32be(respbuf, 0);     /* nresults */
+
+    for (i = 0; i < nops; i++) {
+        if (left < RPC_COMPOUND_OP_HDRLEN) {
+            error = EPROTO;
+            break;
+        }
+        code = rpc_getu32be(p);
+        opflags = rpc_getu32be(p + 4);
+        oplen = rpc_getu32be(p + 8);
+        p += RPC_COMPOUND_OP_HDRLEN;
+        left -= RPC_COMPOUND_OP_HDRLEN;
+        if (oplen > left) {
+            error = EPROTO;
+            break;
+        }
+
+        rho_buf_clear(opbuf);
+        if (opflags & RPC_COMPOUND_OP_F_PREV)
+            rho_buf_write(opbuf, rho_buf_raw(prevbuf, 0, SEEK_SET),
+                    rho_buf_length(prevbuf));
+        rho_buf_write(opbuf, p, oplen);
+        p += oplen;
+        left -= oplen;
+
+        if (code == RPC_OP_COMPOUND ||
+                rho_buf_length(opbuf) > RPC_MAX_BODYLEN) {
+            status = EINVAL;
+            rho_buf_clear(opbuf);
+        } else {
+            agent->ra_bodybuf = opbuf;
+            rho_memzero(&agent->ra_hdr, sizeof(agent->ra_hdr));
+            agent->ra_hdr.rh_code = code;
+            rpc_agent_autoset_bodylen(agent);
+            rpc_agent_set_dispatchable(agent);
+
+            dispatch(agent, arg);
+
+            /* the bodyfd may be a file the op just opened: read it now */
+            if (agent->ra_bodyfd != -1 && rpc_agent_slurp_bodyfd(agent) != 0) {
+                rpc_agent_clear_bodyfd(agent);
+                rpc_agent_new_msg(agent, EIO);
+            }
+            /* likewise a body the op built in a memfd */
+            if (agent->ra_txmap != NULL)
+                rho_buf_write(opbuf, agent->ra_txmap, agent->ra_txmaplen);
+            rpc_agent_clear_bodymap(agent);
+            rpc_agent_clear_fds(agent);
+
+            /* dispatch may only have touched the buffer's contents */
+            RHO_ASSERT(agent->ra_bodybuf == opbuf);
+            status = agent->ra_hdr.rh_code;
+        }
+
+        if ((uint64_t)rho_buf_length(respbuf) + RPC_COMPOUND_RESULT_HDRLEN +
+                rho_buf_length(opbuf) > RPC_MAX_BODYLEN) {
+            error = E2BIG;
+            break;
+        }
+
+        rho_buf_writeu32be(respbuf, status);
+        rho_buf_writeu32be(respbuf, rho_buf_length(opbuf));
+        rho_buf_write(respbuf, rho_buf_raw(opbuf, 0, SEEK_SET),
+                rho_buf_length(opbuf));
+        rpc_buf_patchu32be(respbuf, 0, i + 1);
+
+        /* this op's response is the next op's "previous" */
+        tmp = prevbuf;
+        prevbuf = opbuf;
+        opbuf = tmp;
+
+        if (status != 0) {
+            if (first_error == 0)
+                first_error = status;
+            if (flags & RPC_COMPOUND_F_STOP_ON_ERROR)
+                break;
         }
     }
 
+    /* put the original request back, so that it is released as usual */
+    agent->ra_bodybuf = reqbuf;
+    agent->ra_bodymap = reqmap;
+    agent->ra_bodymaplen = reqmaplen;
+
+    if (error == 0) {
+        rpc_agent_new_msg(agent, first_error);
+        agent->ra_bodybuf = respbuf;
+        respbuf = reqbuf;
+        rpc_agent_autoset_bodylen(agent);
+        rpc_agent_set_dispatchable(agent);
+    }
+
+    rho_buf_destroy(respbuf);
+    rho_buf_destroy(opbuf);
+    rho_buf_destroy(prevbuf);
+
 done:
+    if (error != 0)
+        rpc_agent_new_msg(agent, error);
     RHO_TRACE_EXIT();
     return (error);
 }
@@ -1,6 +1,9 @@
 #ifndef _RPC_H_
 #define _RPC_H_
 
+#include <sys/types.h>
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,6 +16,55 @@
 RHO_DECLS_BEGIN
 
 #define RPC_HDR_LENGTH  8
+#define RPC_HDR_MAXLEN  (RPC_HDR_LENGTH + 4)    /* with a deadline */
+
+/*
+ * On the wire, the header is the code followed by the body length, each a
+ * big-endian uint32_t.  The top bits of the body length word are flags that
+ * describe how the body is carried.  Bodies are thus limited to
+ * RPC_MAX_BODYLEN bytes: a longer one is refused (EMSGSIZE) when the message
+ * is built or readied, and a peer that predates the flags, and so sends one
+ * anyway, is caught by the receiver, which fails (EPROTO) on a flag it
+ * doesn't know or hasn't enabled rather than mask it off.
+ */
+#define RPC_HDR_FLAGS_MASK      0xf0000000U
+#define RPC_HDR_BODYLEN_MASK    0x0fffffffU
+#define RPC_MAX_BODYLEN         RPC_HDR_BODYLEN_MASK
+
+/* body is in a sealed memfd passed (SCM_RIGHTS) with the header */
+#define RPC_HDR_F_MEMFD         0x80000000U
+
+/* 
+ * the header is followed by a big-endian uint32_t: the number of
+ * microseconds the sender will wait for the response
+ */
+#define RPC_HDR_F_DEADLINE      0x40000000U
+
+/*
+ * the body (which is inline, and not empty) is followed by a big-endian
+ * uint32_t trailer, which the body length does not count: the CRC32C of the
+ * body (see rpc_crc32c.h)
+ */
+#define RPC_HDR_F_CRC32C        0x20000000U
+#define RPC_TRAILER_LENGTH      4
+
+/*
+ * the message is sealed (see rpc_aead.h): the header is authenticated, and
+ * the body, which is inline and may be empty, is encrypted and followed by
+ * a RPC_AEAD_TAG_LENGTH-byte tag, which the body length does not count
+ */
+#define RPC_HDR_F_AEAD          0x10000000U
+
+#define RPC_HDR_F_ALL \
+    (RPC_HDR_F_MEMFD | RPC_HDR_F_DEADLINE | RPC_HDR_F_CRC32C | RPC_HDR_F_AEAD)
+
+/*
+ * Opcodes from RPC_OP_RESERVED up are reserved for requests that the library
+ * itself defines; applications must not use them for their own opcodes.
+ */
+#define RPC_OP_RESERVED         0xffff0000U
+#define RPC_OP_COMPOUND         0xffff0001U
+#define RPC_OP_STATS            0xffff0002U     /* see rpc_stats.h */
 
 /* 
  * for requests, rh_code is the request's opcode;
@@ -21,8 +73,13 @@ RHO_DECLS_BEGIN
 struct rpc_hdr {
     uint32_t    rh_code;
     uint32_t    rh_bodylen;
+    uint32_t    rh_flags;   /* RPC_HDR_F_* */
+    uint32_t    rh_deadline_us; /* if RPC_HDR_F_DEADLINE */
 };
 
+int rpc_hdr_pack(const struct rpc_hdr *hdr, struct rho_buf *buf);
+int rpc_hdr_unpack(struct rpc_hdr *hdr, struct rho_buf *buf);
+
 #define RPC_STATE_HANDSHAKE       1
 #define RPC_STATE_RECV_HDR        2
 #define RPC_STATE_RECV_BODY       3
@@ -32,22 +89,162 @@ struct rpc_hdr {
 #define RPC_STATE_CLOSED          7
 #define RPC_STATE_ERROR           8
 
+struct rpc_aead;
+struct rpc_trace;
+
+/*
+ * TRANSPORTS
+ *
+ * An agent normally moves bytes over its rho_sock.  Given a transport
+ * instead (see rpc_agent_set_transport, and rpc_mempipe.h for an in-memory
+ * one), it calls xo_recv to append up to len bytes to buf, and xo_send to
+ * send up to len bytes from buf's position, advancing the position past
+ * what was sent.  Each returns the number of bytes moved (xo_recv returns
+ * 0 at end of file; xo_send never returns 0), or -1 with errno set --
+ * EAGAIN if nothing can move yet.  A transport never blocks, so
+ * rpc_agent_request yields and retries on EAGAIN, until its timeout (if
+ * any) expires.
+ *
+ * The features that need a socket -- memfd attachments, sendfile of a
+ * bodyfd (the body is read into memory instead), and spinning -- are not
+ * available over a transport.
+ */
+struct rpc_transport_ops {
+    ssize_t (*xo_recv)(void *ctx, struct rho_buf *buf, size_t len);
+    ssize_t (*xo_send)(void *ctx, struct rho_buf *buf, size_t len);
+};
+
+/*
+ * I/O accounting.  A call is a single send or receive on the socket (a
+ * system call, or, with TLS, a SSL_read or SSL_write) or transport.  In
+ * rpc_agent_request, where rho_sock's *n_buf functions loop internally,
+ * each of their calls counts once, so the counts there are lower bounds;
+ * each non-blocking peek while spinning counts as a receive.
+ */
+struct rpc_io_stats {
+    uint64_t    is_nrecvs;
+    uint64_t    is_nsends;
+    uint64_t    is_bytes_in;
+    uint64_t    is_bytes_out;
+    uint64_t    is_nagain;      /* calls that would have blocked */
+    uint64_t    is_npartial;    /* calls that moved some, not all, wanted */
+    uint64_t    is_npasses;     /* calls of rpc_agent_{recv,send}_{hdr,body} */
+    uint64_t    is_nmsgs_in;    /* messages received in full */
+    uint64_t    is_nmsgs_out;   /* messages sent in full */
+};
+
 struct rpc_agent {
     int ra_state;
     struct rpc_hdr  ra_hdr;     /* parsed out header */
     struct rho_buf *ra_hdrbuf;  /* buffer for recv/send of headr */
     struct rho_buf *ra_bodybuf; /* holds body of req/resp */
+    size_t  ra_bodycap;         /* most ra_bodybuf has held; it never shrinks */
     struct rho_event *ra_event; /* weak pointer */
-    struct rho_sock *ra_sock;
+    struct rho_sock *ra_sock;   /* NULL if ra_xops is set */
+    bool    ra_raw;             /* bypass ra_sock's TLS layer (see ra_aead) */
+    const struct rpc_transport_ops *ra_xops;
+    void   *ra_xctx;            /* weak pointer; passed to ra_xops */
+
+    /* 
+     * if ra_bodyfd != -1, the body to send is the next ra_bodyfd_left bytes
+     * of ra_bodyfd, starting at ra_bodyfd_off, rather than ra_bodybuf
+     */
+    int     ra_bodyfd;
+    bool    ra_bodyfd_close;    /* close ra_bodyfd once it has been sent */
+    off_t   ra_bodyfd_off;
+    size_t  ra_bodyfd_left;
+
+    /* 
+     * memfd attachments (plain unix sockets only).  Bodies of at least
+     * ra_memfd_threshold bytes are sent as a sealed memfd rather than
+     * through the socket; 0 disables.  A received attachment is mapped
+     * read-only at ra_bodymap instead of being copied to ra_bodybuf.  A body
+     * built in place (rpc_agent_memfd_body) is mapped at ra_txmap until it
+     * is sealed.
+     */
+    size_t  ra_memfd_threshold;
+    int     ra_txfd;            /* memfd to pass with the outgoing header */
+    uint8_t *ra_txmap;
+    size_t  ra_txmaplen;
+    int     ra_rxfd;            /* fd that arrived with the incoming header */
+    const uint8_t *ra_bodymap;
+    size_t  ra_bodymaplen;
+
+    /*
+     * body checksums.  With ra_crc_out, each body sent inline carries a
+     * RPC_HDR_F_CRC32C trailer.  A received body with a trailer is checked
+     * before the message is handed over (the trailer is left in ra_bodybuf,
+     * after the body), and turns ra_crc_out on, so that replies carry one
+     * too.  ra_crc is the CRC32C of the body received so far.
+     */
+    bool        ra_crc_out;
+    uint32_t    ra_crc;
+
+    /*
+     * AEAD record mode (see rpc_aead.h).  With ra_aead, every message sent
+     * is sealed, and every message received must be, and is opened before
+     * it is handed over.  With a pre-shared key, our salt is still to be
+     * sent (in front of the next header) while ra_salt_out, and the peer's
+     * is still to be received (before anything is sealed or opened) while
+     * ra_salt_in; the responder sends its salt as soon as it is set up.
+     * When the key came from ra_sock's TLS handshake, ra_raw is set, and
+     * the sealed messages go straight over the socket, through ra_rawsock
+     * (a plain socket on the same fd), not through TLS.
+     */
+    struct rpc_aead *ra_aead;
+    bool    ra_salt_out;
+    bool    ra_salt_in;
+    struct rho_sock *ra_rawsock;
+
+    /* 
+     * ra_timeout_us bounds each rpc_agent_request (0 waits forever) and is
+     * sent as the request's deadline.  ra_deadline_ns is when the request
+     * just received expires (CLOCK_MONOTONIC), or 0 if it has no deadline.
+     *
+     * As the peers' clocks needn't agree, the deadline is counted from
+     * ra_recv_ns, when the receiver started to read the request's header.
+     * Time spent before that -- in the socket's receive queue, or, for a
+     * new connection, in the listen backlog -- is not counted, and that is
+     * where requests wait when the server is overloaded.  Servers should
+     * therefore also bound the number of requests in flight (rpc_admit).
+     */
+    uint32_t    ra_timeout_us;
+    uint64_t    ra_deadline_ns;
+
+    uint64_t    ra_recv_ns;     /* when reading the last header began */
+
+    /* 
+     * spin-then-block waiting in rpc_agent_request: poll for the response
+     * for up to ra_spin_limit non-blocking peeks (learned, and at most
+     * ra_spin_max; 0 disables) before blocking.
+     */
+    uint32_t    ra_spin_max;
+    uint32_t    ra_spin_limit;
+    uint64_t    ra_spin_hits;   /* response arrived while spinning */
+    uint64_t    ra_spin_misses; /* had to block */
+
+    struct rpc_trace *ra_trace; /* if tracing; see rpc_trace.h */
+
+    struct rpc_io_stats ra_io;
 };
 
 const char * rpc_state_to_str(int state);
-void rpc_agent_ready_send(struct rpc_agent *agent);
+void rpc_agent_set_state(struct rpc_agent *agent, int state);
+void rpc_agent_set_trace(struct rpc_agent *agent, uint32_t nevents);
+
+#define rpc_agent_io_stats(agent) \
+    ((const struct rpc_io_stats *)&(agent)->ra_io)
+
+void rpc_io_stats_add(struct rpc_io_stats *sum,
+        const struct rpc_io_stats *io);
+int rpc_agent_ready_send(struct rpc_agent *agent);
 
 struct rpc_agent * rpc_agent_create(struct rho_sock *sock,
         struct rho_event *event);
 
 void rpc_agent_destroy(struct rpc_agent *agent);
+void rpc_agent_set_transport(struct rpc_agent *agent,
+        const struct rpc_transport_ops *ops, void *ctx);
 
 void rpc_agent_recv_hdr(struct rpc_agent *agent);
 void rpc_agent_recv_body(struct rpc_agent *agent);
@@ -61,11 +258,96 @@ int rpc_agent_request(struct rpc_agent *agent);
 
 void rpc_agent_new_msg(struct rpc_agent *agent, uint32_t code);
 
+/*
+ * A server's dispatch function: handles the DISPATCHABLE request in agent
+ * and builds its response (but does not call rpc_agent_ready_send).
+ */
+typedef void (*rpc_dispatch_fn)(struct rpc_agent *agent, void *arg);
+
+int rpc_agent_set_bodyfd(struct rpc_agent *agent, int fd, off_t offset,
+        size_t len, bool close_when_sent);
+
+int rpc_agent_set_memfd_threshold(struct rpc_agent *agent, size_t threshold);
+void * rpc_agent_memfd_body(struct rpc_agent *agent, size_t len);
+void rpc_agent_set_crc(struct rpc_agent *agent, bool on);
+int rpc_agent_set_aead(struct rpc_agent *agent, int cipher,
+        const uint8_t *psk, size_t keylen, bool initiator);
+int rpc_agent_set_aead_from_tls(struct rpc_agent *agent, int cipher);
+const void * rpc_agent_body(const struct rpc_agent *agent);
+
+#define rpc_agent_body_is_mapped(agent) \
+    ((agent)->ra_bodymap != NULL)
+
+uint64_t rpc_now_ns(void);
+int rpc_agent_set_timeout(struct rpc_agent *agent, uint32_t usec);
+void rpc_agent_set_spin(struct rpc_agent *agent, uint32_t max_spins);
+bool rpc_agent_deadline_expired(const struct rpc_agent *agent);
+
+/* give the message being built (a request) a deadline usec from now */
+#define rpc_agent_set_deadline(agent, usec) \
+    do { \
+        (agent)->ra_hdr.rh_flags |= RPC_HDR_F_DEADLINE; \
+        (agent)->ra_hdr.rh_deadline_us = (usec); \
+    } while (0)
+
+/*
+ * COMPOUND REQUESTS
+ *
+ * A RPC_OP_COMPOUND request carries several operations that the server runs,
+ * in order, through its normal dispatch function, and answers with a single
+ * response.  The request body is
+ *
+ *      u32 flags, u32 nops, nops * { u32 code, u32 opflags, u32 len, body }
+ *
+ * and the response body is
+ *
+ *      u32 nresults, nresults * { u32 status, u32 len, body }
+ *
+ * The response's code is 0 if every operation that ran succeeded, or else the
+ * status of the first one that failed.
+ */
+#define RPC_COMPOUND_MAX_OPS            64
+
+/* sizes of the fixed parts of the bodies above */
+#define RPC_COMPOUND_HDRLEN             8   /* flags, nops */
+#define RPC_COMPOUND_OP_HDRLEN          12  /* code, opflags, len */
+#define RPC_COMPOUND_RESP_HDRLEN        4   /* nresults */
+#define RPC_COMPOUND_RESULT_HDRLEN      8   /* status, len */
+
+/* compound flags: don't run the operations after the first that fails */
+#define RPC_COMPOUND_F_STOP_ON_ERROR    0x00000001U
+
+/* 
+ * operation flags: the operation's request body is the previous operation's
+ * response body followed by the operation's own body
+ */
+#define RPC_COMPOUND_OP_F_PREV          0x00000001U
+
+struct rpc_compound_iter {
+    const uint8_t   *ci_p;
+    size_t          ci_left;
+    uint32_t        ci_nleft;
+};
+
+void rpc_agent_new_compound(struct rpc_agent *agent, uint32_t flags);
+size_t rpc_agent_compound_begin_op(struct rpc_agent *agent, uint32_t code,
+        uint32_t opflags);
+void rpc_agent_compound_end_op(struct rpc_agent *agent, size_t cookie);
+void rpc_agent_compound_add(struct rpc_agent *agent, uint32_t code,
+        uint32_t opflags, const void *body, size_t len);
+
+int rpc_compound_iter_init(struct rpc_compound_iter *iter,
+        const struct rpc_agent *agent);
+int rpc_compound_iter_next(struct rpc_compound_iter *iter, uint32_t *status,
+        const void **body, size_t *len);
+
+int rpc_agent_dispatch_compound(struct rpc_agent *agent,
+        rpc_dispatch_fn dispatch, void *arg);
+
 #define rpc_agent_set_code(agent, code) \
     (agent)->ra_hdr.rh_code = code
 
-#define rpc_agent_set_bodylen(agent, bodylen) \
-    (agent)->ra_hdr.rh_bodylen = bodylen
+int rpc_agent_set_bodylen(struct rpc_agent *agent, size_t bodylen);
 
 #define rpc_agent_get_bodylen(agent) \
     ((agent)->ra_hdr.rh_bodylen)
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_admit.h"
+
+/* weight of a new latency sample in the moving average: 1/2^SHIFT */
+#define RPC_ADMIT_EWMA_SHIFT    3
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+struct rpc_admit *
+rpc_admit_create(const struct rpc_admit_params *params)
+{
+    struct rpc_admit *admit = NULL;
+
+    RHO_TRACE_ENTER();
+
+    admit = rhoL_zalloc(sizeof(*admit));
+    admit->ad_params = *params;
+    if (admit->ad_params.ap_rate > 0 && admit->ad_params.ap_burst == 0)
+        admit->ad_params.ap_burst = 1;
+
+    RHO_TRACE_EXIT();
+    return (admit);
+}
+
+void
+rpc_admit_destroy(struct rpc_admit *admit)
+{
+    RHO_TRACE_ENTER();
+
+    rhoL_free(admit);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * OVERLOAD
+ *********************************************************/
+bool
+rpc_admit_overloaded(const struct rpc_admit *admit)
+{
+    const struct rpc_admit_params *p = &admit->ad_params;
+
+    if (p->ap_max_queue > 0 && admit->ad_queue >= p->ap_max_queue)
+        return (true);
+
+    if (p->ap_max_latency_us > 0 &&
+            admit->ad_latency_ns > (uint64_t)p->ap_max_latency_us * 1000)
+        return (true);
+
+    return (false);
+}
+
+/*********************************************************
+ * CONNECTIONS
+ *********************************************************/
+/*
+ * Returns true if a new connection should be accepted; if so, the caller
+ * must call rpc_admit_conn_closed once it is closed.
+ */
+bool
+rpc_admit_conn(struct rpc_admit *admit)
+{
+    const struct rpc_admit_params *p = &admit->ad_params;
+
+    if ((p->ap_max_conns > 0 && admit->ad_nconns >= p->ap_max_conns) ||
+            rpc_admit_overloaded(admit)) {
+        admit->ad_nrefused_conns++;
+        return (false);
+    }
+
+    admit->ad_nconns++;
+    return (true);
+}
+
+void
+rpc_admit_conn_closed(struct rpc_admit *admit)
+{
+    RHO_ASSERT(admit->ad_nconns > 0);
+
+    admit->ad_nconns--;
+}
+
+/*********************************************************
+ * REQUESTS
+ *********************************************************/
+void
+rpc_admit_bucket_init(const struct rpc_admit *admit,
+        struct rpc_admit_bucket *bucket)
+{
+    bucket->tb_tokens = admit->ad_params.ap_burst;
+    bucket->tb_last_ns = rpc_now_ns();
+}
+
+static bool
+rpc_admit_take_token(const struct rpc_admit *admit,
+        struct rpc_admit_bucket *bucket, uint64_t now)
+{
+    const struct rpc_admit_params *p = &admit->ad_params;
+
+    bucket->tb_tokens += (double)(now - bucket->tb_last_ns) * p->ap_rate / 1e9;
+    if (bucket->tb_tokens > p->ap_burst)
+        bucket->tb_tokens = p->ap_burst;
+    bucket->tb_last_ns = now;
+
+    if (bucket->tb_tokens < 1.0)
+        return (false);
+
+    bucket->tb_tokens -= 1.0;
+    return (true);
+}
+
+/*
+ * Decide whether to run a request that has just become dispatchable on a
+ * connection with the given bucket (which may be NULL if rate limiting is
+ * not used).  Returns 0 if the request is admitted, in which case the
+ * caller must call rpc_admit_done once its response has been sent (or
+ * rpc_admit_dropped if the connection is closed first); otherwise,
+ * returns the status (EBUSY or EAGAIN) to answer it with.
+ */
+int
+rpc_admit_request(struct rpc_admit *admit, struct rpc_admit_bucket *bucket)
+{
+    const struct rpc_admit_params *p = &admit->ad_params;
+    uint64_t now = rpc_now_ns();
+
+    if (rpc_admit_overloaded(admit)) {
+        /*
+         * a full queue is refused outright; high latency lets through a
+         * probe now and then, as it is only updated by requests that run
+         */
+        if ((p->ap_max_queue > 0 && admit->ad_queue >= p->ap_max_queue) ||
+                now - admit->ad_last_admit_ns <
+                (uint64_t)p->ap_max_latency_us * 1000) {
+            admit->ad_nbusy++;
+            return (EBUSY);
+        }
+    }
+
+    if (p->ap_rate > 0 && bucket != NULL &&
+            !rpc_admit_take_token(admit, bucket, now)) {
+        admit->ad_nlimited++;
+        return (EAGAIN);
+    }
+
+    admit->ad_queue++;
+    admit->ad_last_admit_ns = now;
+    return (0);
+}
+
+/*
+ * The response to the admitted request in agent has been sent: take it off
+ * the queue, and fold its latency into the average.
+ */
+void
+rpc_admit_done(struct rpc_admit *admit, const struct rpc_agent *agent)
+{
+    uint64_t now = rpc_now_ns();
+    uint64_t lat = 0;
+
+    RHO_ASSERT(admit->ad_queue > 0);
+
+    admit->ad_queue--;
+
+    lat = now > agent->ra_recv_ns ? now - agent->ra_recv_ns : 0;
+    if (admit->ad_latency_ns == 0) {
+        admit->ad_latency_ns = lat;
+    } else if (lat > admit->ad_latency_ns) {
+        admit->ad_latency_ns +=
+            (lat - admit->ad_latency_ns) >> RPC_ADMIT_EWMA_SHIFT;
+    } else {
+        admit->ad_latency_ns -=
+            (admit->ad_latency_ns - lat) >> RPC_ADMIT_EWMA_SHIFT;
+    }
+}
+
+/* the admitted request's connection was closed before it was answered */
+void
+rpc_admit_dropped(struct rpc_admit *admit)
+{
+    RHO_ASSERT(admit->ad_queue > 0);
+
+    admit->ad_queue--;
+}
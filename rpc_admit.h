@@ -0,0 +1,83 @@
+#ifndef _RPC_ADMIT_H_
+#define _RPC_ADMIT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+#include "rpc.h"
+
+RHO_DECLS_BEGIN
+
+/*
+ * ADMISSION CONTROL
+ *
+ * A server keeps one rpc_admit, and asks it before taking on work: whether
+ * to accept a new connection (rpc_admit_conn), and whether to run a
+ * request that has just become dispatchable (rpc_admit_request).  A refused
+ * connection should be closed at once; a refused request answered at once
+ * with the returned status, without running its handler.
+ *
+ * The server is overloaded when too many admitted requests are still
+ * unanswered (the queue depth), or when the recent latency of requests,
+ * from the start of their header until rpc_admit_done, is above a limit.
+ * A request counts as unanswered until its response has been fully sent,
+ * so an event-loop server's queue includes responses still waiting on
+ * their sockets, not just requests in its handlers.
+ * While overloaded, new connections are refused, and new requests are
+ * answered EBUSY -- except that one request per latency limit is let
+ * through, so that the latency is sampled and the overload can end.
+ *
+ * Independently, each connection may have a token bucket: a request that
+ * finds the connection's bucket empty is answered EAGAIN.
+ *
+ * A limit of 0 disables that check.
+ */
+struct rpc_admit_params {
+    uint32_t    ap_max_conns;       /* open connections */
+    uint32_t    ap_max_queue;       /* admitted, unanswered requests */
+    uint32_t    ap_max_latency_us;  /* mean recent request latency */
+    uint32_t    ap_rate;            /* per-connection requests/second */
+    uint32_t    ap_burst;           /* per-connection bucket size */
+};
+
+struct rpc_admit {
+    struct rpc_admit_params ad_params;
+
+    uint32_t    ad_nconns;
+    uint32_t    ad_queue;
+    uint64_t    ad_latency_ns;      /* EWMA of request latency */
+    uint64_t    ad_last_admit_ns;
+
+    /* what was refused, and why */
+    uint64_t    ad_nrefused_conns;
+    uint64_t    ad_nbusy;
+    uint64_t    ad_nlimited;
+};
+
+/* per-connection token bucket */
+struct rpc_admit_bucket {
+    double      tb_tokens;
+    uint64_t    tb_last_ns;
+};
+
+struct rpc_admit * rpc_admit_create(const struct rpc_admit_params *params);
+void rpc_admit_destroy(struct rpc_admit *admit);
+
+bool rpc_admit_overloaded(const struct rpc_admit *admit);
+
+bool rpc_admit_conn(struct rpc_admit *admit);
+void rpc_admit_conn_closed(struct rpc_admit *admit);
+
+void rpc_admit_bucket_init(const struct rpc_admit *admit,
+        struct rpc_admit_bucket *bucket);
+
+int rpc_admit_request(struct rpc_admit *admit,
+        struct rpc_admit_bucket *bucket);
+void rpc_admit_done(struct rpc_admit *admit, const struct rpc_agent *agent);
+void rpc_admit_dropped(struct rpc_admit *admit);
+
+RHO_DECLS_END
+
+#endif /* _RPC_ADMIT_H_ */
@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc_aead.h"
+
+#define RPC_AEAD_NONCE_LENGTH   12
+
+/* HKDF info strings for the keys derived from a PSK */
+#define RPC_AEAD_INITIATOR_INFO "librpc-aead initiator"
+#define RPC_AEAD_RESPONDER_INFO "librpc-aead responder"
+
+struct rpc_aead_dir {
+    EVP_CIPHER_CTX  *ad_ctx;
+    bool            ad_keyed;   /* false until a PSK's salts are in */
+    uint32_t        ad_id;      /* nonce: the direction ... */
+    uint64_t        ad_seq;     /* ... and the message count */
+};
+
+struct rpc_aead {
+    int                 ae_cipher;
+    size_t              ae_keylen;
+    bool                ae_initiator;
+    struct rpc_aead_dir ae_out;     /* messages we seal */
+    struct rpc_aead_dir ae_in;      /* messages we open */
+
+    /* with a PSK, until the peer's salt is in: the initiator's salt first */
+    uint8_t             ae_psk[RPC_AEAD_MAX_KEYLEN];
+    uint8_t             ae_salts[2 * RPC_AEAD_SALT_LENGTH];
+};
+
+static const struct {
+    int         cipher;
+    const char  *name;
+    size_t      keylen;
+} rpc_aead_ciphers[] = {
+    { RPC_AEAD_AES_128_GCM,         "aes-128-gcm",          16 },
+    { RPC_AEAD_AES_256_GCM,         "aes-256-gcm",          32 },
+    { RPC_AEAD_CHACHA20_POLY1305,   "chacha20-poly1305",    32 },
+};
+
+#define RPC_AEAD_NCIPHERS \
+    (sizeof(rpc_aead_ciphers) / sizeof(rpc_aead_ciphers[0]))
+
+/*********************************************************
+ * CIPHERS
+ *********************************************************/
+size_t
+rpc_aead_keylen(int cipher)
+{
+    size_t i = 0;
+
+    for (i = 0; i < RPC_AEAD_NCIPHERS; i++) {
+        if (rpc_aead_ciphers[i].cipher == cipher)
+            return (rpc_aead_ciphers[i].keylen);
+    }
+
+    return (0);
+}
+
+int
+rpc_aead_cipher_from_str(const char *s)
+{
+    size_t i = 0;
+
+    for (i = 0; i < RPC_AEAD_NCIPHERS; i++) {
+        if (strcasecmp(rpc_aead_ciphers[i].name, s) == 0)
+            return (rpc_aead_ciphers[i].cipher);
+    }
+
+    return (-1);
+}
+
+const char *
+rpc_aead_cipher_to_str(int cipher)
+{
+    size_t i = 0;
+
+    for (i = 0; i < RPC_AEAD_NCIPHERS; i++) {
+        if (rpc_aead_ciphers[i].cipher == cipher)
+            return (rpc_aead_ciphers[i].name);
+    }
+
+    return ("unknown");
+}
+
+static const EVP_CIPHER *
+rpc_aead_evp_cipher(int cipher)
+{
+    switch (cipher) {
+    case RPC_AEAD_AES_128_GCM:
+        return (EVP_aes_128_gcm());
+    case RPC_AEAD_AES_256_GCM:
+        return (EVP_aes_256_gcm());
+    case RPC_AEAD_CHACHA20_POLY1305:
+        return (EVP_chacha20_poly1305());
+    default:
+        return (NULL);
+    }
+}
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+static int
+rpc_aead_dir_init(struct rpc_aead_dir *dir, const EVP_CIPHER *evp,
+        const uint8_t *key, bool encrypt, uint32_t id)
+{
+    int ok = 0;
+
+    dir->ad_ctx = EVP_CIPHER_CTX_new();
+    if (dir->ad_ctx == NULL)
+        return (ENOMEM);
+
+    /*
+     * the key is set once (or, for a PSK, once it has been derived); each
+     * message only sets the nonce
+     */
+    if (encrypt)
+        ok = EVP_EncryptInit_ex(dir->ad_ctx, evp, NULL, key, NULL);
+    else
+        ok = EVP_DecryptInit_ex(dir->ad_ctx, evp, NULL, key, NULL);
+    if (ok != 1)
+        return (EINVAL);
+
+    dir->ad_keyed = key != NULL;
+    dir->ad_id = id;
+    dir->ad_seq = 0;
+    return (0);
+}
+
+/* set dir's key: the one derived (HKDF-SHA256) from psk, salt, and info */
+static int
+rpc_aead_dir_derive(struct rpc_aead_dir *dir, bool encrypt,
+        const uint8_t *psk, size_t keylen, const uint8_t *salt,
+        size_t saltlen, const char *info)
+{
+    uint8_t key[RPC_AEAD_MAX_KEYLEN];
+    size_t outlen = keylen;
+    EVP_PKEY_CTX *pctx = NULL;
+    int ok = 0;
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (pctx == NULL)
+        return (ENOMEM);
+
+    ok = EVP_PKEY_derive_init(pctx) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, (int)saltlen) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, psk, (int)keylen) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, (const uint8_t *)info,
+                (int)strlen(info)) == 1 &&
+        EVP_PKEY_derive(pctx, key, &outlen) == 1 && outlen == keylen;
+    EVP_PKEY_CTX_free(pctx);
+
+    if (ok) {
+        if (encrypt)
+            ok = EVP_EncryptInit_ex(dir->ad_ctx, NULL, NULL, key, NULL);
+        else
+            ok = EVP_DecryptInit_ex(dir->ad_ctx, NULL, NULL, key, NULL);
+    }
+    rho_memzero(key, sizeof(key));
+    if (ok != 1)
+        return (EIO);
+
+    dir->ad_keyed = true;
+    return (0);
+}
+
+/* key (or, for a PSK, NULL) is used in both directions */
+static struct rpc_aead *
+rpc_aead_alloc(int cipher, const uint8_t *key, size_t keylen,
+        bool initiator)
+{
+    struct rpc_aead *aead = NULL;
+    const EVP_CIPHER *evp = NULL;
+    int error = 0;
+
+    evp = rpc_aead_evp_cipher(cipher);
+    if (evp == NULL || keylen != rpc_aead_keylen(cipher)) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    aead = rhoL_zalloc(sizeof(*aead));
+    aead->ae_cipher = cipher;
+    aead->ae_keylen = keylen;
+    aead->ae_initiator = initiator;
+    error = rpc_aead_dir_init(&aead->ae_out, evp, key, true,
+            initiator ? 0 : 1);
+    if (error == 0)
+        error = rpc_aead_dir_init(&aead->ae_in, evp, key, false,
+                initiator ? 1 : 0);
+    if (error != 0) {
+        rpc_aead_destroy(aead);
+        errno = error;
+        return (NULL);
+    }
+
+    return (aead);
+}
+
+struct rpc_aead *
+rpc_aead_create(int cipher, const uint8_t *key, size_t keylen,
+        bool initiator)
+{
+    struct rpc_aead *aead = NULL;
+
+    RHO_TRACE_ENTER();
+
+    RHO_ASSERT(key != NULL);
+    aead = rpc_aead_alloc(cipher, key, keylen, initiator);
+
+    RHO_TRACE_EXIT();
+    return (aead);
+}
+
+struct rpc_aead *
+rpc_aead_create_psk(int cipher, const uint8_t *psk, size_t keylen,
+        bool initiator)
+{
+    struct rpc_aead *aead = NULL;
+    uint8_t *salt = NULL;
+    int error = 0;
+
+    RHO_TRACE_ENTER();
+
+    aead = rpc_aead_alloc(cipher, NULL, keylen, initiator);
+    if (aead == NULL)
+        goto done;
+
+    memcpy(aead->ae_psk, psk, keylen);
+    salt = aead->ae_salts + (initiator ? 0 : RPC_AEAD_SALT_LENGTH);
+    if (RAND_bytes(salt, RPC_AEAD_SALT_LENGTH) != 1) {
+        rho_warn("RAND_bytes failed");
+        error = EIO;
+        goto done;
+    }
+
+done:
+    if (error != 0) {
+        rpc_aead_destroy(aead);
+        aead = NULL;
+        errno = error;
+    }
+    RHO_TRACE_EXIT();
+    return (aead);
+}
+
+void
+rpc_aead_destroy(struct rpc_aead *aead)
+{
+    RHO_TRACE_ENTER();
+
+    /* frees the expanded keys too */
+    EVP_CIPHER_CTX_free(aead->ae_out.ad_ctx);
+    EVP_CIPHER_CTX_free(aead->ae_in.ad_ctx);
+    rho_memzero(aead->ae_psk, sizeof(aead->ae_psk));
+    rhoL_free(aead);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * PRE-SHARED KEYS
+ *********************************************************/
+const uint8_t *
+rpc_aead_salt(const struct rpc_aead *aead)
+{
+    return (aead->ae_salts + (aead->ae_initiator ? 0 : RPC_AEAD_SALT_LENGTH));
+}
+
+/*
+ * Derive both directions' keys, each from the PSK and both salts (the
+ * initiator's first); the PSK is not needed after that, and is wiped.
+ */
+int
+rpc_aead_set_peer_salt(struct rpc_aead *aead, const uint8_t *salt)
+{
+    struct rpc_aead_dir *idir = NULL;
+    struct rpc_aead_dir *rdir = NULL;
+    int error = 0;
+
+    RHO_TRACE_ENTER();
+
+    memcpy(aead->ae_salts + (aead->ae_initiator ? RPC_AEAD_SALT_LENGTH : 0),
+            salt, RPC_AEAD_SALT_LENGTH);
+
+    /* the directions in which the initiator and the responder seal */
+    idir = aead->ae_initiator ? &aead->ae_out : &aead->ae_in;
+    rdir = aead->ae_initiator ? &aead->ae_in : &aead->ae_out;
+
+    error = rpc_aead_dir_derive(idir, aead->ae_initiator, aead->ae_psk,
+            aead->ae_keylen, aead->ae_salts, sizeof(aead->ae_salts),
+            RPC_AEAD_INITIATOR_INFO);
+    if (error == 0)
+        error = rpc_aead_dir_derive(rdir, !aead->ae_initiator, aead->ae_psk,
+                aead->ae_keylen, aead->ae_salts, sizeof(aead->ae_salts),
+                RPC_AEAD_RESPONDER_INFO);
+    rho_memzero(aead->ae_psk, sizeof(aead->ae_psk));
+
+    RHO_TRACE_EXIT();
+    return (error);
+}
+
+/*********************************************************
+ * SEALING AND OPENING
+ *********************************************************/
+/* set dir's nonce for its next message, and add the associated data */
+static int
+rpc_aead_begin(struct rpc_aead_dir *dir, bool encrypt, const uint8_t *aad,
+        size_t aadlen)
+{
+    uint8_t nonce[RPC_AEAD_NONCE_LENGTH];
+    int outl = 0;
+    int ok = 0;
+    int i = 0;
+
+    /* a PSK responder has nothing to seal with before the first message */
+    if (!dir->ad_keyed)
+        return (EPROTO);
+
+    for (i = 0; i < 4; i++)
+        nonce[i] = (uint8_t)(dir->ad_id >> (24 - 8 * i));
+    for (i = 0; i < 8; i++)
+        nonce[4 + i] = (uint8_t)(dir->ad_seq >> (56 - 8 * i));
+    dir->ad_seq++;
+
+    if (encrypt) {
+        ok = EVP_EncryptInit_ex(dir->ad_ctx, NULL, NULL, NULL, nonce);
+        if (ok == 1 && aadlen > 0)
+            ok = EVP_EncryptUpdate(dir->ad_ctx, NULL, &outl, aad,
+                    (int)aadlen);
+    } else {
+        ok = EVP_DecryptInit_ex(dir->ad_ctx, NULL, NULL, NULL, nonce);
+        if (ok == 1 && aadlen > 0)
+            ok = EVP_DecryptUpdate(dir->ad_ctx, NULL, &outl, aad,
+                    (int)aadlen);
+    }
+
+    return (ok == 1 ? 0 : EIO);
+}
+
+/* en- or decrypt len bytes at p in place (both are stream ciphers) */
+static int
+rpc_aead_update(struct rpc_aead_dir *dir, bool encrypt, uint8_t *p,
+        size_t len)
+{
+    int n = 0;
+    int outl = 0;
+    int ok = 1;
+
+    while (ok == 1 && len > 0) {
+        n = len > INT_MAX ? INT_MAX : (int)len;
+        if (encrypt)
+            ok = EVP_EncryptUpdate(dir->ad_ctx, p, &outl, p, n);
+        else
+            ok = EVP_DecryptUpdate(dir->ad_ctx, p, &outl, p, n);
+        p += n;
+        len -= n;
+    }
+
+    return (ok == 1 ? 0 : EIO);
+}
+
+int
+rpc_aead_seal_begin(struct rpc_aead *aead, const uint8_t *aad,
+        size_t aadlen)
+{
+    return (rpc_aead_begin(&aead->ae_out, true, aad, aadlen));
+}
+
+int
+rpc_aead_seal_update(struct rpc_aead *aead, uint8_t *p, size_t len)
+{
+    return (rpc_aead_update(&aead->ae_out, true, p, len));
+}
+
+int
+rpc_aead_seal_final(struct rpc_aead *aead, uint8_t *tag)
+{
+    EVP_CIPHER_CTX *ctx = aead->ae_out.ad_ctx;
+    uint8_t dummy[16];
+    int outl = 0;
+
+    if (EVP_EncryptFinal_ex(ctx, dummy, &outl) != 1)
+        return (EIO);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, RPC_AEAD_TAG_LENGTH,
+                tag) != 1)
+        return (EIO);
+
+    return (0);
+}
+
+int
+rpc_aead_open_begin(struct rpc_aead *aead, const uint8_t *aad,
+        size_t aadlen)
+{
+    return (rpc_aead_begin(&aead->ae_in, false, aad, aadlen));
+}
+
+int
+rpc_aead_open_update(struct rpc_aead *aead, uint8_t *p, size_t len)
+{
+    return (rpc_aead_update(&aead->ae_in, false, p, len));
+}
+
+int
+rpc_aead_open_final(struct rpc_aead *aead, const uint8_t *tag)
+{
+    EVP_CIPHER_CTX *ctx = aead->ae_in.ad_ctx;
+    uint8_t dummy[16];
+    int outl = 0;
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, RPC_AEAD_TAG_LENGTH,
+                (void *)tag) != 1)
+        return (EIO);
+    if (EVP_DecryptFinal_ex(ctx, dummy, &outl) != 1)
+        return (EBADMSG);
+
+    return (0);
+}
@@ -0,0 +1,87 @@
+#ifndef _RPC_AEAD_H_
+#define _RPC_AEAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * AEAD RECORD MODE
+ *
+ * A cheaper secure channel than TLS for a connection's messages: once the
+ * two ends share a key (exported from a TLS handshake, or pre-shared), each
+ * message is sealed on its own, in place, with an AEAD cipher.  The header
+ * is authenticated (as associated data), and the body is encrypted and
+ * followed by a RPC_AEAD_TAG_LENGTH-byte tag (see RPC_HDR_F_AEAD).
+ *
+ * The 96-bit nonce is never sent: it is a 32-bit direction (which end
+ * sealed the message) and a 64-bit count of the messages sealed in that
+ * direction, which both ends keep in step, as messages are never lost or
+ * reordered.  A message that is replayed, dropped, or reordered thus fails
+ * to open, like one that has been tampered with.
+ *
+ * The two ends of a connection must pass different values of initiator
+ * (by convention, the client passes true).
+ *
+ * As the count restarts with every connection, a key must not be used for
+ * more than one, so a pre-shared key (rpc_aead_create_psk) is only used to
+ * derive each connection's keys: each end picks a random
+ * RPC_AEAD_SALT_LENGTH-byte salt, and sends it, in the clear, to the
+ * other.  Both directions' keys are derived (HKDF-SHA256) from the PSK and
+ * both salts, so neither end can seal or open anything until it has the
+ * peer's salt (rpc_aead_set_peer_salt); as each end's salt is fresh, a
+ * message recorded on one connection does not open on another.
+ */
+#define RPC_AEAD_AES_128_GCM            1
+#define RPC_AEAD_AES_256_GCM            2
+#define RPC_AEAD_CHACHA20_POLY1305      3
+
+#define RPC_AEAD_TAG_LENGTH     16
+#define RPC_AEAD_MAX_KEYLEN     32
+#define RPC_AEAD_SALT_LENGTH    16
+
+struct rpc_aead;
+
+/* returns NULL, with errno set to EINVAL, for a bad cipher or keylen */
+struct rpc_aead * rpc_aead_create(int cipher, const uint8_t *key,
+        size_t keylen, bool initiator);
+/* as rpc_aead_create; or errno EIO if no random salt can be had */
+struct rpc_aead * rpc_aead_create_psk(int cipher, const uint8_t *psk,
+        size_t keylen, bool initiator);
+void rpc_aead_destroy(struct rpc_aead *aead);
+
+/* for a PSK: our salt, and the peer's (returns 0, or an errno value) */
+const uint8_t * rpc_aead_salt(const struct rpc_aead *aead);
+int rpc_aead_set_peer_salt(struct rpc_aead *aead, const uint8_t *salt);
+
+/* the key length for cipher, or 0 if it's unknown */
+size_t rpc_aead_keylen(int cipher);
+
+/* "aes-128-gcm", "aes-256-gcm", "chacha20-poly1305"; -1 if unknown */
+int rpc_aead_cipher_from_str(const char *s);
+const char * rpc_aead_cipher_to_str(int cipher);
+
+/*
+ * Sealing a message: begin (with the associated data), update over the
+ * body (which is encrypted in place, and may be passed in pieces), and
+ * final, which writes the tag.  Opening one mirrors it; open_final returns
+ * EBADMSG if the message is not authentic.  Each returns 0, or an errno
+ * value.
+ */
+int rpc_aead_seal_begin(struct rpc_aead *aead, const uint8_t *aad,
+        size_t aadlen);
+int rpc_aead_seal_update(struct rpc_aead *aead, uint8_t *p, size_t len);
+int rpc_aead_seal_final(struct rpc_aead *aead, uint8_t *tag);
+
+int rpc_aead_open_begin(struct rpc_aead *aead, const uint8_t *aad,
+        size_t aadlen);
+int rpc_aead_open_update(struct rpc_aead *aead, uint8_t *p, size_t len);
+int rpc_aead_open_final(struct rpc_aead *aead, const uint8_t *tag);
+
+RHO_DECLS_END
+
+#endif /* _RPC_AEAD_H_ */
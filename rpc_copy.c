@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <rho/rho_log.h>
+
+#include "rpc_copy.h"
+
+/* if sysconf doesn't know the L2 cache's size */
+#define RPC_COPY_DEFAULT_THRESHOLD  (1024 * 1024)
+
+typedef void (*rpc_copy_fn)(void *dst, const void *src, size_t len);
+
+static pthread_once_t rpc_copy_once = PTHREAD_ONCE_INIT;
+static rpc_copy_fn rpc_copy_stream = NULL;  /* NULL: memcpy only */
+static const char *rpc_copy_name = "memcpy";
+static size_t rpc_copy_l2 = RPC_COPY_DEFAULT_THRESHOLD;
+static size_t rpc_copy_min = 0;             /* 0: rpc_copy_l2 */
+
+/*********************************************************
+ * STREAMING COPIES
+ *********************************************************/
+#if defined(__x86_64__)
+/*
+ * Each copies the bytes up to the first 64-byte boundary of dst with
+ * memcpy, the whole cache lines that follow with aligned streaming stores,
+ * and the remainder with memcpy.  len is large, so the ends don't matter.
+ * Streaming stores are weakly ordered: the sfence makes them visible before
+ * any later store (such as one that publishes the copy to another thread).
+ */
+static size_t
+rpc_copy_head(void *dst, const void *src, size_t len)
+{
+    size_t head = (64 - ((uintptr_t)dst & 63)) & 63;
+
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    return (head);
+}
+
+static void
+rpc_copy_sse2(void *dst, const void *src, size_t len)
+{
+    size_t off = rpc_copy_head(dst, src, len);
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    __m128i a, b, c, e;
+
+    for (; off + 64 <= len; off += 64) {
+        a = _mm_loadu_si128((const __m128i *)(s + off));
+        b = _mm_loadu_si128((const __m128i *)(s + off + 16));
+        c = _mm_loadu_si128((const __m128i *)(s + off + 32));
+        e = _mm_loadu_si128((const __m128i *)(s + off + 48));
+        _mm_stream_si128((__m128i *)(d + off), a);
+        _mm_stream_si128((__m128i *)(d + off + 16), b);
+        _mm_stream_si128((__m128i *)(d + off + 32), c);
+        _mm_stream_si128((__m128i *)(d + off + 48), e);
+    }
+    _mm_sfence();
+    memcpy(d + off, s + off, len - off);
+}
+
+__attribute__((target("avx2")))
+static void
+rpc_copy_avx2(void *dst, const void *src, size_t len)
+{
+    size_t off = rpc_copy_head(dst, src, len);
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    __m256i a, b;
+
+    for (; off + 64 <= len; off += 64) {
+        a = _mm256_loadu_si256((const __m256i *)(s + off));
+        b = _mm256_loadu_si256((const __m256i *)(s + off + 32));
+        _mm256_stream_si256((__m256i *)(d + off), a);
+        _mm256_stream_si256((__m256i *)(d + off + 32), b);
+    }
+    _mm_sfence();
+    memcpy(d + off, s + off, len - off);
+}
+
+__attribute__((target("avx512f")))
+static void
+rpc_copy_avx512(void *dst, const void *src, size_t len)
+{
+    size_t off = rpc_copy_head(dst, src, len);
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    __m512i a;
+
+    for (; off + 64 <= len; off += 64) {
+        a = _mm512_loadu_si512((const void *)(s + off));
+        _mm512_stream_si512((void *)(d + off), a);
+    }
+    _mm_sfence();
+    memcpy(d + off, s + off, len - off);
+}
+#endif /* __x86_64__ */
+
+/*********************************************************
+ * SELECTION
+ *********************************************************/
+static void
+rpc_copy_init(void)
+{
+    long l2 = 0;
+
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (l2 > 0)
+        rpc_copy_l2 = (size_t)l2;
+
+#if defined(__x86_64__)
+    /* not AVX-512, unless asked for: see rpc_copy.h */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        rpc_copy_stream = rpc_copy_avx2;
+        rpc_copy_name = "avx2-nt";
+    } else {
+        rpc_copy_stream = rpc_copy_sse2;
+        rpc_copy_name = "sse2-nt";
+    }
+#endif
+
+    rho_debug("bulk copies above %zu bytes use %s",
+            rpc_copy_min > 0 ? rpc_copy_min : rpc_copy_l2, rpc_copy_name);
+}
+
+void *
+rpc_copy(void *dst, const void *src, size_t len)
+{
+    (void)pthread_once(&rpc_copy_once, rpc_copy_init);
+
+    if (rpc_copy_stream == NULL || len < rpc_copy_threshold())
+        return (memcpy(dst, src, len));
+
+    rpc_copy_stream(dst, src, len);
+    return (dst);
+}
+
+size_t
+rpc_copy_threshold(void)
+{
+    (void)pthread_once(&rpc_copy_once, rpc_copy_init);
+
+    return (rpc_copy_min > 0 ? rpc_copy_min : rpc_copy_l2);
+}
+
+void
+rpc_copy_set_threshold(size_t threshold)
+{
+    rpc_copy_min = threshold;
+}
+
+const char *
+rpc_copy_method(void)
+{
+    (void)pthread_once(&rpc_copy_once, rpc_copy_init);
+
+    return (rpc_copy_name);
+}
+
+/*
+ * Use the routine that rpc_copy_method would name method: "memcpy", or, on
+ * x86-64, "sse2-nt", "avx2-nt", or "avx512-nt".  Returns 0, or -1 with
+ * errno set to EINVAL for an unknown method, or ENOTSUP if the CPU lacks
+ * the instructions.
+ */
+int
+rpc_copy_set_method(const char *method)
+{
+    rpc_copy_fn fn = NULL;
+    const char *name = "memcpy";
+    bool ok = true;
+
+    (void)pthread_once(&rpc_copy_once, rpc_copy_init);
+
+    if (strcmp(method, "memcpy") == 0) {
+        fn = NULL;
+#if defined(__x86_64__)
+    } else if (strcmp(method, "sse2-nt") == 0) {
+        fn = rpc_copy_sse2;
+        name = "sse2-nt";
+    } else if (strcmp(method, "avx2-nt") == 0) {
+        fn = rpc_copy_avx2;
+        name = "avx2-nt";
+        ok = __builtin_cpu_supports("avx2");
+    } else if (strcmp(method, "avx512-nt") == 0) {
+        fn = rpc_copy_avx512;
+        name = "avx512-nt";
+        ok = __builtin_cpu_supports("avx512f");
+#endif
+    } else {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    if (!ok) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+
+    rpc_copy_stream = fn;
+    rpc_copy_name = name;
+    return (0);
+}
@@ -0,0 +1,44 @@
+#ifndef _RPC_COPY_H_
+#define _RPC_COPY_H_
+
+#include <stddef.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * BULK COPIES
+ *
+ * rpc_copy is memcpy for large bodies that won't be read again soon -- for
+ * instance, an uploaded payload copied out of the body buffer into the
+ * application's storage.  Copies larger than the threshold (by default,
+ * the L2 cache's size) are made with non-temporal stores, which go around
+ * the cache, so that a multi-MiB body doesn't evict the working set of the
+ * loop that copies it.  Smaller copies, and all copies on CPUs without such
+ * stores, are plain memcpy.
+ *
+ * The routine is chosen once, from the CPU's features: AVX2, else SSE2
+ * streaming stores (x86-64 only).  AVX-512 is used only if asked for with
+ * rpc_copy_set_method ("avx512-nt"), as on some CPUs its stores lower the
+ * core's clock for a while, which can cost the code around the copy more
+ * than the wider stores save; memcpy_bench shows which is faster on a
+ * given machine.  rpc_copy_method names the routine, for benchmarks.
+ *
+ * The library itself uses rpc_copy where the copy's destination is read by
+ * someone else: a body written into a memfd attachment, and data sent over
+ * a rpc_mempipe.
+ */
+void * rpc_copy(void *dst, const void *src, size_t len);
+
+size_t rpc_copy_threshold(void);
+/* 0 restores the default; call before the agents' threads start */
+void rpc_copy_set_threshold(size_t threshold);
+
+const char * rpc_copy_method(void);
+/* as rpc_copy_set_threshold; -1 with errno EINVAL or ENOTSUP on failure */
+int rpc_copy_set_method(const char *method);
+
+RHO_DECLS_END
+
+#endif /* _RPC_COPY_H_ */
@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "rpc_crc32c.h"
+
+/* the Castagnoli polynomial, bit-reversed */
+#define RPC_CRC32C_POLY     0x82f63b78U
+
+typedef uint32_t (*rpc_crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static pthread_once_t rpc_crc32c_once = PTHREAD_ONCE_INIT;
+static rpc_crc32c_fn rpc_crc32c_impl = NULL;
+static const char *rpc_crc32c_name = "table";
+static uint32_t rpc_crc32c_table[256];
+
+/*********************************************************
+ * IMPLEMENTATIONS
+ *
+ * Each takes and returns the CRC register, not the (inverted) CRC.
+ *********************************************************/
+static uint32_t
+rpc_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len-- > 0)
+        crc = rpc_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return (crc);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+rpc_crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    uint64_t v = 0;
+
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    for (; len > 0; len--)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+
+    return ((uint32_t)crc64);
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t
+rpc_crc32c_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v = 0;
+
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+        crc = __crc32cb(crc, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; len > 0; len--)
+        crc = __crc32cb(crc, *p++);
+
+    return (crc);
+}
+#endif
+
+/*********************************************************
+ * SELECTION
+ *********************************************************/
+static void
+rpc_crc32c_init(void)
+{
+    uint32_t i = 0;
+    uint32_t c = 0;
+    int k = 0;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ RPC_CRC32C_POLY : c >> 1;
+        rpc_crc32c_table[i] = c;
+    }
+    rpc_crc32c_impl = rpc_crc32c_sw;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        rpc_crc32c_impl = rpc_crc32c_sse42;
+        rpc_crc32c_name = "sse4.2";
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        rpc_crc32c_impl = rpc_crc32c_armv8;
+        rpc_crc32c_name = "armv8-crc";
+    }
+#endif
+}
+
+uint32_t
+rpc_crc32c(uint32_t crc, const void *p, size_t len)
+{
+    (void)pthread_once(&rpc_crc32c_once, rpc_crc32c_init);
+
+    return (~rpc_crc32c_impl(~crc, p, len));
+}
+
+const char *
+rpc_crc32c_method(void)
+{
+    (void)pthread_once(&rpc_crc32c_once, rpc_crc32c_init);
+
+    return (rpc_crc32c_name);
+}
@@ -0,0 +1,29 @@
+#ifndef _RPC_CRC32C_H_
+#define _RPC_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * CRC32C (Castagnoli), as carried by a RPC_HDR_F_CRC32C trailer.  crc is
+ * the CRC of the bytes before p (0 to start), so a body can be summed in
+ * pieces as it arrives:
+ *
+ *      crc = rpc_crc32c(0, a, alen);
+ *      crc = rpc_crc32c(crc, b, blen);
+ *
+ * The CPU's CRC32C instructions are used where it has them (SSE4.2 on
+ * x86-64, the CRC extension on ARMv8), and a table otherwise.
+ */
+uint32_t rpc_crc32c(uint32_t crc, const void *p, size_t len);
+
+/* "sse4.2", "armv8-crc", or "table" */
+const char * rpc_crc32c_method(void);
+
+RHO_DECLS_END
+
+#endif /* _RPC_CRC32C_H_ */
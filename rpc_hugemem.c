@@ -0,0 +1,206 @@
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rho/rho_log.h>
+
+#include "rpc_hugemem.h"
+
+#define RPC_HUGEMEM_PMD_SIZE_PATH \
+    "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+
+#define RPC_HUGEMEM_THP_ENABLED_PATH \
+    "/sys/kernel/mm/transparent_hugepage/enabled"
+
+/*
+ * Whether madvise(MADV_HUGEPAGE) can get transparent huge pages: the
+ * kernel's THP mode (the bracketed word) is "always" or "madvise".  The
+ * advice itself succeeds even when the mode is "never".
+ */
+static bool
+rpc_hugemem_thp_enabled(void)
+{
+    FILE *fp = NULL;
+    char line[128];
+    bool enabled = false;
+
+    fp = fopen(RPC_HUGEMEM_THP_ENABLED_PATH, "r");
+    if (fp == NULL)
+        return (false);
+
+    if (fgets(line, sizeof(line), fp) != NULL)
+        enabled = strstr(line, "[always]") != NULL ||
+            strstr(line, "[madvise]") != NULL;
+    (void)fclose(fp);
+
+    return (enabled);
+}
+
+/* 0 until rpc_hugemem_page_size has looked it up */
+static size_t rpc_hugemem_pagesize = 0;
+
+size_t
+rpc_hugemem_page_size(void)
+{
+    FILE *fp = NULL;
+    unsigned long long size = 0;
+
+    if (rpc_hugemem_pagesize != 0)
+        return (rpc_hugemem_pagesize);
+
+    fp = fopen(RPC_HUGEMEM_PMD_SIZE_PATH, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%llu", &size) != 1)
+            size = 0;
+        (void)fclose(fp);
+    }
+
+    /* must be a power of two, and bigger than a base page */
+    if (size <= 4096 || (size & (size - 1)) != 0) {
+        rho_debug("can't read %s; assuming %u-byte huge pages",
+                RPC_HUGEMEM_PMD_SIZE_PATH, RPC_HUGEMEM_DEFAULT_PAGE_SIZE);
+        size = RPC_HUGEMEM_DEFAULT_PAGE_SIZE;
+    }
+
+    rpc_hugemem_pagesize = size;
+    return (rpc_hugemem_pagesize);
+}
+
+/* MAP_HUGETLB, asking for pages of the given (power-of-two) size */
+static int
+rpc_hugemem_tlb_flags(size_t pagesize)
+{
+    int flags = MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+    int shift = 0;
+
+    while (((size_t)1 << shift) < pagesize)
+        shift++;
+    flags |= shift << MAP_HUGE_SHIFT;
+#else
+    (void)pagesize;
+#endif
+
+    return (flags);
+}
+
+static size_t
+rpc_hugemem_roundup(size_t len)
+{
+    size_t pagesize = rpc_hugemem_page_size();
+
+    return ((len + pagesize - 1) & ~(pagesize - 1));
+}
+
+/*
+ * Map len bytes (a multiple of the huge page size) of ordinary anonymous
+ * memory at a huge page boundary, by over-mapping and trimming the ends, so
+ * that every huge page's worth of it can be backed by a transparent huge
+ * page.
+ */
+static void *
+rpc_hugemem_map_aligned(size_t len)
+{
+    size_t pagesize = rpc_hugemem_page_size();
+    uint8_t *raw = NULL;
+    uint8_t *p = NULL;
+    size_t head = 0;
+    size_t tail = 0;
+
+    raw = mmap(NULL, len + pagesize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return (NULL);
+
+    p = (uint8_t *)(((uintptr_t)raw + pagesize - 1) &
+            ~(uintptr_t)(pagesize - 1));
+    head = p - raw;
+    tail = pagesize - head;
+    if (head > 0)
+        (void)munmap(raw, head);
+    if (tail > 0)
+        (void)munmap(p + len, tail);
+
+    return (p);
+}
+
+void *
+rpc_hugemem_alloc(size_t len, int *kind)
+{
+    size_t maplen = rpc_hugemem_roundup(len);
+    uint8_t *p = NULL;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t off = 0;
+
+    RHO_TRACE_ENTER("len=%zu", len);
+
+    RHO_ASSERT(len > 0);
+
+    /*
+     * The kernel reserves hugetlb pages when the mapping is made, so a
+     * short pool fails the mmap (ENOMEM) rather than a later touch;
+     * MAP_POPULATE only faults the reserved pages in now.
+     */
+    p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE |
+            rpc_hugemem_tlb_flags(rpc_hugemem_page_size()), -1, 0);
+    if (p != MAP_FAILED) {
+        *kind = RPC_HUGEMEM_TLB;
+        goto done;
+    }
+    rho_debug("no explicit huge pages for %zu bytes (errno=%d)", maplen,
+            errno);
+
+    p = rpc_hugemem_map_aligned(maplen);
+    if (p == NULL)
+        goto done;
+
+    if (madvise(p, maplen, MADV_HUGEPAGE) != 0) {
+        rho_debug("madvise(MADV_HUGEPAGE) failed (errno=%d)", errno);
+        *kind = RPC_HUGEMEM_NONE;
+    } else if (!rpc_hugemem_thp_enabled()) {
+        rho_debug("transparent huge pages are off (%s)",
+                RPC_HUGEMEM_THP_ENABLED_PATH);
+        *kind = RPC_HUGEMEM_NONE;
+    } else {
+        *kind = RPC_HUGEMEM_THP;
+    }
+
+    /* fault it in now: one fault per huge page, if the THP advice took */
+    if (pagesize <= 0)
+        pagesize = 4096;
+    for (off = 0; off < maplen; off += pagesize)
+        ((volatile uint8_t *)p)[off] = 0;
+
+done:
+    RHO_TRACE_EXIT("kind=%d", p != NULL ? *kind : -1);
+    return (p);
+}
+
+void
+rpc_hugemem_free(void *p, size_t len)
+{
+    if (p == NULL)
+        return;
+
+    (void)munmap(p, rpc_hugemem_roundup(len));
+}
+
+const char *
+rpc_hugemem_kind_to_str(int kind)
+{
+    switch (kind) {
+    case RPC_HUGEMEM_TLB:
+        return ("explicit huge pages");
+    case RPC_HUGEMEM_THP:
+        return ("transparent huge pages");
+    default:
+        return ("ordinary pages");
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef _RPC_HUGEMEM_H_
+#define _RPC_HUGEMEM_H_
+
+#include <stddef.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * HUGE-PAGE MEMORY
+ *
+ * Large, long-lived buffers (e.g., a server's 10 MiB payload buffer) backed
+ * by huge pages, so that touching one costs a few page faults and TLB
+ * entries rather than thousands.  The huge page size is the kernel's PMD
+ * size, from /sys/kernel/mm/transparent_hugepage/hpage_pmd_size (2 MiB on
+ * x86-64; RPC_HUGEMEM_DEFAULT_PAGE_SIZE if it can't be read).
+ * rpc_hugemem_alloc tries, in order:
+ *
+ *   RPC_HUGEMEM_TLB   explicit huge pages of that size, from its hugetlbfs
+ *                     pool (/sys/kernel/mm/hugepages/hugepages-<N>kB)
+ *   RPC_HUGEMEM_THP   a huge-page-aligned mapping advised MADV_HUGEPAGE, for
+ *                     transparent huge pages (when the kernel's THP mode is
+ *                     "madvise" or "always")
+ *   RPC_HUGEMEM_NONE  ordinary pages (the advice was refused, or THP is
+ *                     "never")
+ *
+ * and says which it got in *kind.  The memory is zeroed, and faulted in
+ * up front, so that the first RPC to use it doesn't pay for that.  Returns
+ * NULL, with errno set, only if no memory can be mapped at all.
+ */
+#define RPC_HUGEMEM_DEFAULT_PAGE_SIZE   (2U * 1024 * 1024)
+
+#define RPC_HUGEMEM_NONE        0
+#define RPC_HUGEMEM_THP         1
+#define RPC_HUGEMEM_TLB         2
+
+size_t rpc_hugemem_page_size(void);
+
+void * rpc_hugemem_alloc(size_t len, int *kind);
+/* len must be the len passed to rpc_hugemem_alloc */
+void rpc_hugemem_free(void *p, size_t len);
+
+const char * rpc_hugemem_kind_to_str(int kind);
+
+RHO_DECLS_END
+
+#endif /* _RPC_HUGEMEM_H_ */
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rho/rho_buf.h>
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_copy.h"
+#include "rpc_mempipe.h"
+
+struct rpc_mempipe_ring {
+    uint8_t                 *mr_data;
+    size_t                  mr_head;    /* offset of the oldest byte */
+    size_t                  mr_len;     /* bytes held */
+    bool                    mr_wclosed; /* writer closed: EOF once drained */
+    bool                    mr_rclosed; /* reader closed: sends fail */
+};
+
+struct rpc_mempipe_end {
+    struct rpc_mempipe      *me_pipe;
+    struct rpc_mempipe_ring *me_in;
+    struct rpc_mempipe_ring *me_out;
+};
+
+struct rpc_mempipe {
+    pthread_mutex_t         mp_lock;
+    size_t                  mp_cap;
+    struct rpc_mempipe_ring mp_rings[2];    /* ring i carries end i's sends */
+    struct rpc_mempipe_end  mp_ends[2];
+
+    struct rpc_mempipe_faults mp_faults;
+    uint64_t                mp_rand;        /* xorshift64 state */
+};
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+struct rpc_mempipe *
+rpc_mempipe_create(size_t capacity)
+{
+    struct rpc_mempipe *pipe = NULL;
+    int i = 0;
+
+    RHO_TRACE_ENTER();
+
+    RHO_ASSERT(capacity > 0);
+
+    pipe = rhoL_zalloc(sizeof(*pipe));
+    pthread_mutex_init(&pipe->mp_lock, NULL);
+    pipe->mp_cap = capacity;
+    for (i = 0; i < 2; i++) {
+        pipe->mp_rings[i].mr_data = rhoL_zalloc(capacity);
+        pipe->mp_ends[i].me_pipe = pipe;
+        pipe->mp_ends[i].me_out = &pipe->mp_rings[i];
+        pipe->mp_ends[i].me_in = &pipe->mp_rings[1 - i];
+    }
+
+    RHO_TRACE_EXIT();
+    return (pipe);
+}
+
+void
+rpc_mempipe_destroy(struct rpc_mempipe *pipe)
+{
+    RHO_TRACE_ENTER();
+
+    rhoL_free(pipe->mp_rings[0].mr_data);
+    rhoL_free(pipe->mp_rings[1].mr_data);
+    pthread_mutex_destroy(&pipe->mp_lock);
+    rhoL_free(pipe);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * FAULTS
+ *********************************************************/
+void
+rpc_mempipe_set_faults(struct rpc_mempipe *pipe,
+        const struct rpc_mempipe_faults *faults)
+{
+    pthread_mutex_lock(&pipe->mp_lock);
+    pipe->mp_faults = *faults;
+    /* xorshift's state must not be zero */
+    pipe->mp_rand = faults->mf_seed != 0 ? faults->mf_seed :
+        0x9e3779b97f4a7c15ULL;
+    pthread_mutex_unlock(&pipe->mp_lock);
+}
+
+static uint64_t
+rpc_mempipe_rand(struct rpc_mempipe *pipe)
+{
+    uint64_t x = pipe->mp_rand;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    pipe->mp_rand = x;
+    return (x);
+}
+
+/*
+ * Apply the faults to a call that could move len bytes (len > 0): returns
+ * how many it should move, or 0 if it should fail with EAGAIN.  Called with
+ * the lock held.
+ */
+static size_t
+rpc_mempipe_inject(struct rpc_mempipe *pipe, size_t len)
+{
+    const struct rpc_mempipe_faults *f = &pipe->mp_faults;
+
+    if (f->mf_again_pct > 0 && rpc_mempipe_rand(pipe) % 100 < f->mf_again_pct)
+        return (0);
+
+    if (f->mf_max_io > 0 && len > f->mf_max_io)
+        len = f->mf_max_io;
+
+    if (len > 1 && f->mf_short_pct > 0 &&
+            rpc_mempipe_rand(pipe) % 100 < f->mf_short_pct)
+        len = 1 + rpc_mempipe_rand(pipe) % (len - 1);
+
+    return (len);
+}
+
+/*********************************************************
+ * TRANSPORT OPS
+ *********************************************************/
+static ssize_t
+rpc_mempipe_recv(void *ctx, struct rho_buf *buf, size_t len)
+{
+    struct rpc_mempipe_end *end = ctx;
+    struct rpc_mempipe *pipe = end->me_pipe;
+    struct rpc_mempipe_ring *r = end->me_in;
+    size_t n = 0;
+    size_t first = 0;
+    ssize_t ret = 0;
+
+    pthread_mutex_lock(&pipe->mp_lock);
+
+    if (r->mr_len == 0) {
+        if (r->mr_wclosed) {
+            ret = 0;
+        } else {
+            errno = EAGAIN;
+            ret = -1;
+        }
+        goto done;
+    }
+
+    n = len < r->mr_len ? len : r->mr_len;
+    n = rpc_mempipe_inject(pipe, n);
+    if (n == 0) {
+        errno = EAGAIN;
+        ret = -1;
+        goto done;
+    }
+
+    /* the bytes may wrap around the end of the ring */
+    first = pipe->mp_cap - r->mr_head;
+    if (first > n)
+        first = n;
+    rho_buf_write(buf, r->mr_data + r->mr_head, first);
+    if (n > first)
+        rho_buf_write(buf, r->mr_data, n - first);
+
+    r->mr_head = (r->mr_head + n) % pipe->mp_cap;
+    r->mr_len -= n;
+    ret = (ssize_t)n;
+
+done:
+    pthread_mutex_unlock(&pipe->mp_lock);
+    return (ret);
+}
+
+static ssize_t
+rpc_mempipe_send(void *ctx, struct rho_buf *buf, size_t len)
+{
+    struct rpc_mempipe_end *end = ctx;
+    struct rpc_mempipe *pipe = end->me_pipe;
+    struct rpc_mempipe_ring *r = end->me_out;
+    const uint8_t *p = rho_buf_raw(buf, 0, SEEK_CUR);
+    size_t room = 0;
+    size_t tail = 0;
+    size_t n = 0;
+    size_t first = 0;
+    ssize_t ret = 0;
+
+    RHO_ASSERT(len > 0);
+
+    pthread_mutex_lock(&pipe->mp_lock);
+
+    if (r->mr_wclosed || r->mr_rclosed) {
+        errno = EPIPE;
+        ret = -1;
+        goto done;
+    }
+
+    room = pipe->mp_cap - r->mr_len;
+    n = len < room ? len : room;
+    if (n > 0)
+        n = rpc_mempipe_inject(pipe, n);
+    if (n == 0) {
+        errno = EAGAIN;
+        ret = -1;
+        goto done;
+    }
+
+    tail = (r->mr_head + r->mr_len) % pipe->mp_cap;
+    first = pipe->mp_cap - tail;
+    if (first > n)
+        first = n;
+    /* the other end reads it, so a large copy needn't stay in our cache */
+    rpc_copy(r->mr_data + tail, p, first);
+    if (n > first)
+        rpc_copy(r->mr_data, p + first, n - first);
+
+    r->mr_len += n;
+    rho_buf_seek(buf, n, SEEK_CUR);
+    ret = (ssize_t)n;
+
+done:
+    pthread_mutex_unlock(&pipe->mp_lock);
+    return (ret);
+}
+
+static const struct rpc_transport_ops rpc_mempipe_ops = {
+    .xo_recv = rpc_mempipe_recv,
+    .xo_send = rpc_mempipe_send,
+};
+
+/*********************************************************
+ * ENDS
+ *********************************************************/
+/* make agent (created without a socket) use end 0 or 1 of pipe */
+void
+rpc_mempipe_attach(struct rpc_mempipe *pipe, int end,
+        struct rpc_agent *agent)
+{
+    RHO_ASSERT(end == 0 || end == 1);
+
+    rpc_agent_set_transport(agent, &rpc_mempipe_ops, &pipe->mp_ends[end]);
+}
+
+void
+rpc_mempipe_close(struct rpc_mempipe *pipe, int end)
+{
+    RHO_ASSERT(end == 0 || end == 1);
+
+    pthread_mutex_lock(&pipe->mp_lock);
+    pipe->mp_ends[end].me_out->mr_wclosed = true;
+    pipe->mp_ends[end].me_in->mr_rclosed = true;
+    pthread_mutex_unlock(&pipe->mp_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef _RPC_MEMPIPE_H_
+#define _RPC_MEMPIPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+#include "rpc.h"
+
+RHO_DECLS_BEGIN
+
+/*
+ * MEMORY PIPE
+ *
+ * An in-process transport (see struct rpc_transport_ops): a pair of byte
+ * rings, one each way, joining end 0 and end 1.  Attach an agent (created
+ * without a socket) to each end, and the two can exchange messages with no
+ * system calls at all -- for measuring the library's own cost, and for
+ * tests.  The ends may be used from different threads.
+ *
+ * A receive on an empty ring fails with EAGAIN, as does a send to a full
+ * one; a ring holds capacity bytes.  Once an end is closed, its peer reads
+ * what is left and then end of file, and its sends fail with EPIPE.
+ *
+ * Faults, if set, are injected at each send and receive, to exercise the
+ * agents' handling of partial I/O: a call may fail with EAGAIN although it
+ * could have moved bytes, or be cut short.  The choices come from a PRNG
+ * seeded with mf_seed, so a run can be repeated exactly.
+ */
+struct rpc_mempipe_faults {
+    uint32_t    mf_max_io;      /* most bytes a call moves (0: no limit) */
+    uint32_t    mf_short_pct;   /* % of calls cut to a random shorter length */
+    uint32_t    mf_again_pct;   /* % of calls that fail with EAGAIN */
+    uint64_t    mf_seed;
+};
+
+struct rpc_mempipe;
+
+struct rpc_mempipe * rpc_mempipe_create(size_t capacity);
+void rpc_mempipe_destroy(struct rpc_mempipe *pipe);
+
+void rpc_mempipe_set_faults(struct rpc_mempipe *pipe,
+        const struct rpc_mempipe_faults *faults);
+
+void rpc_mempipe_attach(struct rpc_mempipe *pipe, int end,
+        struct rpc_agent *agent);
+void rpc_mempipe_close(struct rpc_mempipe *pipe, int end);
+
+RHO_DECLS_END
+
+#endif /* _RPC_MEMPIPE_H_ */
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_poller.h"
+
+struct rpc_poller_ent {
+    rpc_poller_fn   pe_fn;
+    void            *pe_arg;
+};
+
+struct rpc_poller {
+    uint64_t                pr_idle_ns;
+    struct pollfd           *pr_fds;
+    struct rpc_poller_ent   *pr_ents;
+    size_t                  pr_n;
+    size_t                  pr_cap;
+    int                     *pr_slots;  /* by fd: its index above, or -1 */
+    size_t                  pr_nslots;
+    bool                    pr_dirty;   /* deleted entries to compact */
+    volatile sig_atomic_t   pr_stop;
+    struct rpc_poller_stats pr_stats;
+};
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+/*
+ * idle_us is how long the poller spins without finding anything before it
+ * blocks; 0 means that it never spins.
+ */
+struct rpc_poller *
+rpc_poller_create(uint32_t idle_us)
+{
+    struct rpc_poller *poller = NULL;
+
+    RHO_TRACE_ENTER("idle_us=%"PRIu32, idle_us);
+
+    poller = rhoL_zalloc(sizeof(*poller));
+    poller->pr_idle_ns = (uint64_t)idle_us * 1000;
+
+    RHO_TRACE_EXIT();
+    return (poller);
+}
+
+void
+rpc_poller_destroy(struct rpc_poller *poller)
+{
+    RHO_TRACE_ENTER();
+
+    if (poller->pr_fds != NULL) {
+        rhoL_free(poller->pr_fds);
+        rhoL_free(poller->pr_ents);
+    }
+    if (poller->pr_slots != NULL)
+        rhoL_free(poller->pr_slots);
+    rhoL_free(poller);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * FDS
+ *********************************************************/
+static short
+rpc_poller_to_pollev(int events)
+{
+    short ev = 0;
+
+    if (events & RPC_POLLER_READ)
+        ev |= POLLIN;
+    if (events & RPC_POLLER_WRITE)
+        ev |= POLLOUT;
+
+    return (ev);
+}
+
+static struct pollfd *
+rpc_poller_find(struct rpc_poller *poller, int fd)
+{
+    if (fd < 0 || (size_t)fd >= poller->pr_nslots ||
+            poller->pr_slots[fd] == -1)
+        rho_die("fd %d is not in the poller", fd);
+
+    return (&poller->pr_fds[poller->pr_slots[fd]]);
+}
+
+/* make room in pr_slots for fd */
+static void
+rpc_poller_grow_slots(struct rpc_poller *poller, int fd)
+{
+    size_t n = poller->pr_nslots == 0 ? 64 : poller->pr_nslots;
+    size_t i = 0;
+
+    while (n <= (size_t)fd)
+        n *= 2;
+
+    poller->pr_slots = rhoL_realloc(poller->pr_slots,
+            n * sizeof(*poller->pr_slots));
+    for (i = poller->pr_nslots; i < n; i++)
+        poller->pr_slots[i] = -1;
+    poller->pr_nslots = n;
+}
+
+static void
+rpc_poller_grow(struct rpc_poller *poller)
+{
+    size_t cap = poller->pr_cap == 0 ? 16 : poller->pr_cap * 2;
+    struct pollfd *fds = rhoL_zalloc(cap * sizeof(*fds));
+    struct rpc_poller_ent *ents = rhoL_zalloc(cap * sizeof(*ents));
+
+    if (poller->pr_n > 0) {
+        memcpy(fds, poller->pr_fds, poller->pr_n * sizeof(*fds));
+        memcpy(ents, poller->pr_ents, poller->pr_n * sizeof(*ents));
+    }
+    if (poller->pr_fds != NULL) {
+        rhoL_free(poller->pr_fds);
+        rhoL_free(poller->pr_ents);
+    }
+
+    poller->pr_fds = fds;
+    poller->pr_ents = ents;
+    poller->pr_cap = cap;
+}
+
+void
+rpc_poller_add(struct rpc_poller *poller, int fd, int events,
+        rpc_poller_fn fn, void *arg)
+{
+    RHO_ASSERT(fd >= 0);
+
+    if (poller->pr_n == poller->pr_cap)
+        rpc_poller_grow(poller);
+    if ((size_t)fd >= poller->pr_nslots)
+        rpc_poller_grow_slots(poller, fd);
+    RHO_ASSERT(poller->pr_slots[fd] == -1);
+
+    poller->pr_slots[fd] = (int)poller->pr_n;
+    poller->pr_fds[poller->pr_n].fd = fd;
+    poller->pr_fds[poller->pr_n].events = rpc_poller_to_pollev(events);
+    poller->pr_fds[poller->pr_n].revents = 0;
+    poller->pr_ents[poller->pr_n].pe_fn = fn;
+    poller->pr_ents[poller->pr_n].pe_arg = arg;
+    poller->pr_n++;
+}
+
+/* change the events fd is watched for; 0 stops watching it for now */
+void
+rpc_poller_set(struct rpc_poller *poller, int fd, int events)
+{
+    rpc_poller_find(poller, fd)->events = rpc_poller_to_pollev(events);
+}
+
+/* call before closing fd */
+void
+rpc_poller_del(struct rpc_poller *poller, int fd)
+{
+    struct pollfd *pfd = rpc_poller_find(poller, fd);
+
+    /*
+     * poll(2) ignores negative fds; the slot is reclaimed after the sweep.
+     * fd itself is free at once, as it may be reused before then.
+     */
+    poller->pr_slots[fd] = -1;
+    pfd->fd = -1;
+    pfd->events = 0;
+    pfd->revents = 0;
+    poller->pr_dirty = true;
+}
+
+static void
+rpc_poller_compact(struct rpc_poller *poller)
+{
+    size_t i = 0;
+    size_t j = 0;
+
+    for (i = 0; i < poller->pr_n; i++) {
+        if (poller->pr_fds[i].fd < 0)
+            continue;
+        poller->pr_fds[j] = poller->pr_fds[i];
+        poller->pr_ents[j] = poller->pr_ents[i];
+        poller->pr_slots[poller->pr_fds[j].fd] = (int)j;
+        j++;
+    }
+
+    poller->pr_n = j;
+    poller->pr_dirty = false;
+}
+
+/*********************************************************
+ * LOOP
+ *********************************************************/
+static void
+rpc_poller_dispatch(struct rpc_poller *poller)
+{
+    size_t i = 0;
+    size_t n = poller->pr_n;    /* not any added by the callbacks */
+    short rev = 0;
+    int what = 0;
+
+    for (i = 0; i < n; i++) {
+        rev = poller->pr_fds[i].revents;
+        if (rev == 0 || poller->pr_fds[i].fd < 0)
+            continue;
+        poller->pr_fds[i].revents = 0;
+
+        what = 0;
+        if (rev & (POLLIN | POLLHUP | POLLERR))
+            what |= RPC_POLLER_READ;
+        if (rev & POLLOUT)
+            what |= RPC_POLLER_WRITE;
+        /* an error or hangup goes to whichever side is being watched */
+        if (!(poller->pr_fds[i].events & POLLIN) && (what & RPC_POLLER_READ))
+            what = RPC_POLLER_WRITE;
+
+        poller->pr_ents[i].pe_fn(poller, poller->pr_fds[i].fd, what,
+                poller->pr_ents[i].pe_arg);
+    }
+
+    if (poller->pr_dirty)
+        rpc_poller_compact(poller);
+}
+
+/* run until rpc_poller_stop is called (which is async-signal safe) */
+void
+rpc_poller_run(struct rpc_poller *poller)
+{
+    struct rpc_poller_stats *st = &poller->pr_stats;
+    uint64_t last = rpc_now_ns();
+    uint64_t t0 = 0;
+    uint64_t t1 = 0;
+    int timeout = 0;
+    int n = 0;
+
+    RHO_TRACE_ENTER();
+
+    poller->pr_stop = false;
+    while (!poller->pr_stop) {
+        t0 = rpc_now_ns();
+        timeout = (t0 - last >= poller->pr_idle_ns) ? -1 : 0;
+
+        n = poll(poller->pr_fds, poller->pr_n, timeout);
+        t1 = rpc_now_ns();
+
+        if (timeout == -1) {
+            st->ps_nblocks++;
+            st->ps_block_ns += t1 - t0;
+        } else {
+            st->ps_nsweeps++;
+        }
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            rho_errno_die(errno, "poll");
+        }
+
+        if (n == 0) {
+            st->ps_nempty++;
+            st->ps_spin_ns += t1 - t0;
+            continue;
+        }
+
+        last = t1;
+        rpc_poller_dispatch(poller);
+    }
+
+    RHO_TRACE_EXIT();
+}
+
+void
+rpc_poller_stop(struct rpc_poller *poller)
+{
+    poller->pr_stop = true;
+}
+
+const struct rpc_poller_stats *
+rpc_poller_get_stats(const struct rpc_poller *poller)
+{
+    return (&poller->pr_stats);
+}
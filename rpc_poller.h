@@ -0,0 +1,56 @@
+#ifndef _RPC_POLLER_H_
+#define _RPC_POLLER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * POLLING LOOP
+ *
+ * An alternative to rho_event_loop for servers with a core to spare.  While
+ * requests keep arriving, the poller sweeps all of its fds with a
+ * non-blocking poll(2), and so never sleeps; once a sweep has found nothing
+ * for idle_us microseconds, it blocks in poll(2) until something is ready.
+ * This trades CPU for latency: a request that arrives while the poller is
+ * spinning costs no wakeup (and, exitless, no handoff to an untrusted
+ * thread).
+ *
+ * Callbacks may add, change, and delete fds, including their own.
+ */
+#define RPC_POLLER_READ     0x01
+#define RPC_POLLER_WRITE    0x02
+
+struct rpc_poller;
+
+typedef void (*rpc_poller_fn)(struct rpc_poller *poller, int fd, int what,
+        void *arg);
+
+struct rpc_poller_stats {
+    uint64_t    ps_spin_ns;     /* spent in sweeps that found nothing */
+    uint64_t    ps_block_ns;    /* spent blocked */
+    uint64_t    ps_nsweeps;
+    uint64_t    ps_nempty;      /* sweeps that found nothing */
+    uint64_t    ps_nblocks;     /* times the poller went idle */
+};
+
+struct rpc_poller * rpc_poller_create(uint32_t idle_us);
+void rpc_poller_destroy(struct rpc_poller *poller);
+
+void rpc_poller_add(struct rpc_poller *poller, int fd, int events,
+        rpc_poller_fn fn, void *arg);
+void rpc_poller_set(struct rpc_poller *poller, int fd, int events);
+void rpc_poller_del(struct rpc_poller *poller, int fd);
+
+void rpc_poller_run(struct rpc_poller *poller);
+void rpc_poller_stop(struct rpc_poller *poller);
+
+const struct rpc_poller_stats * rpc_poller_get_stats(
+        const struct rpc_poller *poller);
+
+RHO_DECLS_END
+
+#endif /* _RPC_POLLER_H_ */
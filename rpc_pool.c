@@ -0,0 +1,411 @@
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_pool.h"
+
+struct rpc_pool_job {
+    struct rpc_agent        *pj_agent;
+    rpc_dispatch_fn         pj_fn;
+    void                    *pj_udata;
+    struct rpc_pool_job     *pj_next;
+};
+
+struct rpc_pool_worker {
+    struct rpc_pool         *pw_pool;
+    unsigned int            pw_id;
+    pthread_t               pw_thread;
+    pthread_mutex_t         pw_lock;
+    struct rpc_pool_job     *pw_head;   /* FIFO of submitted jobs */
+    struct rpc_pool_job     *pw_tail;
+};
+
+struct rpc_pool {
+    unsigned int            pl_nworkers;
+    struct rpc_pool_worker  *pl_workers;
+    unsigned int            pl_next;    /* worker to submit to next */
+
+    /* idle workers sleep on pl_cond until there are jobs queued */
+    pthread_mutex_t         pl_lock;
+    pthread_cond_t          pl_cond;
+    unsigned int            pl_queued;  /* atomic */
+    bool                    pl_stop;
+
+    /* finished jobs, most recent first (a Treiber stack) */
+    struct rpc_pool_job     *pl_done;   /* atomic */
+    int                     pl_efd;
+
+    uint32_t                pl_offload[RPC_POOL_MAX_OFFLOAD_OPS];
+    unsigned int            pl_noffload;
+};
+
+static uint32_t
+rpc_pool_getu32be(const uint8_t *p)
+{
+    return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+            ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+/*********************************************************
+ * QUEUES
+ *********************************************************/
+static void
+rpc_pool_worker_push(struct rpc_pool_worker *w, struct rpc_pool_job *job)
+{
+    job->pj_next = NULL;
+
+    pthread_mutex_lock(&w->pw_lock);
+    if (w->pw_tail != NULL)
+        w->pw_tail->pj_next = job;
+    else
+        w->pw_head = job;
+    w->pw_tail = job;
+    pthread_mutex_unlock(&w->pw_lock);
+}
+
+static struct rpc_pool_job *
+rpc_pool_worker_pop(struct rpc_pool_worker *w)
+{
+    struct rpc_pool_job *job = NULL;
+
+    pthread_mutex_lock(&w->pw_lock);
+    job = w->pw_head;
+    if (job != NULL) {
+        w->pw_head = job->pj_next;
+        if (w->pw_head == NULL)
+            w->pw_tail = NULL;
+    }
+    pthread_mutex_unlock(&w->pw_lock);
+
+    if (job != NULL)
+        __atomic_sub_fetch(&w->pw_pool->pl_queued, 1, __ATOMIC_RELAXED);
+
+    return (job);
+}
+
+/* the next job from w's own queue, or else from another worker's */
+static struct rpc_pool_job *
+rpc_pool_next_job(struct rpc_pool_worker *w)
+{
+    struct rpc_pool *pool = w->pw_pool;
+    struct rpc_pool_job *job = NULL;
+    unsigned int i = 0;
+
+    job = rpc_pool_worker_pop(w);
+    for (i = 1; job == NULL && i < pool->pl_nworkers; i++)
+        job = rpc_pool_worker_pop(
+                &pool->pl_workers[(w->pw_id + i) % pool->pl_nworkers]);
+
+    return (job);
+}
+
+static void
+rpc_pool_push_done(struct rpc_pool *pool, struct rpc_pool_job *job)
+{
+    struct rpc_pool_job *head = NULL;
+    uint64_t one = 1;
+    ssize_t n = 0;
+
+    head = __atomic_load_n(&pool->pl_done, __ATOMIC_RELAXED);
+    do {
+        job->pj_next = head;
+    } while (!__atomic_compare_exchange_n(&pool->pl_done, &head, job, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /*
+     * the loop takes the whole stack at once, so it only needs waking for
+     * the first job pushed since
+     */
+    if (head == NULL) {
+        do {
+            n = write(pool->pl_efd, &one, sizeof(one));
+        } while (n == -1 && errno == EINTR);
+    }
+}
+
+/*********************************************************
+ * WORKERS
+ *********************************************************/
+static void *
+rpc_pool_worker_main(void *arg)
+{
+    struct rpc_pool_worker *w = arg;
+    struct rpc_pool *pool = w->pw_pool;
+    struct rpc_pool_job *job = NULL;
+
+    while (1) {
+        job = rpc_pool_next_job(w);
+        if (job != NULL) {
+            job->pj_fn(job->pj_agent, job->pj_udata);
+            rpc_pool_push_done(pool, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->pl_lock);
+        while (!pool->pl_stop &&
+                __atomic_load_n(&pool->pl_queued, __ATOMIC_RELAXED) == 0)
+            pthread_cond_wait(&pool->pl_cond, &pool->pl_lock);
+        if (pool->pl_stop) {
+            pthread_mutex_unlock(&pool->pl_lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->pl_lock);
+    }
+
+    return (NULL);
+}
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+struct rpc_pool *
+rpc_pool_create(unsigned int nworkers)
+{
+    struct rpc_pool *pool = NULL;
+    struct rpc_pool_worker *w = NULL;
+    unsigned int i = 0;
+    int error = 0;
+
+    RHO_ASSERT(nworkers > 0);
+
+    RHO_TRACE_ENTER("nworkers=%u", nworkers);
+
+    pool = rhoL_zalloc(sizeof(*pool));
+    pool->pl_nworkers = nworkers;
+    pool->pl_workers = rhoL_zalloc(nworkers * sizeof(*pool->pl_workers));
+    pthread_mutex_init(&pool->pl_lock, NULL);
+    pthread_cond_init(&pool->pl_cond, NULL);
+
+    pool->pl_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->pl_efd == -1)
+        rho_errno_die(errno, "eventfd");
+
+    for (i = 0; i < nworkers; i++) {
+        w = &pool->pl_workers[i];
+        w->pw_pool = pool;
+        w->pw_id = i;
+        pthread_mutex_init(&w->pw_lock, NULL);
+        error = pthread_create(&w->pw_thread, NULL, rpc_pool_worker_main, w);
+        if (error != 0)
+            rho_errno_die(error, "pthread_create");
+    }
+
+    RHO_TRACE_EXIT();
+    return (pool);
+}
+
+/*
+ * Stops and joins the workers.  Jobs that have not been reaped by then,
+ * whether they had run or not, are passed to discard (with arg) instead of
+ * a completion function, so that the caller can close their connections;
+ * if discard is NULL, their agents are simply destroyed.
+ */
+static void
+rpc_pool_discard(struct rpc_pool_job *job, rpc_pool_done_fn discard,
+        void *arg)
+{
+    if (discard != NULL)
+        discard(job->pj_agent, job->pj_udata, arg);
+    else
+        rpc_agent_destroy(job->pj_agent);
+    rhoL_free(job);
+}
+
+void
+rpc_pool_destroy(struct rpc_pool *pool, rpc_pool_done_fn discard, void *arg)
+{
+    struct rpc_pool_job *job = NULL;
+    unsigned int i = 0;
+
+    RHO_TRACE_ENTER();
+
+    pthread_mutex_lock(&pool->pl_lock);
+    pool->pl_stop = true;
+    pthread_cond_broadcast(&pool->pl_cond);
+    pthread_mutex_unlock(&pool->pl_lock);
+
+    for (i = 0; i < pool->pl_nworkers; i++)
+        pthread_join(pool->pl_workers[i].pw_thread, NULL);
+
+    for (i = 0; i < pool->pl_nworkers; i++) {
+        while ((job = rpc_pool_worker_pop(&pool->pl_workers[i])) != NULL)
+            rpc_pool_discard(job, discard, arg);
+        pthread_mutex_destroy(&pool->pl_workers[i].pw_lock);
+    }
+
+    while ((job = pool->pl_done) != NULL) {
+        pool->pl_done = job->pj_next;
+        rpc_pool_discard(job, discard, arg);
+    }
+
+    (void)close(pool->pl_efd);
+    pthread_cond_destroy(&pool->pl_cond);
+    pthread_mutex_destroy(&pool->pl_lock);
+    rhoL_free(pool->pl_workers);
+    rhoL_free(pool);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * OFFLOADED OPCODES
+ *********************************************************/
+/*
+ * Mark requests with opcode code as ones to run on the pool.  Returns 0, or
+ * -1 with errno set to ENOSPC if RPC_POOL_MAX_OFFLOAD_OPS are already
+ * marked.
+ */
+int
+rpc_pool_offload_op(struct rpc_pool *pool, uint32_t code)
+{
+    if (rpc_pool_is_offloaded(pool, code))
+        return (0);
+
+    if (pool->pl_noffload == RPC_POOL_MAX_OFFLOAD_OPS) {
+        errno = ENOSPC;
+        return (-1);
+    }
+
+    pool->pl_offload[pool->pl_noffload++] = code;
+    return (0);
+}
+
+bool
+rpc_pool_is_offloaded(const struct rpc_pool *pool, uint32_t code)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < pool->pl_noffload; i++) {
+        if (pool->pl_offload[i] == code)
+            return (true);
+    }
+
+    return (false);
+}
+
+/*
+ * Whether the DISPATCHABLE request in agent should run on the pool: its
+ * opcode is offloaded, or it is a compound request with an operation whose
+ * opcode is.  A malformed compound is left to the loop, which rejects it.
+ */
+bool
+rpc_pool_wants(const struct rpc_pool *pool, const struct rpc_agent *agent)
+{
+    const uint8_t *p = rpc_agent_body(agent);
+    size_t left = rpc_agent_get_bodylen(agent);
+    uint32_t nops = 0;
+    uint32_t oplen = 0;
+    uint32_t i = 0;
+
+    if (agent->ra_hdr.rh_code != RPC_OP_COMPOUND)
+        return (rpc_pool_is_offloaded(pool, agent->ra_hdr.rh_code));
+
+    if (pool->pl_noffload == 0 || left < RPC_COMPOUND_HDRLEN)
+        return (false);
+    nops = rpc_pool_getu32be(p + 4);
+    p += RPC_COMPOUND_HDRLEN;
+    left -= RPC_COMPOUND_HDRLEN;
+
+    for (i = 0; i < nops && left >= RPC_COMPOUND_OP_HDRLEN; i++) {
+        if (rpc_pool_is_offloaded(pool, rpc_pool_getu32be(p)))
+            return (true);
+        oplen = rpc_pool_getu32be(p + 8);
+        p += RPC_COMPOUND_OP_HDRLEN;
+        left -= RPC_COMPOUND_OP_HDRLEN;
+        if (oplen > left)
+            break;
+        p += oplen;
+        left -= oplen;
+    }
+
+    return (false);
+}
+
+/*********************************************************
+ * JOBS
+ *********************************************************/
+/* the fd to watch for reading; when it is readable, call rpc_pool_reap */
+int
+rpc_pool_fd(const struct rpc_pool *pool)
+{
+    return (pool->pl_efd);
+}
+
+/*
+ * Run fn(agent, udata) on a worker.  agent must be DISPATCHABLE (to handle
+ * its request) or HANDSHAKE (to do its TLS handshake), and is handed over to
+ * the pool until the job is reaped.
+ */
+void
+rpc_pool_submit(struct rpc_pool *pool, struct rpc_agent *agent,
+        rpc_dispatch_fn fn, void *udata)
+{
+    struct rpc_pool_job *job = NULL;
+    struct rpc_pool_worker *w = NULL;
+
+    RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE ||
+            agent->ra_state == RPC_STATE_HANDSHAKE);
+
+    job = rhoL_zalloc(sizeof(*job));
+    job->pj_agent = agent;
+    job->pj_fn = fn;
+    job->pj_udata = udata;
+
+    w = &pool->pl_workers[pool->pl_next];
+    pool->pl_next = (pool->pl_next + 1) % pool->pl_nworkers;
+
+    rpc_pool_worker_push(w, job);
+    __atomic_add_fetch(&pool->pl_queued, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->pl_lock);
+    pthread_cond_signal(&pool->pl_cond);
+    pthread_mutex_unlock(&pool->pl_lock);
+}
+
+/*
+ * Call done(agent, udata, arg) on the calling (loop) thread for each job
+ * that has finished, in the order they finished.  Returns the number of
+ * jobs reaped.
+ */
+int
+rpc_pool_reap(struct rpc_pool *pool, rpc_pool_done_fn done, void *arg)
+{
+    struct rpc_pool_job *job = NULL;
+    struct rpc_pool_job *next = NULL;
+    struct rpc_pool_job *fifo = NULL;
+    uint64_t count = 0;
+    ssize_t nread = 0;
+    int n = 0;
+
+    /* reset the eventfd before taking the stack, so no wakeup is lost */
+    do {
+        nread = read(pool->pl_efd, &count, sizeof(count));
+    } while (nread == -1 && errno == EINTR);
+
+    job = __atomic_exchange_n(&pool->pl_done, NULL, __ATOMIC_ACQUIRE);
+    while (job != NULL) {
+        next = job->pj_next;
+        job->pj_next = fifo;
+        fifo = job;
+        job = next;
+    }
+
+    while (fifo != NULL) {
+        job = fifo;
+        fifo = job->pj_next;
+        done(job->pj_agent, job->pj_udata, arg);
+        rhoL_free(job);
+        n++;
+    }
+
+    return (n);
+}
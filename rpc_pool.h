@@ -0,0 +1,59 @@
+#ifndef _RPC_POOL_H_
+#define _RPC_POOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+#include "rpc.h"
+
+RHO_DECLS_BEGIN
+
+/*
+ * WORKER POOL
+ *
+ * Lets an event-loop server run slow handlers on worker threads, so that
+ * they don't hold up the loop's other connections.  The loop submits the
+ * DISPATCHABLE agent with the function that handles it; the agent stays in
+ * RPC_STATE_DISPATCHABLE, and the loop must neither touch it nor watch its
+ * socket until the job completes.
+ *
+ * Jobs are spread round-robin over per-worker queues, and a worker whose
+ * own queue is empty takes jobs from the others'.  Finished jobs are pushed
+ * onto a lock-free completion queue, and the pool's eventfd is signalled;
+ * the loop watches rpc_pool_fd() for reading, and then calls
+ * rpc_pool_reap(), which runs a completion function for each finished job
+ * on the loop's thread.
+ *
+ * A server may likewise hand a pool its agents in RPC_STATE_HANDSHAKE, so
+ * that the handshakes' public-key operations don't hold up the loop either;
+ * the job then runs the handshake to completion, and the loop takes the
+ * agent back to receive its first request.
+ */
+
+#define RPC_POOL_MAX_OFFLOAD_OPS    32
+
+struct rpc_pool;
+
+typedef void (*rpc_pool_done_fn)(struct rpc_agent *agent, void *udata,
+        void *arg);
+
+struct rpc_pool * rpc_pool_create(unsigned int nworkers);
+void rpc_pool_destroy(struct rpc_pool *pool, rpc_pool_done_fn discard,
+        void *arg);
+
+int rpc_pool_fd(const struct rpc_pool *pool);
+
+int rpc_pool_offload_op(struct rpc_pool *pool, uint32_t code);
+bool rpc_pool_is_offloaded(const struct rpc_pool *pool, uint32_t code);
+bool rpc_pool_wants(const struct rpc_pool *pool,
+        const struct rpc_agent *agent);
+
+void rpc_pool_submit(struct rpc_pool *pool, struct rpc_agent *agent,
+        rpc_dispatch_fn fn, void *udata);
+int rpc_pool_reap(struct rpc_pool *pool, rpc_pool_done_fn done, void *arg);
+
+RHO_DECLS_END
+
+#endif /* _RPC_POOL_H_ */
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <rho/rho_buf.h>
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_stats.h"
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+struct rpc_stats *
+rpc_stats_create(void)
+{
+    struct rpc_stats *stats = NULL;
+
+    RHO_TRACE_ENTER();
+
+    stats = rhoL_zalloc(sizeof(*stats));
+    stats->st_start_ns = rpc_now_ns();
+
+    RHO_TRACE_EXIT();
+    return (stats);
+}
+
+void
+rpc_stats_destroy(struct rpc_stats *stats)
+{
+    RHO_TRACE_ENTER();
+
+    if (stats->st_agents != NULL)
+        rhoL_free(stats->st_agents);
+    rhoL_free(stats);
+
+    RHO_TRACE_EXIT();
+}
+
+/*********************************************************
+ * AGENTS
+ *********************************************************/
+void
+rpc_stats_agent_add(struct rpc_stats *stats, struct rpc_agent *agent)
+{
+    size_t cap = 0;
+    struct rpc_agent **agents = NULL;
+
+    if (stats->st_nagents == stats->st_cap) {
+        cap = stats->st_cap == 0 ? 16 : stats->st_cap * 2;
+        agents = rhoL_zalloc(cap * sizeof(*agents));
+        if (stats->st_agents != NULL) {
+            memcpy(agents, stats->st_agents,
+                    stats->st_nagents * sizeof(*agents));
+            rhoL_free(stats->st_agents);
+        }
+        stats->st_agents = agents;
+        stats->st_cap = cap;
+    }
+
+    stats->st_agents[stats->st_nagents++] = agent;
+}
+
+void
+rpc_stats_agent_del(struct rpc_stats *stats, struct rpc_agent *agent)
+{
+    size_t i = 0;
+
+    for (i = 0; i < stats->st_nagents; i++) {
+        if (stats->st_agents[i] == agent) {
+            rpc_io_stats_add(&stats->st_io_closed, rpc_agent_io_stats(agent));
+            stats->st_agents[i] = stats->st_agents[--stats->st_nagents];
+            return;
+        }
+    }
+
+    rho_die("agent is not in the stats");
+}
+
+/*********************************************************
+ * REQUESTS
+ *********************************************************/
+static size_t
+rpc_stats_msglen(const struct rpc_hdr *hdr)
+{
+    size_t len = RPC_HDR_LENGTH + hdr->rh_bodylen;
+
+    if (hdr->rh_flags & RPC_HDR_F_DEADLINE)
+        len += RPC_HDR_MAXLEN - RPC_HDR_LENGTH;
+
+    return (len);
+}
+
+static struct rpc_stats_op *
+rpc_stats_op(struct rpc_stats *stats, uint32_t code)
+{
+    struct rpc_stats_op *op = NULL;
+    unsigned int i = 0;
+
+    for (i = 0; i < stats->st_nops; i++) {
+        if (stats->st_ops[i].so_code == code)
+            return (&stats->st_ops[i]);
+    }
+
+    if (stats->st_nops == RPC_STATS_MAX_OPS)
+        return (NULL);
+
+    op = &stats->st_ops[stats->st_nops++];
+    op->so_code = code;
+    return (op);
+}
+
+static unsigned int
+rpc_stats_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned int b = 0;
+
+    while (us > 0 && b < RPC_STATS_NBUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+
+    return (b);
+}
+
+/* call when agent's request has become dispatchable */
+void
+rpc_stats_request(struct rpc_stats *stats, const struct rpc_agent *agent)
+{
+    RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE);
+
+    stats->st_bytes_in += rpc_stats_msglen(&agent->ra_hdr);
+}
+
+/*
+ * Call once the response to agent's request for opcode has been built,
+ * whether by the handler or by the server refusing the request.
+ */
+void
+rpc_stats_done(struct rpc_stats *stats, const struct rpc_agent *agent,
+        uint32_t opcode)
+{
+    struct rpc_stats_op *op = rpc_stats_op(stats, opcode);
+
+    stats->st_bytes_out += rpc_stats_msglen(&agent->ra_hdr);
+
+    if (op == NULL) {
+        stats->st_nother++;
+        return;
+    }
+
+    op->so_count++;
+    if (agent->ra_hdr.rh_code != 0)
+        op->so_nerrors++;
+    if (agent->ra_recv_ns != 0)
+        op->so_hist[rpc_stats_bucket(rpc_now_ns() - agent->ra_recv_ns)]++;
+}
+
+/*********************************************************
+ * SNAPSHOT
+ *********************************************************/
+/*
+ * If agent's request is a RPC_OP_STATS, build the response (a snapshot) and
+ * return true; the caller then sends it as it would any other.  Otherwise,
+ * return false.
+ */
+bool
+rpc_stats_dispatch(struct rpc_stats *stats, struct rpc_agent *agent)
+{
+    uint32_t nstate[RPC_STATS_NSTATES];
+    uint64_t body_bytes = 0;
+    struct rpc_io_stats io = stats->st_io_closed;
+    const struct rpc_agent *a = NULL;
+    const struct rpc_stats_op *op = NULL;
+    struct rho_buf *buf = agent->ra_bodybuf;
+    size_t i = 0;
+    unsigned int j = 0;
+
+    RHO_ASSERT(agent->ra_state == RPC_STATE_DISPATCHABLE);
+
+    if (agent->ra_hdr.rh_code != RPC_OP_STATS)
+        return (false);
+
+    rho_memzero(nstate, sizeof(nstate));
+    for (i = 0; i < stats->st_nagents; i++) {
+        a = stats->st_agents[i];
+        /* only the loop's thread changes an agent's state and I/O stats */
+        if (a->ra_state >= 1 && a->ra_state <= RPC_STATS_NSTATES)
+            nstate[a->ra_state - 1]++;
+        rpc_io_stats_add(&io, rpc_agent_io_stats(a));
+        /* but a worker (rpc_pool) may be using the buffers of these */
+        if (a->ra_state == RPC_STATE_DISPATCHABLE ||
+                a->ra_state == RPC_STATE_HANDSHAKE)
+            continue;
+        body_bytes += a->ra_bodycap + a->ra_bodymaplen;
+    }
+
+    rpc_agent_new_msg(agent, 0);
+    rho_buf_writeu32be(buf, RPC_STATS_VERSION);
+    rho_buf_writeu32be(buf, RPC_STATS_NSTATES);
+    rho_buf_writeu32be(buf, RPC_STATS_NBUCKETS);
+    rho_buf_writeu64be(buf, rpc_now_ns() - stats->st_start_ns);
+    rho_buf_writeu64be(buf, stats->st_busy_ns);
+    rho_buf_writeu64be(buf, stats->st_bytes_in);
+    rho_buf_writeu64be(buf, stats->st_bytes_out);
+    rho_buf_writeu64be(buf, body_bytes);
+    rho_buf_writeu32be(buf, (uint32_t)stats->st_nagents);
+    for (j = 0; j < RPC_STATS_NSTATES; j++)
+        rho_buf_writeu32be(buf, nstate[j]);
+    rho_buf_writeu64be(buf, stats->st_nother);
+    rho_buf_writeu64be(buf, io.is_nrecvs);
+    rho_buf_writeu64be(buf, io.is_nsends);
+    rho_buf_writeu64be(buf, io.is_bytes_in);
+    rho_buf_writeu64be(buf, io.is_bytes_out);
+    rho_buf_writeu64be(buf, io.is_nagain);
+    rho_buf_writeu64be(buf, io.is_npartial);
+    rho_buf_writeu64be(buf, io.is_npasses);
+    rho_buf_writeu64be(buf, io.is_nmsgs_in);
+    rho_buf_writeu64be(buf, io.is_nmsgs_out);
+    rho_buf_writeu32be(buf, stats->st_nops);
+    for (j = 0; j < stats->st_nops; j++) {
+        op = &stats->st_ops[j];
+        rho_buf_writeu32be(buf, op->so_code);
+        rho_buf_writeu64be(buf, op->so_count);
+        rho_buf_writeu64be(buf, op->so_nerrors);
+        for (i = 0; i < RPC_STATS_NBUCKETS; i++)
+            rho_buf_writeu64be(buf, op->so_hist[i]);
+    }
+    rpc_agent_autoset_bodylen(agent);
+
+    return (true);
+}
@@ -0,0 +1,88 @@
+#ifndef _RPC_STATS_H_
+#define _RPC_STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rho/rho_decls.h>
+
+#include "rpc.h"
+
+RHO_DECLS_BEGIN
+
+/*
+ * SERVER STATISTICS
+ *
+ * A server keeps one rpc_stats, and tells it about its connections
+ * (rpc_stats_agent_add, rpc_stats_agent_del), each request as it becomes
+ * dispatchable (rpc_stats_request) and once its response is built
+ * (rpc_stats_done), and the time its loop spends doing work rather than
+ * waiting (rpc_stats_busy).
+ *
+ * A RPC_OP_STATS request, which rpc_stats_dispatch answers, returns a
+ * snapshot of these statistics; tools/rpcstat.py asks a running server for
+ * one.  The request has no body; the response body is, big-endian,
+ *
+ *      u32 version, u32 nstates, u32 nbuckets,
+ *      u64 uptime_ns, u64 busy_ns, u64 bytes_in, u64 bytes_out,
+ *      u64 body_bytes, u32 nagents, nstates * u32 nagents_in_state,
+ *      u64 nother, 9 * u64 io, u32 nops,
+ *      nops * { u32 code, u64 count, u64 nerrors, nbuckets * u64 }
+ *
+ * where nagents_in_state[i] counts the agents in state i + 1, body_bytes is
+ * the memory held by the agents' body buffers and mappings (but not those of
+ * agents that are DISPATCHABLE or in a HANDSHAKE, which a worker thread may
+ * be using), and nother counts the requests with opcodes that did not fit in
+ * the per-opcode table.  io is the sum of the agents' struct rpc_io_stats,
+ * past and present, in the struct's order.  Bucket 0 of an opcode's latency
+ * histogram counts requests answered in under 1 us; bucket i, those answered
+ * in [2^(i-1), 2^i) us; the last bucket has no upper bound.
+ */
+#define RPC_STATS_VERSION       2
+#define RPC_STATS_MAX_OPS       32
+#define RPC_STATS_NBUCKETS      24
+#define RPC_STATS_NSTATES       RPC_STATE_ERROR
+
+struct rpc_stats_op {
+    uint32_t    so_code;
+    uint64_t    so_count;
+    uint64_t    so_nerrors;     /* answered with a non-zero status */
+    uint64_t    so_hist[RPC_STATS_NBUCKETS];
+};
+
+struct rpc_stats {
+    uint64_t            st_start_ns;
+    uint64_t            st_busy_ns;
+    uint64_t            st_bytes_in;    /* headers and bodies */
+    uint64_t            st_bytes_out;
+
+    struct rpc_agent    **st_agents;
+    size_t              st_nagents;
+    size_t              st_cap;
+
+    struct rpc_io_stats st_io_closed;   /* of the agents deleted */
+
+    struct rpc_stats_op st_ops[RPC_STATS_MAX_OPS];
+    unsigned int        st_nops;
+    uint64_t            st_nother;
+};
+
+struct rpc_stats * rpc_stats_create(void);
+void rpc_stats_destroy(struct rpc_stats *stats);
+
+void rpc_stats_agent_add(struct rpc_stats *stats, struct rpc_agent *agent);
+void rpc_stats_agent_del(struct rpc_stats *stats, struct rpc_agent *agent);
+
+void rpc_stats_request(struct rpc_stats *stats, const struct rpc_agent *agent);
+void rpc_stats_done(struct rpc_stats *stats, const struct rpc_agent *agent,
+        uint32_t opcode);
+
+#define rpc_stats_busy(stats, ns) \
+    (stats)->st_busy_ns += (ns)
+
+bool rpc_stats_dispatch(struct rpc_stats *stats, struct rpc_agent *agent);
+
+RHO_DECLS_END
+
+#endif /* _RPC_STATS_H_ */
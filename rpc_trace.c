@@ -0,0 +1,169 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <rho/rho_log.h>
+#include <rho/rho_mem.h>
+
+#include "rpc.h"
+#include "rpc_trace.h"
+
+/*********************************************************
+ * CONSTRUCTOR / DESTRUCTOR
+ *********************************************************/
+/* the ring holds nevents (rounded up to a power of two) events */
+struct rpc_trace *
+rpc_trace_create(uint32_t nevents)
+{
+    struct rpc_trace *trace = NULL;
+    uint32_t size = 1;
+
+    RHO_ASSERT(nevents > 0 && nevents <= (1U << 31));
+
+    while (size < nevents)
+        size <<= 1;
+
+    trace = rhoL_zalloc(sizeof(*trace));
+    trace->tr_evs = rhoL_zalloc(size * sizeof(*trace->tr_evs));
+    trace->tr_mask = size - 1;
+
+    return (trace);
+}
+
+void
+rpc_trace_destroy(struct rpc_trace *trace)
+{
+    rhoL_free(trace->tr_evs);
+    rhoL_free(trace);
+}
+
+/*********************************************************
+ * RECORDING
+ *********************************************************/
+void
+rpc_trace_record(struct rpc_trace *trace, uint16_t type, uint8_t state,
+        uint8_t flags, uint32_t arg)
+{
+    struct rpc_trace_ev *ev = &trace->tr_evs[trace->tr_n & trace->tr_mask];
+
+    ev->te_ns = rpc_now_ns();
+    ev->te_arg = arg;
+    ev->te_type = type;
+    ev->te_state = state;
+    ev->te_flags = flags;
+    trace->tr_n++;
+}
+
+/*********************************************************
+ * CHROME TRACE (JSON) OUTPUT
+ *********************************************************/
+/*
+ * The output is a JSON array of trace events.  rpc_trace_json_begin writes
+ * the opening bracket and a first (metadata) event, which names process
+ * pid, so that every later event can be written with a leading comma.
+ */
+void
+rpc_trace_json_begin(FILE *fp, int pid)
+{
+    fprintf(fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":0,\"args\":{\"name\":\"librpc\"}}", pid);
+}
+
+void
+rpc_trace_json_end(FILE *fp)
+{
+    fprintf(fp, "\n]\n");
+    fflush(fp);
+}
+
+/* write s as a JSON string, quotes included */
+static void
+rpc_trace_json_str(FILE *fp, const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    fputc('"', fp);
+    for (; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+static double
+rpc_trace_us(uint64_t ns)
+{
+    return (ns / 1000.0);
+}
+
+/*
+ * Write trace's events as those of thread tid of process pid, naming the
+ * thread name (e.g., after the connection).  A state is drawn as a span
+ * from the event that entered it to the next state change (or the end of
+ * a rpc_agent_request); the last state, still open, is not drawn.
+ */
+void
+rpc_trace_json_write(const struct rpc_trace *trace, FILE *fp, int pid,
+        int tid, const char *name)
+{
+    uint64_t size = (uint64_t)trace->tr_mask + 1;
+    uint64_t first = trace->tr_n > size ? trace->tr_n - size : 0;
+    uint64_t i = 0;
+    uint64_t j = 0;
+    const struct rpc_trace_ev *ev = NULL;
+    const struct rpc_trace_ev *end = NULL;
+
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":", pid, tid);
+    rpc_trace_json_str(fp, name);
+    fprintf(fp, "}}");
+
+    for (i = first; i < trace->tr_n; i++) {
+        ev = &trace->tr_evs[i & trace->tr_mask];
+
+        switch (ev->te_type) {
+        case RPC_TRACE_STATE:
+            end = NULL;
+            for (j = i + 1; j < trace->tr_n && end == NULL; j++) {
+                end = &trace->tr_evs[j & trace->tr_mask];
+                if (end->te_type != RPC_TRACE_STATE &&
+                        end->te_type != RPC_TRACE_DONE)
+                    end = NULL;
+            }
+            if (end == NULL)
+                break;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"X\","
+                    "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"code\":%"PRIu32"}}",
+                    rpc_state_to_str(ev->te_state), pid, tid,
+                    rpc_trace_us(ev->te_ns),
+                    rpc_trace_us(end->te_ns - ev->te_ns), ev->te_arg);
+            break;
+        case RPC_TRACE_RECV:
+        case RPC_TRACE_SEND:
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"io\",\"ph\":\"i\","
+                    "\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"bytes\":%"PRIu32",\"partial\":%s,"
+                    "\"again\":%s}}",
+                    ev->te_type == RPC_TRACE_RECV ? "recv" : "send",
+                    pid, tid, rpc_trace_us(ev->te_ns), ev->te_arg,
+                    (ev->te_flags & RPC_TRACE_F_PARTIAL) ? "true" : "false",
+                    (ev->te_flags & RPC_TRACE_F_AGAIN) ? "true" : "false");
+            break;
+        case RPC_TRACE_DONE:
+            fprintf(fp, ",\n{\"name\":\"done\",\"cat\":\"rpc\",\"ph\":\"i\","
+                    "\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"code\":%"PRIu32"}}",
+                    pid, tid, rpc_trace_us(ev->te_ns), ev->te_arg);
+            break;
+        default:
+            break;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef _RPC_TRACE_H_
+#define _RPC_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <rho/rho_decls.h>
+
+RHO_DECLS_BEGIN
+
+/*
+ * TRACE RINGS
+ *
+ * An agent with tracing enabled (rpc_agent_set_trace) records a timestamped
+ * event for every state transition and every send or receive into a ring of
+ * fixed size; once full, the oldest events are overwritten.  Recording is a
+ * clock read and a 16-byte store, so it can be left on in production; with
+ * tracing off, it is a NULL test.
+ *
+ * A ring can be written out as Chrome trace (JSON array) events, which
+ * chrome://tracing and Perfetto display as one row per agent, with a span
+ * for each state and a mark for each send or receive.
+ */
+#define RPC_TRACE_STATE     1   /* te_arg is the message's code */
+#define RPC_TRACE_RECV      2   /* te_arg is the number of bytes */
+#define RPC_TRACE_SEND      3   /* te_arg is the number of bytes */
+#define RPC_TRACE_DONE      4   /* rpc_agent_request returned; te_arg: code */
+
+/* a send or receive moved fewer bytes than were wanted */
+#define RPC_TRACE_F_PARTIAL 0x01
+/* ... and, in fact, none: it would have blocked (EAGAIN) */
+#define RPC_TRACE_F_AGAIN   0x02
+
+struct rpc_trace_ev {
+    uint64_t    te_ns;      /* CLOCK_MONOTONIC */
+    uint32_t    te_arg;
+    uint16_t    te_type;    /* RPC_TRACE_* */
+    uint8_t     te_state;   /* agent's state, after a RPC_TRACE_STATE */
+    uint8_t     te_flags;   /* RPC_TRACE_F_* */
+};
+
+struct rpc_trace {
+    struct rpc_trace_ev *tr_evs;
+    uint32_t            tr_mask;    /* ring size - 1 */
+    uint64_t            tr_n;       /* events ever recorded */
+};
+
+struct rpc_trace * rpc_trace_create(uint32_t nevents);
+void rpc_trace_destroy(struct rpc_trace *trace);
+
+void rpc_trace_record(struct rpc_trace *trace, uint16_t type, uint8_t state,
+        uint8_t flags, uint32_t arg);
+
+void rpc_trace_json_begin(FILE *fp, int pid);
+void rpc_trace_json_write(const struct rpc_trace *trace, FILE *fp, int pid,
+        int tid, const char *name);
+void rpc_trace_json_end(FILE *fp);
+
+#define RPC_AGENT_TRACE(agent, type, flags, arg) \
+    do { \
+        if ((agent)->ra_trace != NULL) \
+            rpc_trace_record((agent)->ra_trace, (type), (agent)->ra_state, \
+                    (flags), (arg)); \
+    } while (0)
+
+RHO_DECLS_END
+
+#endif /* _RPC_TRACE_H_ */
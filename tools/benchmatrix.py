@@ -0,0 +1,499 @@
+#!/usr/bin/env python3
+"""
+benchmatrix: run rpccombinedbench over a matrix of configurations, and
+write the results as CSV and/or JSON.
+
+Each cell of the matrix is a payload size, an opcode (UPLOAD or DOWNLOAD), a
+transport (tcp, unix, or abstract unix), TLS on or off, and an AEAD cipher for
+record mode (rpccombinedbench -A), or off.  Each cell is run
+-r times; a run is one rpccombinedbench process, which runs its own server
+and forks its clients (--clients), each of which issues -n requests and
+reports their mean time.  A run's result is the mean of its clients' means;
+for each cell, the runs' results give the mean, standard deviation, and a 95%
+confidence interval.  --server-cpu and --client-cpus pin the processes.
+
+    benchmatrix.py -n 1000 -r 5 --csv results.csv --json results.json
+    benchmatrix.py -s 0,4K,1M -c DOWNLOAD -t unix,abstract --tls off
+    benchmatrix.py -s 64,1M -t tcp --tls on --aead off,aes-128-gcm
+
+With TLS on, an AEAD cell keys its cipher from the TLS handshake and then
+bypasses TLS, so comparing it with the cell that has the AEAD off compares
+record mode with TLS itself.
+
+TLS runs need the keying material that the README describes (root.crt,
+proc.crt, and proc.key) in --certs.  Every run gets its own port or socket
+path, so that one run's lingering socket can't disturb the next.
+
+Each client also times every RPC (rpccombinedbench -s), and the JSON output
+keeps up to --max-samples of those times per cell.  Given such a file as
+--baseline, benchmatrix reruns the baseline's configuration and compares each
+cell's per-RPC times with the baseline's by a one-sided Mann-Whitney U test.
+A cell has regressed if its times are significantly larger (p < --alpha) and
+its median is more than --threshold percent above the baseline's; if any cell
+has, benchmatrix exits 1.  --results compares a saved result instead of
+running anything.
+
+    benchmatrix.py -r 5 --json base.json                  # before a change
+    benchmatrix.py --baseline base.json --json new.json   # after it
+"""
+
+import argparse
+import csv
+import json
+import math
+import os
+import platform
+import random
+import re
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+BENCH_MAX_PAYLOAD_SIZE = 10 * 1024 * 1024
+
+DEFAULT_SIZES = '0,64,1K,4K,16K,64K,256K,1M,10M'
+OPS = ['UPLOAD', 'DOWNLOAD']
+TRANSPORTS = ['tcp', 'unix', 'abstract']
+AEADS = ['off', 'aes-128-gcm', 'aes-256-gcm', 'chacha20-poly1305']
+
+MEAN_RE = re.compile(r'^mean time for a BENCH_OP_(\w+) RPC of (\d+) bytes '
+                     r'\(based on (\d+) runs\): ([0-9.eE+-]+) s')
+IO_RE = re.compile(r'^per RPC: ([0-9.]+) syscalls')
+
+# two-sided 95% critical values of Student's t, by degrees of freedom
+T95 = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+       2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+       2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+       2.042]
+
+CSV_FIELDS = ['op', 'size', 'transport', 'tls', 'aead', 'runs', 'requests',
+              'mean_s', 'stdev_s', 'ci95_lo_s', 'ci95_hi_s', 'min_s', 'max_s',
+              'p50_s', 'p99_s', 'syscalls_per_rpc', 'failures']
+
+
+class MatrixError(Exception):
+    pass
+
+
+def parse_size(s):
+    s = s.strip().upper()
+    mult = 1
+    for suffix, m in (('K', 1024), ('M', 1024 * 1024)):
+        if s.endswith(suffix):
+            s = s[:-1]
+            mult = m
+            break
+    if not s.isdigit():
+        raise MatrixError('bad size: %s' % s)
+    size = int(s) * mult
+    if size > BENCH_MAX_PAYLOAD_SIZE:
+        raise MatrixError('size %d is over the 10 MiB limit' % size)
+    return size
+
+
+def parse_list(s, choices):
+    vals = [v.strip() for v in s.split(',') if v.strip()]
+    for v in vals:
+        if v not in choices:
+            raise MatrixError('%s is not one of %s' % (v, ', '.join(choices)))
+    return vals
+
+
+def summarize(samples):
+    """The mean, sample standard deviation, and 95% CI of samples."""
+    n = len(samples)
+    if n == 0:
+        return None, None, None, None
+    mean = sum(samples) / n
+    if n == 1:
+        return mean, 0.0, mean, mean
+    stdev = math.sqrt(sum((x - mean) ** 2 for x in samples) / (n - 1))
+    t = T95[n - 2] if n - 2 < len(T95) else 1.960
+    half = t * stdev / math.sqrt(n)
+    return mean, stdev, mean - half, mean + half
+
+
+def quantile(sorted_xs, q):
+    if not sorted_xs:
+        return None
+    return sorted_xs[min(len(sorted_xs) - 1, int(q * len(sorted_xs)))]
+
+
+def mann_whitney(xs, ys):
+    """
+    The one-sided p-value of the Mann-Whitney U test that xs tend to be
+    larger than ys, by the normal approximation (with corrections for ties
+    and continuity), which is sound for the hundreds of samples per cell.
+    """
+    n1 = len(xs)
+    n2 = len(ys)
+    n = n1 + n2
+    if n1 == 0 or n2 == 0:
+        return None
+
+    both = sorted([(x, 0) for x in xs] + [(y, 1) for y in ys])
+    r1 = 0.0
+    ties = 0.0
+    i = 0
+    while i < n:
+        j = i
+        while j < n and both[j][0] == both[i][0]:
+            j += 1
+        rank = (i + 1 + j) / 2.0    # the mean of ranks i+1..j
+        r1 += rank * sum(1 for k in range(i, j) if both[k][1] == 0)
+        t = j - i
+        ties += t ** 3 - t
+        i = j
+
+    u1 = r1 - n1 * (n1 + 1) / 2.0
+    mu = n1 * n2 / 2.0
+    var = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (u1 - mu - 0.5) / math.sqrt(var)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+class Runner(object):
+    def __init__(self, args):
+        self.args = args
+        self.seq = 0
+
+    def url(self, transport):
+        if transport == 'tcp':
+            return 'tcp://127.0.0.1:%d' % (self.args.port + self.seq), []
+        path = '/tmp/rpcbench.%d.%d' % (os.getpid(), self.seq)
+        if transport == 'abstract':
+            return 'unix://' + path, ['-a']
+        return 'unix://' + path, []
+
+    def command(self, op, size, transport, tls, aead, samples):
+        url, opts = self.url(transport)
+        cmd = [self.args.bench, '-c', op, '-n', str(self.args.clients),
+               '-s', samples] + opts
+        if self.args.server_cpu is not None:
+            cmd += ['-P', str(self.args.server_cpu)]
+        if self.args.client_cpus is not None:
+            cmd += ['-C', self.args.client_cpus]
+        if tls:
+            certs = self.args.certs
+            cmd += ['-Z', os.path.join(certs, 'root.crt'),
+                    os.path.join(certs, 'proc.crt'),
+                    os.path.join(certs, 'proc.key')]
+        if aead != 'off':
+            cmd += ['-A', aead]
+        cmd += [url, str(size), str(self.args.requests)]
+        return cmd
+
+    def run_once(self, op, size, transport, tls, aead):
+        """
+        Returns (mean seconds per RPC, syscalls per RPC or None, and the
+        list of per-RPC ns).
+        """
+        self.seq += 1
+        samples = '/tmp/rpcbench.%d.%d.samples' % (os.getpid(), self.seq)
+        cmd = self.command(op, size, transport, tls, aead, samples)
+        if self.args.verbose:
+            sys.stderr.write('+ %s\n' % ' '.join(cmd))
+        try:
+            proc = subprocess.run(cmd, stdout=subprocess.PIPE,
+                    stderr=subprocess.PIPE, timeout=self.args.timeout,
+                    universal_newlines=True)
+        except subprocess.TimeoutExpired:
+            raise MatrixError('timed out after %d s' % self.args.timeout)
+        try:
+            with open(samples) as f:
+                rpc_ns = [int(line) for line in f if line.strip()]
+            os.unlink(samples)
+        except (OSError, ValueError):
+            rpc_ns = []
+        if proc.returncode != 0:
+            lines = proc.stderr.strip().splitlines()
+            raise MatrixError('exited %d: %s' % (proc.returncode,
+                lines[-1] if lines else ''))
+
+        means = []
+        syscalls = []
+        for line in proc.stdout.splitlines():
+            m = MEAN_RE.match(line)
+            if m:
+                means.append(float(m.group(4)))
+            m = IO_RE.match(line)
+            if m:
+                syscalls.append(float(m.group(1)))
+        if len(means) != self.args.clients:
+            raise MatrixError('%d of %d clients reported a result' %
+                    (len(means), self.args.clients))
+        return (sum(means) / len(means),
+                sum(syscalls) / len(syscalls) if syscalls else None, rpc_ns)
+
+    def run_cell(self, op, size, transport, tls, aead):
+        samples = []
+        syscalls = []
+        rpc_ns = []
+        errors = []
+        for _ in range(self.args.repeat):
+            try:
+                mean, nsys, ns = self.run_once(op, size, transport, tls,
+                        aead)
+            except MatrixError as err:
+                errors.append(str(err))
+                continue
+            samples.append(mean)
+            if nsys is not None:
+                syscalls.append(nsys)
+            rpc_ns.extend(ns)
+
+        mean, stdev, lo, hi = summarize(samples)
+        rpc_ns.sort()
+        p50 = quantile(rpc_ns, 0.50)
+        p99 = quantile(rpc_ns, 0.99)
+        if len(rpc_ns) > self.args.max_samples:
+            # a fixed seed, so that reruns keep the same positions
+            rng = random.Random(0)
+            rpc_ns = sorted(rng.sample(rpc_ns, self.args.max_samples))
+        return {
+            'op': op,
+            'size': size,
+            'transport': transport,
+            'tls': tls,
+            'aead': aead,
+            'runs': len(samples),
+            'requests': self.args.requests,
+            'mean_s': mean,
+            'stdev_s': stdev,
+            'ci95_lo_s': lo,
+            'ci95_hi_s': hi,
+            'min_s': min(samples) if samples else None,
+            'max_s': max(samples) if samples else None,
+            'p50_s': p50 / 1e9 if p50 is not None else None,
+            'p99_s': p99 / 1e9 if p99 is not None else None,
+            'syscalls_per_rpc': (sum(syscalls) / len(syscalls)
+                if syscalls else None),
+            'failures': len(errors),
+            'errors': errors,
+            'samples_s': samples,
+            'rpc_ns': rpc_ns,
+        }
+
+
+def fmt_s(v):
+    return '-' if v is None else '%.3f' % (v * 1e6)
+
+
+def write_csv(path, cells):
+    with open(path, 'w', newline='') as f:
+        w = csv.DictWriter(f, fieldnames=CSV_FIELDS, extrasaction='ignore')
+        w.writeheader()
+        for cell in cells:
+            row = dict(cell)
+            row['tls'] = 'on' if cell['tls'] else 'off'
+            row['aead'] = cell.get('aead', 'off')
+            w.writerow(row)
+
+
+def cell_key(cell):
+    # results from before the aead axis ran without it
+    return (cell['op'], cell['size'], cell['transport'], cell['tls'],
+            cell.get('aead', 'off'))
+
+
+def compare(base_cells, cells, threshold, alpha, out):
+    """Prints the comparison; returns the number of regressed cells."""
+    base = dict((cell_key(c), c) for c in base_cells)
+    nregressed = 0
+    out.write('\n%-8s %9s %-9s %-4s %-17s %12s %12s %8s %10s  %s\n' % ('op',
+        'size', 'transport', 'tls', 'aead', 'base p50 us', 'new p50 us',
+        'change', 'p', 'verdict'))
+    for cell in cells:
+        old = base.get(cell_key(cell))
+        if old is None:
+            continue
+        xs = cell.get('rpc_ns') or []
+        ys = old.get('rpc_ns') or []
+        p = mann_whitney(xs, ys)
+        new_p50 = quantile(sorted(xs), 0.5)
+        old_p50 = quantile(sorted(ys), 0.5)
+        if p is None or not old_p50:
+            change = None
+            verdict = 'no samples'
+        else:
+            change = 100.0 * (new_p50 - old_p50) / old_p50
+            if p < alpha and change > threshold:
+                verdict = 'REGRESSED'
+                nregressed += 1
+            elif change < -threshold and mann_whitney(ys, xs) < alpha:
+                verdict = 'improved'
+            else:
+                verdict = 'same'
+        out.write('%-8s %9d %-9s %-4s %-17s %12s %12s %8s %10s  %s\n' % (
+            cell['op'], cell['size'], cell['transport'],
+            'on' if cell['tls'] else 'off', cell.get('aead', 'off'),
+            fmt_s(old_p50 / 1e9 if old_p50 is not None else None),
+            fmt_s(new_p50 / 1e9 if new_p50 is not None else None),
+            '-' if change is None else '%+.1f%%' % change,
+            '-' if p is None else '%.2g' % p, verdict))
+    return nregressed
+
+
+def write_json(path, args, cells):
+    doc = {
+        'host': platform.node(),
+        'platform': platform.platform(),
+        'cpus': os.cpu_count(),
+        'started': time.strftime('%Y-%m-%dT%H:%M:%S%z',
+            time.localtime(args.started)),
+        'bench': args.bench,
+        'requests': args.requests,
+        'repeat': args.repeat,
+        'clients': args.clients,
+        'server_cpu': args.server_cpu,
+        'client_cpus': args.client_cpus,
+        'cells': cells,
+    }
+    with open(path, 'w') as f:
+        json.dump(doc, f, indent=2)
+        f.write('\n')
+
+
+def load_json(path):
+    try:
+        with open(path) as f:
+            doc = json.load(f)
+    except (OSError, ValueError) as err:
+        raise MatrixError('%s: %s' % (path, err))
+    if 'cells' not in doc:
+        raise MatrixError('%s: not a benchmatrix result' % path)
+    return doc
+
+
+def run_matrix(runner, matrix):
+    cells = []
+    print('%-8s %9s %-9s %-4s %-17s %5s %12s %12s %25s' % ('op', 'size',
+        'transport', 'tls', 'aead', 'runs', 'mean us', 'stdev us',
+        '95% CI us'))
+    for op, size, transport, on, aead in matrix:
+        cell = runner.run_cell(op, size, transport, on, aead)
+        cells.append(cell)
+        ci = '-' if cell['runs'] == 0 else '%s-%s' % (
+                fmt_s(cell['ci95_lo_s']), fmt_s(cell['ci95_hi_s']))
+        print('%-8s %9d %-9s %-4s %-17s %5d %12s %12s %25s' % (
+            op, size, transport, 'on' if on else 'off', aead, cell['runs'],
+            fmt_s(cell['mean_s']), fmt_s(cell['stdev_s']), ci))
+        for err in cell['errors']:
+            sys.stderr.write('benchmatrix: %s %d %s tls=%s aead=%s: %s\n' %
+                    (op, size, transport, on, aead, err))
+        sys.stdout.flush()
+    return cells
+
+
+def main():
+    ap = argparse.ArgumentParser(
+            description='run rpccombinedbench over a matrix of configurations')
+    ap.add_argument('-b', '--bench',
+            default=os.path.join(HERE, '..', 'bench', 'rpccombinedbench'),
+            help='the rpccombinedbench binary')
+    ap.add_argument('-s', '--sizes', default=DEFAULT_SIZES,
+            help='payload sizes, in bytes, with optional K or M suffix '
+                 '(default: %(default)s)')
+    ap.add_argument('-c', '--ops', default=','.join(OPS),
+            help='opcodes (default: %(default)s)')
+    ap.add_argument('-t', '--transports', default=','.join(TRANSPORTS),
+            help='transports (default: %(default)s)')
+    ap.add_argument('--tls', default='off,on',
+            help='TLS settings to run (default: %(default)s)')
+    ap.add_argument('--aead', default='off',
+            help='AEAD record mode ciphers to run, or off '
+                 '(default: %(default)s)')
+    ap.add_argument('--certs', default=os.path.join(HERE, '..', 'bench'),
+            help='directory with root.crt, proc.crt and proc.key')
+    ap.add_argument('-n', '--requests', type=int, default=1000,
+            help='requests per run (default: %(default)s)')
+    ap.add_argument('-r', '--repeat', type=int, default=5,
+            help='runs per cell (default: %(default)s)')
+    ap.add_argument('--clients', type=int, default=1,
+            help='client processes per run (default: %(default)s)')
+    ap.add_argument('--server-cpu', type=int, default=None,
+            help='pin the server to this CPU')
+    ap.add_argument('--client-cpus', default=None,
+            help='pin the clients to these CPUs (e.g., 1 or 2,3)')
+    ap.add_argument('-p', '--port', type=int, default=9000,
+            help='tcp ports are allocated upward from this one')
+    ap.add_argument('--timeout', type=int, default=600,
+            help='seconds to allow each run (default: %(default)s)')
+    ap.add_argument('--max-samples', type=int, default=2000,
+            help='per-RPC times to keep per cell (default: %(default)s)')
+    ap.add_argument('--baseline', default=None,
+            help='rerun this JSON result\'s configuration, and compare')
+    ap.add_argument('--results', default=None,
+            help='with --baseline: compare this JSON result, not a new run')
+    ap.add_argument('--threshold', type=float, default=5.0,
+            help='median slowdown, in percent, that counts as a regression '
+                 '(default: %(default)s)')
+    ap.add_argument('--alpha', type=float, default=0.01,
+            help='significance level (default: %(default)s)')
+    ap.add_argument('--csv', default=None, help='write the cells as CSV')
+    ap.add_argument('--json', default=None, help='write the cells as JSON')
+    ap.add_argument('-v', '--verbose', action='store_true',
+            help='show each command as it runs')
+    args = ap.parse_args()
+    args.started = time.time()
+
+    base = None
+    cells = None
+    try:
+        if args.baseline is not None:
+            base = load_json(args.baseline)
+            args.requests = base['requests']
+            args.repeat = base['repeat']
+            args.clients = base.get('clients', 1)
+            args.server_cpu = base.get('server_cpu')
+            args.client_cpus = base.get('client_cpus')
+            matrix = [cell_key(c) for c in base['cells']]
+        else:
+            sizes = [parse_size(x) for x in args.sizes.split(',')
+                    if x.strip()]
+            ops = parse_list(args.ops.upper(), OPS)
+            transports = parse_list(args.transports, TRANSPORTS)
+            tls = [v == 'on' for v in parse_list(args.tls, ['off', 'on'])]
+            aeads = parse_list(args.aead.lower(), AEADS)
+            matrix = [(op, size, transport, on, aead) for op in ops
+                    for size in sizes for transport in transports
+                    for on in tls for aead in aeads]
+        if args.results is not None:
+            if base is None:
+                raise MatrixError('--results needs --baseline')
+            cells = load_json(args.results)['cells']
+        elif not os.access(args.bench, os.X_OK):
+            raise MatrixError('%s is not executable (build bench/ first)' %
+                    args.bench)
+        if args.requests <= 0 or args.repeat <= 0 or args.clients <= 0:
+            raise MatrixError('requests, repeat and clients must be positive')
+    except MatrixError as err:
+        sys.stderr.write('benchmatrix: %s\n' % err)
+        sys.exit(2)
+
+    if cells is None:
+        cells = run_matrix(Runner(args), matrix)
+
+    if args.csv is not None:
+        write_csv(args.csv, cells)
+    if args.json is not None:
+        write_json(args.json, args, cells)
+
+    status = 0
+    if any(cell['runs'] == 0 for cell in cells):
+        status = 1
+    if base is not None:
+        nregressed = compare(base['cells'], cells, args.threshold,
+                args.alpha, sys.stdout)
+        if nregressed > 0:
+            sys.stdout.write('\n%d of %d cells regressed by more than '
+                    '%g%%\n' % (nregressed, len(cells), args.threshold))
+            status = 1
+    sys.exit(status)
+
+if __name__ == '__main__':
+    main()
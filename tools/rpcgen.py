@@ -0,0 +1,658 @@
+#!/usr/bin/env python3
+"""
+rpcgen: generate typed librpc stubs and a server dispatcher from an
+interface definition.
+
+An interface definition looks like:
+
+    # comments start with '#' or '//'
+    prefix bench;
+
+    op UPLOAD = 0 {
+        request {
+            bytes payload;
+        }
+    }
+
+    op READ = 2 {
+        request {
+            u64 handle;
+            u32 size;
+        }
+        response {
+            u32 flags;
+            u8  tag[16];
+            bytes data;
+        }
+    }
+
+Field types are u8, u16, u32, u64, i8, i16, i32, i64, fixed-size u8 arrays
+(u8 name[N]), and bytes.  A bytes field must be the last field of a message;
+it takes up the rest of the body.  All integers are big-endian on the wire.
+
+For an interface with prefix P, rpcgen writes P_rpc.h and P_rpc.c, which
+define, for each op NAME:
+
+    P_OP_NAME                       the opcode
+    struct P_name_req/_resp         the host-order message (if it has fields)
+    P_name_req_encode/_decode       (and _resp_) body (de)serializers; a
+                                    decoder does a single length check
+    P_name()                        a client stub over rpc_agent_request()
+    P_name_reply()                  builds the response in a server handler
+
+and a server dispatcher, P_dispatch(), that switches on the opcode, decodes
+the request, and calls the handler in a struct P_ops.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+INT_TYPES = {
+    'u8':  ('uint8_t', 1, None),
+    'u16': ('uint16_t', 2, 'be16'),
+    'u32': ('uint32_t', 4, 'be32'),
+    'u64': ('uint64_t', 8, 'be64'),
+    'i8':  ('int8_t', 1, None),
+    'i16': ('int16_t', 2, 'be16'),
+    'i32': ('int32_t', 4, 'be32'),
+    'i64': ('int64_t', 8, 'be64'),
+}
+
+
+# opcodes from here up are reserved by librpc (see rpc.h)
+RPC_OP_RESERVED = 0xffff0000
+
+
+class IdlError(Exception):
+    pass
+
+
+class Field(object):
+    def __init__(self, ftype, name, count=None):
+        self.ftype = ftype
+        self.name = name
+        self.count = count
+
+    @property
+    def is_bytes(self):
+        return self.ftype == 'bytes'
+
+    @property
+    def is_array(self):
+        return self.count is not None
+
+
+class Message(object):
+    def __init__(self, fields):
+        self.fields = fields
+
+    @property
+    def fixed(self):
+        return [f for f in self.fields if not f.is_bytes]
+
+    @property
+    def tail(self):
+        if self.fields and self.fields[-1].is_bytes:
+            return self.fields[-1]
+        return None
+
+    @property
+    def empty(self):
+        return not self.fields
+
+
+class Op(object):
+    def __init__(self, name, code, request, response):
+        self.name = name
+        self.code = code
+        self.request = request
+        self.response = response
+
+    @property
+    def lname(self):
+        return self.name.lower()
+
+
+def tokenize(text):
+    text = re.sub(r'(#|//)[^\n]*', '', text)
+    return re.findall(r'[A-Za-z_][A-Za-z0-9_]*|0x[0-9A-Fa-f]+|\d+|[{}=;\[\]]',
+            text)
+
+
+class Parser(object):
+    def __init__(self, tokens):
+        self.tokens = tokens
+        self.i = 0
+
+    def peek(self):
+        if self.i < len(self.tokens):
+            return self.tokens[self.i]
+        return None
+
+    def next(self):
+        tok = self.peek()
+        if tok is None:
+            raise IdlError('unexpected end of input')
+        self.i += 1
+        return tok
+
+    def expect(self, want):
+        tok = self.next()
+        if tok != want:
+            raise IdlError('expected "%s", got "%s"' % (want, tok))
+
+    def ident(self):
+        tok = self.next()
+        if not re.match(r'[A-Za-z_][A-Za-z0-9_]*$', tok):
+            raise IdlError('expected an identifier, got "%s"' % tok)
+        return tok
+
+    def number(self):
+        tok = self.next()
+        try:
+            return int(tok, 0)
+        except ValueError:
+            raise IdlError('expected a number, got "%s"' % tok)
+
+    def parse(self):
+        prefix = None
+        ops = []
+        while self.peek() is not None:
+            tok = self.next()
+            if tok == 'prefix':
+                prefix = self.ident()
+                self.expect(';')
+            elif tok == 'op':
+                ops.append(self.parse_op())
+            else:
+                raise IdlError('unexpected "%s"' % tok)
+        if prefix is None:
+            raise IdlError('missing "prefix" declaration')
+        return prefix, ops
+
+    def parse_op(self):
+        name = self.ident()
+        self.expect('=')
+        code = self.number()
+        request = Message([])
+        response = Message([])
+        self.expect('{')
+        while self.peek() != '}':
+            which = self.next()
+            if which == 'request':
+                request = self.parse_message()
+            elif which == 'response':
+                response = self.parse_message()
+            else:
+                raise IdlError('expected "request" or "response" in op %s'
+                        % name)
+        self.expect('}')
+        if self.peek() == ';':
+            self.next()
+        return Op(name, code, request, response)
+
+    def parse_message(self):
+        fields = []
+        self.expect('{')
+        while self.peek() != '}':
+            ftype = self.next()
+            if ftype != 'bytes' and ftype not in INT_TYPES:
+                raise IdlError('unknown type "%s"' % ftype)
+            name = self.ident()
+            count = None
+            if self.peek() == '[':
+                if ftype != 'u8':
+                    raise IdlError('only u8 arrays are supported (%s)' % name)
+                self.next()
+                count = self.number()
+                self.expect(']')
+            self.expect(';')
+            if fields and fields[-1].is_bytes:
+                raise IdlError('bytes field "%s" must be last'
+                        % fields[-1].name)
+            fields.append(Field(ftype, name, count))
+        self.expect('}')
+        return Message(fields)
+
+
+def check(prefix, ops):
+    names = set()
+    codes = set()
+    for op in ops:
+        if op.name in names:
+            raise IdlError('duplicate op %s' % op.name)
+        if op.code in codes:
+            raise IdlError('duplicate opcode %d (op %s)' % (op.code, op.name))
+        if op.code < 0 or op.code >= RPC_OP_RESERVED:
+            raise IdlError('opcode of %s is not below 0x%08x (reserved)'
+                    % (op.name, RPC_OP_RESERVED))
+        names.add(op.name)
+        codes.add(op.code)
+
+
+class Emitter(object):
+    def __init__(self):
+        self.lines = []
+
+    def __call__(self, line=''):
+        self.lines.append(line)
+
+    def text(self):
+        return '\n'.join(self.lines) + '\n'
+
+
+def c_field_decl(f):
+    if f.is_bytes:
+        return ['const void *%s;' % f.name, 'size_t %s_len;' % f.name]
+    ctype = INT_TYPES[f.ftype][0]
+    if f.is_array:
+        return ['%s %s[%d];' % (ctype, f.name, f.count)]
+    return ['%s %s;' % (ctype, f.name)]
+
+
+def struct_name(prefix, op, kind):
+    return '%s_%s_%s' % (prefix, op.lname, kind)
+
+
+def emit_struct(e, prefix, op, kind, msg):
+    if msg.empty:
+        return
+    e('struct %s {' % struct_name(prefix, op, kind))
+    for f in msg.fields:
+        for d in c_field_decl(f):
+            e('    %s' % d)
+    e('};')
+    e()
+
+
+def emit_wire_struct(e, prefix, op, kind, msg):
+    if not msg.fixed:
+        return
+    e('struct %s_wire {' % struct_name(prefix, op, kind))
+    for f in msg.fixed:
+        for d in c_field_decl(f):
+            e('    %s' % d)
+    e('} __attribute__((packed));')
+    e()
+
+
+def codec_protos(prefix, op, kind, msg):
+    if msg.empty:
+        return []
+    sname = struct_name(prefix, op, kind)
+    return [
+        'void %s_encode(struct rho_buf *buf,\n        const struct %s *msg);'
+            % (sname, sname),
+        'int %s_decode(const void *body, size_t len,\n        struct %s *msg);'
+            % (sname, sname),
+    ]
+
+
+def emit_codec(e, prefix, op, kind, msg):
+    if msg.empty:
+        return
+    sname = struct_name(prefix, op, kind)
+    fixed = msg.fixed
+    tail = msg.tail
+
+    e('void')
+    e('%s_encode(struct rho_buf *buf, const struct %s *msg)' % (sname, sname))
+    e('{')
+    if fixed:
+        e('    struct %s_wire w;' % sname)
+        e()
+        for f in fixed:
+            conv = INT_TYPES[f.ftype][2]
+            if f.is_array:
+                e('    memcpy(w.%s, msg->%s, sizeof(w.%s));'
+                        % (f.name, f.name, f.name))
+            elif conv is None:
+                e('    w.%s = msg->%s;' % (f.name, f.name))
+            else:
+                e('    w.%s = hto%s(msg->%s);' % (f.name, conv, f.name))
+        e('    rho_buf_write(buf, &w, sizeof(w));')
+    if tail:
+        e('    if (msg->%s_len > 0)' % tail.name)
+        e('        rho_buf_write(buf, msg->%s, msg->%s_len);'
+                % (tail.name, tail.name))
+    e('}')
+    e()
+
+    e('int')
+    e('%s_decode(const void *body, size_t len, struct %s *msg)'
+            % (sname, sname))
+    e('{')
+    if fixed:
+        e('    struct %s_wire w;' % sname)
+        e()
+        if tail:
+            e('    if (len < sizeof(w))')
+        else:
+            e('    if (len != sizeof(w))')
+        e('        return (EPROTO);')
+        e()
+        e('    memcpy(&w, body, sizeof(w));')
+        for f in fixed:
+            conv = INT_TYPES[f.ftype][2]
+            if f.is_array:
+                e('    memcpy(msg->%s, w.%s, sizeof(w.%s));'
+                        % (f.name, f.name, f.name))
+            elif conv is None:
+                e('    msg->%s = w.%s;' % (f.name, f.name))
+            else:
+                e('    msg->%s = %stoh(w.%s);' % (f.name, conv, f.name))
+        if tail:
+            e('    msg->%s = (const uint8_t *)body + sizeof(w);' % tail.name)
+            e('    msg->%s_len = len - sizeof(w);' % tail.name)
+    else:
+        e('    msg->%s = body;' % tail.name)
+        e('    msg->%s_len = len;' % tail.name)
+    e()
+    e('    return (0);')
+    e('}')
+    e()
+
+
+def stub_proto(prefix, op):
+    args = ['struct rpc_agent *agent']
+    if not op.request.empty:
+        args.append('const struct %s *req'
+                % struct_name(prefix, op, 'req'))
+    if not op.response.empty:
+        args.append('struct %s *resp' % struct_name(prefix, op, 'resp'))
+    return 'int %s_%s(%s)' % (prefix, op.lname, ', '.join(args))
+
+
+def reply_proto(prefix, op):
+    args = ['struct rpc_agent *agent', 'uint32_t status']
+    if not op.response.empty:
+        args.append('const struct %s *resp'
+                % struct_name(prefix, op, 'resp'))
+    return 'void %s_%s_reply(%s)' % (prefix, op.lname, ', '.join(args))
+
+
+def handler_decl(prefix, op):
+    args = ['struct rpc_agent *agent']
+    if not op.request.empty:
+        args.append('const struct %s *req'
+                % struct_name(prefix, op, 'req'))
+    args.append('void *arg')
+    return 'void (*%s)(%s);' % (op.lname, ', '.join(args))
+
+
+def wrap_proto(proto, semicolon=True, split_type=False):
+    """break a prototype after the return type and at commas past 79 cols"""
+    ret, rest = proto.split(' ', 1)
+    if split_type:
+        head = ret + '\n'
+        line = rest
+    else:
+        head = ''
+        line = proto
+    out = []
+    parts = line.split(', ')
+    cur = parts[0]
+    for p in parts[1:]:
+        if len(cur) + len(p) + 3 > 79:
+            out.append(cur + ',')
+            cur = '        ' + p
+        else:
+            cur += ', ' + p
+    out.append(cur + (';' if semicolon else ''))
+    return head + '\n'.join(out)
+
+
+def gen_header(prefix, ops, srcname):
+    e = Emitter()
+    guard = '_%s_RPC_H_' % prefix.upper()
+    e('/* generated by rpcgen from %s; do not edit */' % srcname)
+    e()
+    e('#ifndef %s' % guard)
+    e('#define %s' % guard)
+    e()
+    e('#include <stddef.h>')
+    e('#include <stdint.h>')
+    e()
+    e('#include <rho/rho_decls.h>')
+    e()
+    e('#include <rho/rho_buf.h>')
+    e()
+    e('#include <rpc.h>')
+    e()
+    e('RHO_DECLS_BEGIN')
+    e()
+    width = max([len(op.name) for op in ops] + [0])
+    for op in ops:
+        e('#define %s_OP_%s %s%d' % (prefix.upper(), op.name,
+                ' ' * (width - len(op.name) + 4), op.code))
+    e()
+    for op in ops:
+        emit_struct(e, prefix, op, 'req', op.request)
+        emit_struct(e, prefix, op, 'resp', op.response)
+
+    for op in ops:
+        for p in codec_protos(prefix, op, 'req', op.request):
+            e(p)
+        for p in codec_protos(prefix, op, 'resp', op.response):
+            e(p)
+    e()
+
+    e('/* client stubs: return -1 on error, or else the response status */')
+    for op in ops:
+        e(wrap_proto(stub_proto(prefix, op)))
+    e()
+
+    e('/* server side */')
+    for op in ops:
+        e(wrap_proto(reply_proto(prefix, op)))
+    e()
+    e('struct %s_ops {' % prefix)
+    for op in ops:
+        e('    ' + wrap_proto(handler_decl(prefix, op), semicolon=False)
+                .replace('\n', '\n    '))
+    e('};')
+    e()
+    e('int %s_dispatch(struct rpc_agent *agent, const struct %s_ops *ops,'
+            % (prefix, prefix))
+    e('        void *arg);')
+    e()
+    e('RHO_DECLS_END')
+    e()
+    e('#endif /* %s */' % guard)
+    return e.text()
+
+
+def gen_source(prefix, ops, srcname, hdrname):
+    e = Emitter()
+    e('/* generated by rpcgen from %s; do not edit */' % srcname)
+    e()
+    e('#define _DEFAULT_SOURCE     /* htobe32 and friends */')
+    e()
+    e('#include <endian.h>')
+    e('#include <errno.h>')
+    e('#include <stddef.h>')
+    e('#include <stdint.h>')
+    e('#include <string.h>')
+    e()
+    e('#include <rho/rho_buf.h>')
+    e()
+    e('#include <rpc.h>')
+    e()
+    e('#include "%s"' % hdrname)
+    e()
+    for op in ops:
+        emit_wire_struct(e, prefix, op, 'req', op.request)
+        emit_wire_struct(e, prefix, op, 'resp', op.response)
+
+    e('/*********************************************************')
+    e(' * ENCODERS / DECODERS')
+    e(' *********************************************************/')
+    for op in ops:
+        emit_codec(e, prefix, op, 'req', op.request)
+        emit_codec(e, prefix, op, 'resp', op.response)
+
+    e('/*********************************************************')
+    e(' * CLIENT STUBS')
+    e(' *********************************************************/')
+    for op in ops:
+        e(wrap_proto(stub_proto(prefix, op), semicolon=False,
+                split_type=True))
+        e('{')
+        e('    uint32_t status = 0;')
+        e()
+        e('    rpc_agent_new_msg(agent, %s_OP_%s);' % (prefix.upper(), op.name))
+        if not op.request.empty:
+            e('    %s_encode(agent->ra_bodybuf, req);'
+                    % struct_name(prefix, op, 'req'))
+        e('    rpc_agent_autoset_bodylen(agent);')
+        e()
+        e('    if (rpc_agent_request(agent) == -1)')
+        e('        return (-1);')
+        e()
+        e('    status = agent->ra_hdr.rh_code;')
+        if not op.response.empty:
+            e('    if (status != 0)')
+            e('        return (status);')
+            e()
+            e('    if (%s_decode(rpc_agent_body(agent),'
+                    % struct_name(prefix, op, 'resp'))
+            e('                rpc_agent_get_bodylen(agent), resp) != 0) {')
+            e('        errno = EPROTO;')
+            e('        return (-1);')
+            e('    }')
+            e()
+        e('    return (status);')
+        e('}')
+        e()
+
+    e('/*********************************************************')
+    e(' * SERVER')
+    e(' *********************************************************/')
+    for op in ops:
+        e(wrap_proto(reply_proto(prefix, op), semicolon=False,
+                split_type=True))
+        e('{')
+        e('    rpc_agent_new_msg(agent, status);')
+        if not op.response.empty:
+            e('    if (status == 0)')
+            e('        %s_encode(agent->ra_bodybuf, resp);'
+                    % struct_name(prefix, op, 'resp'))
+        e('    rpc_agent_autoset_bodylen(agent);')
+        e('}')
+        e()
+
+    e('struct %s_dispatch_ctx {' % prefix)
+    e('    const struct %s_ops *ops;' % prefix)
+    e('    void *arg;')
+    e('};')
+    e()
+    e('static void')
+    e('%s_dispatch_op(struct rpc_agent *agent, void *arg)' % prefix)
+    e('{')
+    e('    struct %s_dispatch_ctx *ctx = arg;' % prefix)
+    e()
+    e('    (void)%s_dispatch(agent, ctx->ops, ctx->arg);' % prefix)
+    e('}')
+    e()
+    e('/*')
+    e(' * Decode the dispatchable request held by agent and pass it to the')
+    e(' * matching handler in ops, which must build the response (e.g., with')
+    e(' * the op\'s _reply function).  Compound requests are run operation by')
+    e(' * operation through this same function.  For an unknown or unhandled')
+    e(' * opcode, the response is ENOSYS; for a malformed body, EPROTO; and for')
+    e(' * a request whose deadline has already passed, ETIMEDOUT.')
+    e(' * Returns 0 or the error status of the response built here.  The caller')
+    e(' * then readies the agent to send, as usual.')
+    e(' */')
+    e('int')
+    e('%s_dispatch(struct rpc_agent *agent, const struct %s_ops *ops,'
+            % (prefix, prefix))
+    e('        void *arg)')
+    e('{')
+    e('    int error = 0;')
+    e('    const void *body = rpc_agent_body(agent);')
+    e('    size_t len = rpc_agent_get_bodylen(agent);')
+    e()
+    e('    (void)body;')
+    e('    (void)len;')
+    e()
+    e('    /* the caller has given up: don\'t spend anything more on it */')
+    e('    if (rpc_agent_deadline_expired(agent)) {')
+    e('        error = ETIMEDOUT;')
+    e('        goto fail;')
+    e('    }')
+    e()
+    e('    switch (agent->ra_hdr.rh_code) {')
+    for op in ops:
+        e('    case %s_OP_%s:' % (prefix.upper(), op.name))
+        e('        if (ops->%s == NULL)' % op.lname)
+        e('            break;')
+        if op.request.empty:
+            e('        if (len != 0) {')
+            e('            error = EPROTO;')
+            e('            goto fail;')
+            e('        }')
+            e('        ops->%s(agent, arg);' % op.lname)
+        else:
+            sname = struct_name(prefix, op, 'req')
+            e('        {')
+            e('            struct %s req;' % sname)
+            e()
+            e('            error = %s_decode(body, len, &req);' % sname)
+            e('            if (error != 0)')
+            e('                goto fail;')
+            e('            ops->%s(agent, &req, arg);' % op.lname)
+            e('        }')
+        e('        return (0);')
+    e('    case RPC_OP_COMPOUND:')
+    e('        {')
+    e('            struct %s_dispatch_ctx ctx = { ops, arg };' % prefix)
+    e()
+    e('            return (rpc_agent_dispatch_compound(agent, %s_dispatch_op,'
+            % prefix)
+    e('                        &ctx));')
+    e('        }')
+    e('    default:')
+    e('        break;')
+    e('    }')
+    e()
+    e('    error = ENOSYS;')
+    e()
+    e('fail:')
+    e('    rpc_agent_new_msg(agent, error);')
+    e('    return (error);')
+    e('}')
+    return e.text()
+
+
+def main():
+    ap = argparse.ArgumentParser(description='generate librpc stubs')
+    ap.add_argument('idl', help='interface definition file')
+    ap.add_argument('-o', '--outdir', default=None,
+            help='output directory (default: directory of IDL)')
+    args = ap.parse_args()
+
+    with open(args.idl) as f:
+        text = f.read()
+
+    try:
+        prefix, ops = Parser(tokenize(text)).parse()
+        check(prefix, ops)
+    except IdlError as err:
+        sys.stderr.write('%s: %s\n' % (args.idl, err))
+        sys.exit(1)
+
+    outdir = args.outdir or os.path.dirname(args.idl) or '.'
+    srcname = os.path.basename(args.idl)
+    hdrname = '%s_rpc.h' % prefix
+
+    with open(os.path.join(outdir, hdrname), 'w') as f:
+        f.write(gen_header(prefix, ops, srcname))
+    with open(os.path.join(outdir, '%s_rpc.c' % prefix), 'w') as f:
+        f.write(gen_source(prefix, ops, srcname, hdrname))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+"""
+rpcstat: ask a running librpc server for its statistics.
+
+rpcstat connects to the server's URL, as any client would, sends a single
+RPC_OP_STATS request, and prints the snapshot that the server returns (see
+rpc_stats.h for its contents and wire format) as text or, with -j, as JSON.
+
+    rpcstat.py unix:///tmp/foo
+    rpcstat.py -r root.crt -i bench/bench.rpc -j tcp://127.0.0.1:9000
+
+The server must answer RPC_OP_STATS requests with rpc_stats_dispatch (as
+rpcbenchserver does).  Given the server's interface definition (-i),
+rpcstat names the opcodes; otherwise it shows their numbers.
+"""
+
+import argparse
+import json
+import os
+import socket
+import ssl
+import struct
+import sys
+
+RPC_OP_COMPOUND = 0xffff0001
+RPC_OP_STATS = 0xffff0002
+
+RPC_HDR_FLAGS_MASK = 0xf0000000
+RPC_HDR_BODYLEN_MASK = 0x0fffffff
+RPC_HDR_F_MEMFD = 0x80000000
+
+RPC_STATS_VERSION = 2
+
+# struct rpc_io_stats, in order
+IO_FIELDS = ['nrecvs', 'nsends', 'bytes_in', 'bytes_out', 'nagain',
+             'npartial', 'npasses', 'nmsgs_in', 'nmsgs_out']
+
+# indexed by RPC_STATE_* - 1
+STATES = ['handshake', 'recv_hdr', 'recv_body', 'dispatchable', 'send_hdr',
+          'send_body', 'closed', 'error']
+
+
+class StatError(Exception):
+    pass
+
+
+def connect(url, abstract, cafile):
+    if url.startswith('unix://'):
+        path = url[len('unix://'):]
+        if abstract:
+            path = '\0' + path
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(path)
+        host = None
+    elif url.startswith('tcp://'):
+        host, _, port = url[len('tcp://'):].rpartition(':')
+        if not host or not port.isdigit():
+            raise StatError('bad URL: %s' % url)
+        sock = socket.create_connection((host, int(port)))
+    else:
+        raise StatError('unsupported URL: %s' % url)
+
+    if cafile is not None:
+        ctx = ssl.create_default_context(cafile=cafile)
+        ctx.check_hostname = False
+        sock = ctx.wrap_socket(sock)
+
+    return sock
+
+
+def recvn(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise StatError('server closed the connection')
+        data += chunk
+    return data
+
+
+def fetch(sock):
+    sock.sendall(struct.pack('>II', RPC_OP_STATS, 0))
+    code, word = struct.unpack('>II', recvn(sock, 8))
+    flags = word & RPC_HDR_FLAGS_MASK
+    bodylen = word & RPC_HDR_BODYLEN_MASK
+    if flags & RPC_HDR_F_MEMFD:
+        raise StatError('server sent the snapshot as a memfd')
+    if flags:
+        raise StatError('unexpected header flags 0x%08x' % flags)
+    if code != 0:
+        raise StatError('server answered %d (%s)' % (code,
+            os.strerror(code) if code < 4096 else 'unknown'))
+    return recvn(sock, bodylen)
+
+
+class Reader(object):
+    def __init__(self, data):
+        self.data = data
+        self.off = 0
+
+    def take(self, fmt):
+        size = struct.calcsize(fmt)
+        if self.off + size > len(self.data):
+            raise StatError('snapshot is truncated')
+        vals = struct.unpack_from(fmt, self.data, self.off)
+        self.off += size
+        return vals if len(vals) > 1 else vals[0]
+
+
+def decode(body, names):
+    r = Reader(body)
+    version, nstates, nbuckets = r.take('>III')
+    if version != RPC_STATS_VERSION:
+        raise StatError('unknown snapshot version %d' % version)
+
+    snap = {}
+    (snap['uptime_ns'], snap['busy_ns'], snap['bytes_in'], snap['bytes_out'],
+        snap['body_bytes']) = r.take('>QQQQQ')
+    snap['nagents'] = r.take('>I')
+    snap['states'] = {}
+    for i in range(nstates):
+        name = STATES[i] if i < len(STATES) else 'state%d' % (i + 1)
+        snap['states'][name] = r.take('>I')
+    snap['nother'] = r.take('>Q')
+    snap['io'] = dict(zip(IO_FIELDS, r.take('>' + 'Q' * len(IO_FIELDS))))
+    snap['ops'] = []
+    for _ in range(r.take('>I')):
+        code, count, nerrors = r.take('>IQQ')
+        hist = [r.take('>Q') for _ in range(nbuckets)]
+        snap['ops'].append({
+            'code': code,
+            'name': names.get(code, '%#x' % code),
+            'count': count,
+            'nerrors': nerrors,
+            'hist_us': hist,
+        })
+    return snap
+
+
+def op_names(idl):
+    names = {RPC_OP_COMPOUND: 'COMPOUND', RPC_OP_STATS: 'STATS'}
+    if idl is None:
+        return names
+
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    import rpcgen
+
+    with open(idl) as f:
+        text = f.read()
+    try:
+        _, ops = rpcgen.Parser(rpcgen.tokenize(text)).parse()
+    except rpcgen.IdlError as err:
+        raise StatError('%s: %s' % (idl, err))
+    for op in ops:
+        names[op.code] = op.name
+    return names
+
+
+def percentile(hist, q):
+    """The upper bound, in us, of the bucket holding the q-th quantile."""
+    total = sum(hist)
+    if total == 0:
+        return None
+    want = q * total
+    seen = 0
+    for i, n in enumerate(hist):
+        seen += n
+        if seen >= want:
+            return None if i == len(hist) - 1 else 1 << i
+    return None
+
+
+def fmt_us(us):
+    return '-' if us is None else '<%dus' % us
+
+
+def render_text(snap, out):
+    up = snap['uptime_ns'] / 1e9
+    busy = snap['busy_ns'] / 1e9
+    out.write('uptime %.3f s, loop busy %.3f s (%.1f%%)\n' %
+            (up, busy, 100.0 * busy / up if up > 0 else 0.0))
+    out.write('bytes in %d, out %d; bodies hold %d bytes\n' %
+            (snap['bytes_in'], snap['bytes_out'], snap['body_bytes']))
+    states = ', '.join('%s %d' % (k, v) for k, v in snap['states'].items()
+            if v > 0)
+    out.write('agents %d%s\n' % (snap['nagents'],
+            ': ' + states if states else ''))
+    io = snap['io']
+    if io['nmsgs_in'] > 0:
+        n = float(io['nmsgs_in'])
+        out.write('per request: %.2f recvs, %.2f sends, %.2f EAGAIN, '
+                '%.2f partial, %.2f passes\n' % (io['nrecvs'] / n,
+                    io['nsends'] / n, io['nagain'] / n, io['npartial'] / n,
+                    io['npasses'] / n))
+    if snap['nother'] > 0:
+        out.write('requests with untracked opcodes: %d\n' % snap['nother'])
+
+    if not snap['ops']:
+        return
+    out.write('\n%-16s %12s %10s %10s %10s\n' %
+            ('opcode', 'count', 'errors', 'p50', 'p99'))
+    for op in snap['ops']:
+        out.write('%-16s %12d %10d %10s %10s\n' % (op['name'], op['count'],
+            op['nerrors'], fmt_us(percentile(op['hist_us'], 0.5)),
+            fmt_us(percentile(op['hist_us'], 0.99))))
+
+
+def main():
+    ap = argparse.ArgumentParser(
+            description='show a running librpc server\'s statistics')
+    ap.add_argument('url',
+            help='server URL (e.g., unix:///tmp/foo, tcp://127.0.0.1:9000)')
+    ap.add_argument('-a', '--abstract', action='store_true',
+            help='treat a unix URL\'s path as an abstract socket')
+    ap.add_argument('-r', '--root-crt', default=None,
+            help='connect with TLS, trusting this CA certificate')
+    ap.add_argument('-i', '--idl', default=None,
+            help='the server\'s interface definition, to name opcodes')
+    ap.add_argument('-j', '--json', action='store_true',
+            help='print the snapshot as JSON')
+    args = ap.parse_args()
+
+    try:
+        names = op_names(args.idl)
+        sock = connect(args.url, args.abstract, args.root_crt)
+        try:
+            snap = decode(fetch(sock), names)
+        finally:
+            sock.close()
+    except (StatError, OSError) as err:
+        sys.stderr.write('rpcstat: %s\n' % err)
+        sys.exit(1)
+
+    if args.json:
+        json.dump(snap, sys.stdout, indent=2)
+        sys.stdout.write('\n')
+    else:
+        render_text(snap, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()